@@ -152,6 +152,59 @@ static_assert(
 static_assert(
     RTL_FIELD_SIZE(WG_IOCTL_ALLOWED_IP, Address) == RTL_FIELD_SIZE(WIREGUARD_ALLOWED_IP, Address),
     "AllowedIp->Address struct mismatch");
+static_assert(WG_IOCTL_ACL_MAX_RULES == WIREGUARD_ACL_MAX_RULES, "ACL max rules mismatch");
+static_assert(sizeof(WG_IOCTL_ACL_RULE) == sizeof(WIREGUARD_ACL_RULE), "ACL rule struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_ACL_RULE, Address) == offsetof(WIREGUARD_ACL_RULE, Address),
+    "AclRule->Address struct mismatch");
+static_assert(
+    RTL_FIELD_SIZE(WG_IOCTL_ACL_RULE, Address) == RTL_FIELD_SIZE(WIREGUARD_ACL_RULE, Address),
+    "AclRule->Address struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_ACL_RULE, AddressFamily) == offsetof(WIREGUARD_ACL_RULE, AddressFamily),
+    "AclRule->AddressFamily struct mismatch");
+static_assert(offsetof(WG_IOCTL_ACL_RULE, Cidr) == offsetof(WIREGUARD_ACL_RULE, Cidr), "AclRule->Cidr struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_ACL_RULE, Protocol) == offsetof(WIREGUARD_ACL_RULE, Protocol),
+    "AclRule->Protocol struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_ACL_RULE, PortLow) == offsetof(WIREGUARD_ACL_RULE, PortLow),
+    "AclRule->PortLow struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_ACL_RULE, PortHigh) == offsetof(WIREGUARD_ACL_RULE, PortHigh),
+    "AclRule->PortHigh struct mismatch");
+static_assert(sizeof(WG_IOCTL_PEER_ACL) == sizeof(WIREGUARD_PEER_ACL), "Peer ACL struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_ACL, PublicKey) == offsetof(WIREGUARD_PEER_ACL, PublicKey),
+    "PeerAcl->PublicKey struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_ACL, RulesCount) == offsetof(WIREGUARD_PEER_ACL, RulesCount),
+    "PeerAcl->RulesCount struct mismatch");
+static_assert(sizeof(WG_IOCTL_PEER_STATS) == sizeof(WIREGUARD_PEER_STATS), "Peer stats struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, PublicKey) == offsetof(WIREGUARD_PEER_STATS, PublicKey),
+    "PeerStats->PublicKey struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, LastHandshakeRtt) == offsetof(WIREGUARD_PEER_STATS, LastHandshakeRtt),
+    "PeerStats->LastHandshakeRtt struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, MinHandshakeRtt) == offsetof(WIREGUARD_PEER_STATS, MinHandshakeRtt),
+    "PeerStats->MinHandshakeRtt struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, SmoothedHandshakeRtt) == offsetof(WIREGUARD_PEER_STATS, SmoothedHandshakeRtt),
+    "PeerStats->SmoothedHandshakeRtt struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, StagedWaitTime) == offsetof(WIREGUARD_PEER_STATS, StagedWaitTime),
+    "PeerStats->StagedWaitTime struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, HandshakesCompleted) == offsetof(WIREGUARD_PEER_STATS, HandshakesCompleted),
+    "PeerStats->HandshakesCompleted struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, HandshakeRetransmits) == offsetof(WIREGUARD_PEER_STATS, HandshakeRetransmits),
+    "PeerStats->HandshakeRetransmits struct mismatch");
+static_assert(
+    offsetof(WG_IOCTL_PEER_STATS, CookieReplies) == offsetof(WIREGUARD_PEER_STATS, CookieReplies),
+    "PeerStats->CookieReplies struct mismatch");
 static_assert(sizeof(WG_IOCTL_ADAPTER_STATE) == sizeof(WIREGUARD_ADAPTER_STATE), "Adapter state mismatch");
 static_assert(WG_IOCTL_ADAPTER_STATE_DOWN == WIREGUARD_ADAPTER_STATE_DOWN, "Adapter state down mismatch");
 static_assert(WG_IOCTL_ADAPTER_STATE_UP == WIREGUARD_ADAPTER_STATE_UP, "Adapter state up mismatch");
@@ -244,3 +297,71 @@ WireGuardGetConfiguration(WIREGUARD_ADAPTER *Adapter, WIREGUARD_INTERFACE *Confi
     CloseHandle(ControlFile);
     return TRUE;
 }
+
+WIREGUARD_SET_PEER_ACL_FUNC WireGuardSetPeerAcl;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardSetPeerAcl(WIREGUARD_ADAPTER *Adapter, const WIREGUARD_PEER_ACL *Acl, DWORD Bytes)
+{
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD BytesReturned;
+    if (!DeviceIoControl(ControlFile, WG_IOCTL_SET_PEER_ACL, (VOID *)Acl, Bytes, NULL, 0, &BytesReturned, NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
+
+WIREGUARD_GET_PEER_ACL_FUNC WireGuardGetPeerAcl;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardGetPeerAcl(WIREGUARD_ADAPTER *Adapter, WIREGUARD_PEER_ACL *Acl, DWORD *Bytes)
+{
+    if (*Bytes < sizeof(*Acl))
+    {
+        *Bytes = sizeof(*Acl);
+        SetLastError(ERROR_MORE_DATA);
+        return FALSE;
+    }
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    if (!DeviceIoControl(ControlFile, WG_IOCTL_GET_PEER_ACL, Acl, sizeof(*Acl), Acl, *Bytes, Bytes, NULL))
+    {
+        DWORD LastError = GetLastError();
+        if (LastError == ERROR_MORE_DATA)
+            *Bytes = sizeof(*Acl) + Acl->RulesCount * sizeof(WIREGUARD_ACL_RULE);
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
+
+WIREGUARD_GET_PEER_STATS_FUNC WireGuardGetPeerStats;
+_Use_decl_annotations_
+BOOL WINAPI
+WireGuardGetPeerStats(WIREGUARD_ADAPTER *Adapter, WIREGUARD_PEER_STATS *Stats)
+{
+    HANDLE ControlFile = AdapterOpenDeviceObject(Adapter);
+    if (ControlFile == INVALID_HANDLE_VALUE)
+        return FALSE;
+    DWORD BytesReturned;
+    if (!DeviceIoControl(
+            ControlFile, WG_IOCTL_GET_PEER_STATS, Stats, sizeof(*Stats), Stats, sizeof(*Stats), &BytesReturned, NULL))
+    {
+        DWORD LastError = GetLastError();
+        CloseHandle(ControlFile);
+        SetLastError(LastError);
+        return FALSE;
+    }
+    CloseHandle(ControlFile);
+    return TRUE;
+}
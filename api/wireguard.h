@@ -303,6 +303,93 @@ BOOL(WINAPI WIREGUARD_GET_CONFIGURATION_FUNC)
  _Out_writes_bytes_all_(*Bytes) WIREGUARD_INTERFACE *Config,
  _Inout_ DWORD *Bytes);
 
+#define WIREGUARD_ACL_MAX_RULES 64
+
+typedef struct _WIREGUARD_ACL_RULE WIREGUARD_ACL_RULE;
+struct ALIGNED(8) _WIREGUARD_ACL_RULE
+{
+    union
+    {
+        IN_ADDR V4;
+        IN6_ADDR V6;
+    } Address;                    /**< IP address on this side of the tunnel */
+    ADDRESS_FAMILY AddressFamily; /**< Address family, either AF_INET or AF_INET6 */
+    BYTE Cidr;                    /**< CIDR of the address range */
+    BYTE Protocol;                /**< IPPROTO_* value, or 0 for any protocol */
+    WORD PortLow;                 /**< First port of the inclusive port range, in host byte order */
+    WORD PortHigh;                /**< Last port of the inclusive port range, in host byte order */
+};
+
+typedef struct _WIREGUARD_PEER_ACL WIREGUARD_PEER_ACL;
+struct ALIGNED(8) _WIREGUARD_PEER_ACL
+{
+    BYTE PublicKey[WIREGUARD_KEY_LENGTH]; /**< Public key of the peer */
+    DWORD RulesCount;                     /**< Number of ACL rule structs following this struct */
+};
+
+/**
+ * Sets the inner traffic ACL of a peer of the WireGuard adapter. Once a peer has any rules, only packets received from
+ * it with a destination, or sent to it with a source, that matches at least one rule are let through. The ACL is
+ * dropped when the peer is removed, including by WIREGUARD_INTERFACE_REPLACE_PEERS.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Acl           Peer ACL, followed by at most WIREGUARD_ACL_MAX_RULES rules, or by none to remove the ACL.
+ *
+ * @param Bytes         Number of bytes in Acl allocation.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_SET_PEER_ACL_FUNC)
+(_In_ WIREGUARD_ADAPTER_HANDLE Adapter, _In_reads_bytes_(Bytes) const WIREGUARD_PEER_ACL *Acl, _In_ DWORD Bytes);
+
+/**
+ * Gets the inner traffic ACL of a peer of the WireGuard adapter.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Acl           Peer ACL, with PublicKey set on input, and followed by its rules on output.
+ *
+ * @param Bytes         Pointer to number of bytes in Acl allocation.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError, which if ERROR_MORE_DATA, Bytes is updated with the
+ *         required size.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_GET_PEER_ACL_FUNC)
+(_In_ WIREGUARD_ADAPTER_HANDLE Adapter, _Inout_updates_bytes_(*Bytes) WIREGUARD_PEER_ACL *Acl, _Inout_ DWORD *Bytes);
+
+typedef struct _WIREGUARD_PEER_STATS WIREGUARD_PEER_STATS;
+struct ALIGNED(8) _WIREGUARD_PEER_STATS
+{
+    BYTE PublicKey[WIREGUARD_KEY_LENGTH]; /**< Public key of the peer */
+    DWORD64 LastHandshakeRtt;             /**< Round trip of the last handshake, in 100ns intervals, or 0 if none */
+    DWORD64 MinHandshakeRtt;              /**< Lowest handshake round trip, in 100ns intervals */
+    DWORD64 SmoothedHandshakeRtt;         /**< Handshake round trip moving average, in 100ns intervals */
+    DWORD64 StagedWaitTime;               /**< Time spent with packets staged but no session, in 100ns intervals */
+    DWORD HandshakesCompleted;            /**< Number of handshakes completed */
+    DWORD HandshakeRetransmits;           /**< Number of initiations sent again after going unanswered */
+    DWORD CookieReplies;                  /**< Number of times the peer was under load and sent a cookie */
+};
+
+/**
+ * Gets handshake statistics of a peer of the WireGuard adapter.
+ *
+ * @param Adapter       Adapter handle obtained with WireGuardCreateAdapter or WireGuardOpenAdapter
+ *
+ * @param Stats         Peer statistics, with PublicKey set on input.
+ *
+ * @return If the function succeeds, the return value is nonzero. If the function fails, the return value is zero. To
+ *         get extended error information, call GetLastError.
+ */
+typedef _Must_inspect_result_
+_Return_type_success_(return != FALSE)
+BOOL(WINAPI WIREGUARD_GET_PEER_STATS_FUNC)(_In_ WIREGUARD_ADAPTER_HANDLE Adapter, _Inout_ WIREGUARD_PEER_STATS *Stats);
+
 #pragma warning(pop)
 
 #ifdef __cplusplus
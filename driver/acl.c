@@ -0,0 +1,431 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "acl.h"
+#include "memory.h"
+#include "messages.h"
+
+/* Rules are compiled into a bit vector classifier. Each dimension of a packet (protocol, address, port) is cut into
+ * the elementary intervals that the rules' boundaries produce, and every interval records the set of rules that cover
+ * it, one bit per rule. Classifying is a binary search per dimension over small sorted arrays, followed by ANDing the
+ * three sets; any bit left standing means some rule matches.
+ */
+
+typedef UINT64 ACL_RULE_SET;
+static_assert(sizeof(ACL_RULE_SET) * 8 >= WG_IOCTL_ACL_MAX_RULES, "Rule set too small for maximum number of rules");
+
+enum ACL_VALUES
+{
+    ACL_MAX_INTERVALS = WG_IOCTL_ACL_MAX_RULES * 2 + 1,
+    ACL_MAX_EXTENSION_HEADERS = 8
+};
+
+struct _ACL_TABLE
+{
+    ACL_RULE_SET AnyProtocol, AllPorts;
+    ULONG NumProtocols, NumPorts, NumV4, NumV6;
+    UINT8 Protocols[WG_IOCTL_ACL_MAX_RULES];
+    ACL_RULE_SET ProtocolRules[WG_IOCTL_ACL_MAX_RULES];
+    UINT16 PortStarts[ACL_MAX_INTERVALS];
+    ACL_RULE_SET PortRules[ACL_MAX_INTERVALS];
+    UINT32 V4Starts[ACL_MAX_INTERVALS];
+    ACL_RULE_SET V4Rules[ACL_MAX_INTERVALS];
+    UINT64 V6Starts[ACL_MAX_INTERVALS][2];
+    ACL_RULE_SET V6Rules[ACL_MAX_INTERVALS];
+    ULONG NumRules;
+    WG_IOCTL_ACL_RULE Rules[WG_IOCTL_ACL_MAX_RULES]; /* As given, to be handed back by WG_IOCTL_GET_PEER_ACL. */
+    RCU_CALLBACK Rcu;
+};
+
+/* A point in any of the dimensions, wide enough for an IPv6 address. */
+typedef struct _ACL_KEY
+{
+    UINT64 Hi, Lo;
+} ACL_KEY;
+
+typedef struct _ACL_RANGE
+{
+    ACL_KEY Start, End;
+} ACL_RANGE;
+
+typedef enum _ACL_PORT_KIND
+{
+    ACL_PORT_KNOWN,
+    ACL_PORT_NONE,
+    ACL_PORT_UNKNOWN
+} ACL_PORT_KIND;
+
+static inline LONG
+KeyCompare(_In_ CONST ACL_KEY *A, _In_ CONST ACL_KEY *B)
+{
+    if (A->Hi != B->Hi)
+        return A->Hi < B->Hi ? -1 : 1;
+    if (A->Lo != B->Lo)
+        return A->Lo < B->Lo ? -1 : 1;
+    return 0;
+}
+
+/* Returns the key after End, or FALSE if End is the largest key of its dimension. */
+static inline BOOLEAN
+KeyAfter(_In_ CONST ACL_KEY *End, _In_ UINT64 HiMax, _In_ UINT64 LoMax, _Out_ ACL_KEY *Next)
+{
+    if (End->Hi == HiMax && End->Lo == LoMax)
+        return FALSE;
+    *Next = *End;
+    if (Next->Lo++ == MAXUINT64)
+        ++Next->Hi;
+    return TRUE;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static ULONG
+BuildIntervals(
+    _In_reads_(NumRules) CONST ACL_RANGE *Ranges,
+    _In_ ULONG NumRules,
+    _In_ ACL_RULE_SET Members,
+    _In_ UINT64 HiMax,
+    _In_ UINT64 LoMax,
+    _Out_writes_(ACL_MAX_INTERVALS) ACL_KEY *Starts,
+    _Out_writes_(ACL_MAX_INTERVALS) ACL_RULE_SET *Sets)
+{
+    ULONG Num = 0;
+
+    Starts[Num++] = (ACL_KEY){ 0 };
+    for (ULONG i = 0; i < NumRules; ++i)
+    {
+        if (!(Members & (1ULL << i)))
+            continue;
+        Starts[Num++] = Ranges[i].Start;
+        if (KeyAfter(&Ranges[i].End, HiMax, LoMax, &Starts[Num]))
+            ++Num;
+    }
+
+    /* Insertion sort, dropping duplicates, as there are never more than a hundred or so. */
+    ULONG Unique = 0;
+    for (ULONG i = 0; i < Num; ++i)
+    {
+        ACL_KEY Key = Starts[i];
+        ULONG j = Unique;
+        while (j && KeyCompare(&Starts[j - 1], &Key) > 0)
+            --j;
+        if (j && !KeyCompare(&Starts[j - 1], &Key))
+            continue;
+        RtlMoveMemory(&Starts[j + 1], &Starts[j], (Unique - j) * sizeof(*Starts));
+        Starts[j] = Key;
+        ++Unique;
+    }
+
+    for (ULONG i = 0; i < Unique; ++i)
+    {
+        Sets[i] = 0;
+        for (ULONG j = 0; j < NumRules; ++j)
+        {
+            if ((Members & (1ULL << j)) && KeyCompare(&Ranges[j].Start, &Starts[i]) <= 0 &&
+                KeyCompare(&Starts[i], &Ranges[j].End) <= 0)
+                Sets[i] |= 1ULL << j;
+        }
+    }
+    return Unique;
+}
+
+static inline BOOLEAN
+HasPorts(_In_ UINT8 Protocol)
+{
+    return Protocol == IPPROTO_TCP || Protocol == IPPROTO_UDP || Protocol == IPPROTO_SCTP;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+AclCompile(CONST WG_IOCTL_ACL_RULE *Rules, ULONG NumRules, ACL_TABLE **Acl)
+{
+    *Acl = NULL;
+    if (!NumRules || NumRules > WG_IOCTL_ACL_MAX_RULES)
+        return STATUS_INVALID_PARAMETER;
+
+    ACL_RANGE *Addresses = MemAllocateArray(NumRules, sizeof(*Addresses));
+    ACL_RANGE *Ports = MemAllocateArray(NumRules, sizeof(*Ports));
+    ACL_KEY *Starts = MemAllocateArray(ACL_MAX_INTERVALS, sizeof(*Starts));
+    ACL_TABLE *Table = MemAllocateAndZero(sizeof(*Table));
+    NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
+    if (!Addresses || !Ports || !Starts || !Table)
+        goto cleanup;
+
+    Status = STATUS_INVALID_PARAMETER;
+    ACL_RULE_SET V4Members = 0, V6Members = 0, AllMembers = 0;
+    for (ULONG i = 0; i < NumRules; ++i)
+    {
+        CONST WG_IOCTL_ACL_RULE *Rule = &Rules[i];
+        if (Rule->PortLow > Rule->PortHigh)
+            goto cleanup;
+        if (Rule->AddressFamily == AF_INET && Rule->Cidr <= 32)
+        {
+            UINT64 Mask = Rule->Cidr ? (~0ULL << (32 - Rule->Cidr)) & MAXUINT32 : 0;
+            UINT64 Addr = Be32ToCpu(*(CONST UINT32_BE *)&Rule->Address.V4) & Mask;
+            Addresses[i] = (ACL_RANGE){ .Start = { .Lo = Addr }, .End = { .Lo = Addr | (~Mask & MAXUINT32) } };
+            V4Members |= 1ULL << i;
+        }
+        else if (Rule->AddressFamily == AF_INET6 && Rule->Cidr <= 128)
+        {
+            UINT64 MaskHi = Rule->Cidr >= 64 ? MAXUINT64 : Rule->Cidr ? ~0ULL << (64 - Rule->Cidr) : 0;
+            UINT64 MaskLo = Rule->Cidr <= 64 ? 0 : ~0ULL << (128 - Rule->Cidr);
+            UINT64 Hi = Be64ToCpu(((CONST UINT64_BE *)&Rule->Address.V6)[0]) & MaskHi;
+            UINT64 Lo = Be64ToCpu(((CONST UINT64_BE *)&Rule->Address.V6)[1]) & MaskLo;
+            Addresses[i] = (ACL_RANGE){ .Start = { .Hi = Hi, .Lo = Lo },
+                                        .End = { .Hi = Hi | ~MaskHi, .Lo = Lo | ~MaskLo } };
+            V6Members |= 1ULL << i;
+        }
+        else
+            goto cleanup;
+        Ports[i] = (ACL_RANGE){ .Start = { .Lo = Rule->PortLow }, .End = { .Lo = Rule->PortHigh } };
+        AllMembers |= 1ULL << i;
+
+        if (Rule->PortLow == 0 && Rule->PortHigh == MAXUINT16)
+            Table->AllPorts |= 1ULL << i;
+        if (!Rule->Protocol)
+        {
+            Table->AnyProtocol |= 1ULL << i;
+            continue;
+        }
+        ULONG j;
+        for (j = 0; j < Table->NumProtocols && Table->Protocols[j] != Rule->Protocol; ++j)
+            ;
+        if (j == Table->NumProtocols)
+            Table->Protocols[Table->NumProtocols++] = Rule->Protocol;
+        Table->ProtocolRules[j] |= 1ULL << i;
+    }
+
+    Table->NumPorts = BuildIntervals(Ports, NumRules, AllMembers, 0, MAXUINT16, Starts, Table->PortRules);
+    for (ULONG i = 0; i < Table->NumPorts; ++i)
+        Table->PortStarts[i] = (UINT16)Starts[i].Lo;
+    Table->NumV4 = BuildIntervals(Addresses, NumRules, V4Members, 0, MAXUINT32, Starts, Table->V4Rules);
+    for (ULONG i = 0; i < Table->NumV4; ++i)
+        Table->V4Starts[i] = (UINT32)Starts[i].Lo;
+    Table->NumV6 = BuildIntervals(Addresses, NumRules, V6Members, MAXUINT64, MAXUINT64, Starts, Table->V6Rules);
+    for (ULONG i = 0; i < Table->NumV6; ++i)
+    {
+        Table->V6Starts[i][0] = Starts[i].Hi;
+        Table->V6Starts[i][1] = Starts[i].Lo;
+    }
+    Table->NumRules = NumRules;
+    RtlCopyMemory(Table->Rules, Rules, NumRules * sizeof(*Rules));
+
+    *Acl = Table;
+    Table = NULL;
+    Status = STATUS_SUCCESS;
+cleanup:
+    MemFree(Table);
+    MemFree(Starts);
+    MemFree(Ports);
+    MemFree(Addresses);
+    return Status;
+}
+
+_Use_decl_annotations_
+CONST WG_IOCTL_ACL_RULE *
+AclRules(CONST ACL_TABLE *Acl, ULONG *NumRules)
+{
+    *NumRules = Acl->NumRules;
+    return Acl->Rules;
+}
+
+_Use_decl_annotations_
+VOID
+AclFree(ACL_TABLE *Acl)
+{
+    MemFree(Acl);
+}
+
+_Use_decl_annotations_
+VOID
+AclFreeRcu(ACL_TABLE *Acl)
+{
+    if (Acl)
+        RcuFree(ACL_TABLE, Acl, Rcu);
+}
+
+/* Each of these returns the index of the last interval starting at or before the key. The first interval always
+ * starts at zero, so there is one as long as the dimension has any intervals at all.
+ */
+
+static inline ULONG
+FindPort(_In_ CONST ACL_TABLE *Acl, _In_ UINT16 Port)
+{
+    ULONG Low = 0, High = Acl->NumPorts;
+    while (High - Low > 1)
+    {
+        ULONG Mid = (Low + High) / 2;
+        if (Acl->PortStarts[Mid] <= Port)
+            Low = Mid;
+        else
+            High = Mid;
+    }
+    return Low;
+}
+
+static inline ULONG
+FindV4(_In_ CONST ACL_TABLE *Acl, _In_ UINT32 Addr)
+{
+    ULONG Low = 0, High = Acl->NumV4;
+    while (High - Low > 1)
+    {
+        ULONG Mid = (Low + High) / 2;
+        if (Acl->V4Starts[Mid] <= Addr)
+            Low = Mid;
+        else
+            High = Mid;
+    }
+    return Low;
+}
+
+static inline ULONG
+FindV6(_In_ CONST ACL_TABLE *Acl, _In_ UINT64 Hi, _In_ UINT64 Lo)
+{
+    ULONG Low = 0, High = Acl->NumV6;
+    while (High - Low > 1)
+    {
+        ULONG Mid = (Low + High) / 2;
+        if (Acl->V6Starts[Mid][0] < Hi || (Acl->V6Starts[Mid][0] == Hi && Acl->V6Starts[Mid][1] <= Lo))
+            Low = Mid;
+        else
+            High = Mid;
+    }
+    return Low;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+AclClassify(
+    _In_ CONST ACL_TABLE *Acl,
+    _In_ ADDRESS_FAMILY Family,
+    _In_ CONST ACL_KEY *Addr,
+    _In_ UINT8 Protocol,
+    _In_ ACL_PORT_KIND PortKind,
+    _In_ UINT16 Port)
+{
+    ACL_RULE_SET Set = Acl->AnyProtocol;
+    for (ULONG i = 0; i < Acl->NumProtocols; ++i)
+    {
+        if (Acl->Protocols[i] == Protocol)
+        {
+            Set |= Acl->ProtocolRules[i];
+            break;
+        }
+    }
+    if (!Set)
+        return FALSE;
+
+    if (Family == AF_INET && Acl->NumV4)
+        Set &= Acl->V4Rules[FindV4(Acl, (UINT32)Addr->Lo)];
+    else if (Family == AF_INET6 && Acl->NumV6)
+        Set &= Acl->V6Rules[FindV6(Acl, Addr->Hi, Addr->Lo)];
+    else
+        return FALSE;
+    if (!Set)
+        return FALSE;
+
+    if (PortKind == ACL_PORT_KNOWN)
+        Set &= Acl->PortRules[FindPort(Acl, Port)];
+    else if (PortKind == ACL_PORT_NONE)
+        Set &= Acl->AllPorts;
+    return Set != 0;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+CopyFromNetBuffer(_Out_writes_bytes_all_(Size) VOID *Dst, _In_ NET_BUFFER *Nb, _In_ ULONG Offset, _In_ ULONG Size)
+{
+    if (Offset > NET_BUFFER_DATA_LENGTH(Nb) || Size > NET_BUFFER_DATA_LENGTH(Nb) - Offset)
+        return FALSE;
+    return NT_SUCCESS(
+        MemCopyFromMdl(Dst, NET_BUFFER_CURRENT_MDL(Nb), NET_BUFFER_CURRENT_MDL_OFFSET(Nb) + Offset, Size));
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static BOOLEAN
+AclAllowsNetBuffer(_In_ CONST ACL_TABLE *Acl, _In_ NET_BUFFER *Nb, _In_ UINT16_BE Protocol, _In_ BOOLEAN Inbound)
+{
+    union
+    {
+        IPV4HDR V4;
+        IPV6HDR V6;
+    } Storage;
+    ADDRESS_FAMILY Family;
+    ACL_KEY Addr;
+    ULONG Offset;
+    UINT8 NextHeader;
+    BOOLEAN Fragment = FALSE;
+
+    if (Protocol == Htons(NDIS_ETH_TYPE_IPV4))
+    {
+        IPV4HDR *Hdr = NET_BUFFER_DATA_LENGTH(Nb) >= sizeof(*Hdr) ? NdisGetDataBuffer(Nb, sizeof(*Hdr), &Storage, 1, 0)
+                                                                   : NULL;
+        if (!Hdr || Hdr->Ihl < sizeof(*Hdr) / 4)
+            return FALSE;
+        Family = AF_INET;
+        Addr = (ACL_KEY){ .Lo = Be32ToCpu(Inbound ? Hdr->Daddr : Hdr->Saddr) };
+        NextHeader = Hdr->Protocol;
+        Offset = Hdr->Ihl * 4;
+        Fragment = (Ntohs(Hdr->FragOff) & 0x1fff) != 0;
+    }
+    else if (Protocol == Htons(NDIS_ETH_TYPE_IPV6))
+    {
+        IPV6HDR *Hdr = NET_BUFFER_DATA_LENGTH(Nb) >= sizeof(*Hdr) ? NdisGetDataBuffer(Nb, sizeof(*Hdr), &Storage, 1, 0)
+                                                                   : NULL;
+        if (!Hdr)
+            return FALSE;
+        CONST UINT64_BE *Words = (CONST UINT64_BE *)(Inbound ? &Hdr->Daddr : &Hdr->Saddr);
+        Family = AF_INET6;
+        Addr = (ACL_KEY){ .Hi = Be64ToCpu(Words[0]), .Lo = Be64ToCpu(Words[1]) };
+        NextHeader = Hdr->Nexthdr;
+        Offset = sizeof(*Hdr);
+        for (ULONG i = 0; i < ACL_MAX_EXTENSION_HEADERS; ++i)
+        {
+            UINT8 Ext[4];
+            if (NextHeader != IPPROTO_HOPOPTS && NextHeader != IPPROTO_ROUTING && NextHeader != IPPROTO_DSTOPTS &&
+                NextHeader != IPPROTO_FRAGMENT)
+                break;
+            if (!CopyFromNetBuffer(Ext, Nb, Offset, sizeof(Ext)))
+                return FALSE;
+            if (NextHeader == IPPROTO_FRAGMENT)
+            {
+                Fragment = (((ULONG)Ext[2] << 8 | Ext[3]) & ~7U) != 0;
+                Offset += 8;
+            }
+            else
+                Offset += ((ULONG)Ext[1] + 1) * 8;
+            NextHeader = Ext[0];
+        }
+    }
+    else
+        return FALSE;
+
+    if (Fragment)
+        return AclClassify(Acl, Family, &Addr, NextHeader, ACL_PORT_UNKNOWN, 0);
+    if (!HasPorts(NextHeader))
+        return AclClassify(Acl, Family, &Addr, NextHeader, ACL_PORT_NONE, 0);
+    UINT16_BE Ports[2];
+    if (!CopyFromNetBuffer(Ports, Nb, Offset, sizeof(Ports)))
+        return FALSE;
+    return AclClassify(Acl, Family, &Addr, NextHeader, ACL_PORT_KNOWN, Ntohs(Ports[Inbound ? 1 : 0]));
+}
+
+_Use_decl_annotations_
+BOOLEAN
+AclAllowsNetBufferList(CONST ACL_TABLE *Acl, NET_BUFFER_LIST *Nbl, UINT16_BE Protocol, BOOLEAN Inbound)
+{
+    for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
+    {
+        if (!AclAllowsNetBuffer(Acl, Nb, Protocol, Inbound))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+#ifdef DBG
+#    include "selftest/acl.c"
+#endif
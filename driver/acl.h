@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "rcu.h"
+#include "arithmetic.h"
+#include <ntifs.h> /* Must be included before <wdm.h> */
+#include <wdm.h>
+#include <wsk.h>
+#include <ndis.h>
+#include "ioctl.h"
+
+typedef struct _ACL_TABLE ACL_TABLE;
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+AclCompile(_In_reads_(NumRules) CONST WG_IOCTL_ACL_RULE *Rules, _In_ ULONG NumRules, _Out_ ACL_TABLE **Acl);
+
+/* Returns the rules that the table was compiled from. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Ret_writes_(*NumRules)
+CONST WG_IOCTL_ACL_RULE *
+AclRules(_In_ CONST ACL_TABLE *Acl, _Out_ ULONG *NumRules);
+
+/* Frees a table that no reader can see. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+AclFree(_In_opt_ __drv_freesMem(Mem) ACL_TABLE *Acl);
+
+/* Frees a table after all current RCU readers are done with it. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+AclFreeRcu(_In_opt_ __drv_freesMem(Mem) ACL_TABLE *Acl);
+
+/* Inbound packets are matched on their destination, outbound ones on their source, so that the same rules describe
+ * this side of the tunnel in both directions.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_rcu_held_
+_Must_inspect_result_
+BOOLEAN
+AclAllowsNetBufferList(
+    _In_ CONST ACL_TABLE *Acl,
+    _In_ NET_BUFFER_LIST *Nbl,
+    _In_ UINT16_BE Protocol,
+    _In_ BOOLEAN Inbound);
+
+#ifdef DBG
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+AclSelftest(VOID);
+#endif
@@ -10,7 +10,7 @@
 
 #define STACK_ENTRIES 129
 
-static LOOKASIDE_ALIGN LOOKASIDE_LIST_EX NodeCache;
+static LOOKASIDE_ALIGN MEM_CACHE NodeCache;
 
 static VOID
 SwapEndian(_Out_writes_bytes_all_(Bits / 8) UINT8 *Dst, _In_reads_bytes_(Bits / 8) CONST UINT8 *Src, _In_ UINT8 Bits)
@@ -67,7 +67,7 @@ _Use_decl_annotations_
 static VOID
 NodeFreeRcu(RCU_CALLBACK *Rcu)
 {
-    ExFreeToLookasideListEx(&NodeCache, CONTAINING_RECORD(Rcu, ALLOWEDIPS_NODE, Rcu));
+    MemCacheFree(&NodeCache, CONTAINING_RECORD(Rcu, ALLOWEDIPS_NODE, Rcu));
 }
 
 static RCU_CALLBACK_FN RootFreeRcu;
@@ -83,10 +83,19 @@ RootFreeRcu(RCU_CALLBACK *Rcu)
     {
         PushRcu(Stack, Node->Bit[0], &Len);
         PushRcu(Stack, Node->Bit[1], &Len);
-        ExFreeToLookasideListEx(&NodeCache, Node);
+        MemCacheFree(&NodeCache, Node);
     }
 }
 
+static VOID
+FreeDetached(_In_ WG_PEER *Peer)
+{
+    ALLOWEDIPS_NODE *Node, *Tmp;
+    LIST_FOR_EACH_ENTRY_SAFE (Node, Tmp, &Peer->AllowedIpsDetachedList, ALLOWEDIPS_NODE, PeerList)
+        RcuCall(&Node->Rcu, NodeFreeRcu);
+    InitializeListHead(&Peer->AllowedIpsDetachedList);
+}
+
 #pragma warning(suppress : 6262) /* Using 1044 bytes of stack is still below 1280. */
 static VOID
 RootRemovePeerLists(_In_ ALLOWEDIPS_NODE *Root)
@@ -97,8 +106,12 @@ RootRemovePeerLists(_In_ ALLOWEDIPS_NODE *Root)
     {
         PushRcu(Stack, Node->Bit[0], &Len);
         PushRcu(Stack, Node->Bit[1], &Len);
-        if (RcuAccessPointer(Node->Peer))
-            RemoveEntryList(&Node->PeerList);
+        if (!RcuAccessPointer(Node->Peer))
+            continue;
+        RemoveEntryList(&Node->PeerList);
+        /* This empties the list, so later absorbing nodes of the same peer find nothing left to do. */
+        if (Node->Flags & ALLOWEDIPS_NODE_ABSORBING)
+            FreeDetached(RcuAccessPointer(Node->Peer));
     }
 }
 
@@ -215,6 +228,219 @@ ChooseAndConnectNode(_Inout_ ALLOWEDIPS_NODE *Parent, _In_ __drv_aliasesMem ALLO
     ConnectNode(&Parent->Bit[Bit], Bit, Node);
 }
 
+static inline ALLOWEDIPS_NODE *
+ParentOf(_In_ CONST ALLOWEDIPS_NODE *Node)
+{
+    ALLOWEDIPS_NODE **ParentBit = (ALLOWEDIPS_NODE **)(Node->ParentBitPacked & ~(ULONG_PTR)3);
+    return (ALLOWEDIPS_NODE *)((UCHAR *)ParentBit - FIELD_OFFSET(ALLOWEDIPS_NODE, Bit[Node->ParentBitPacked & 1]));
+}
+
+/* Puts Newnode into the trie below Parent, as found by NodePlacement, which must not have been an exact match. */
+_Requires_lock_held_(Lock)
+static NTSTATUS
+Link(_Inout_ ALLOWEDIPS_NODE __rcu **Trie,
+     _In_ UINT8 Bits,
+     _In_opt_ ALLOWEDIPS_NODE *Parent,
+     _Inout_ ALLOWEDIPS_NODE *Newnode,
+     _In_ EX_PUSH_LOCK *Lock)
+{
+    ALLOWEDIPS_NODE *Node, *Down;
+    UINT8 Cidr;
+
+    if (!Parent)
+    {
+        Down = RcuDereferenceProtected(ALLOWEDIPS_NODE, *Trie, Lock);
+    }
+    else
+    {
+        CONST UINT8 Bit = Choose(Parent, Newnode->Bits);
+        Down = RcuDereferenceProtected(ALLOWEDIPS_NODE, Parent->Bit[Bit], Lock);
+        if (!Down)
+        {
+            ConnectNode(&Parent->Bit[Bit], Bit, Newnode);
+            return STATUS_SUCCESS;
+        }
+    }
+    Cidr = min(Newnode->Cidr, CommonBits(Down, Newnode->Bits, Bits));
+
+    if (Newnode->Cidr == Cidr)
+    {
+        ChooseAndConnectNode(Newnode, Down);
+        if (!Parent)
+            ConnectNode(Trie, 2, Newnode);
+        else
+            ChooseAndConnectNode(Parent, Newnode);
+        return 0;
+    }
+
+    Node = MemCacheAllocate(&NodeCache);
+    if (!Node)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(Node, sizeof(*Node));
+    InitializeListHead(&Node->PeerList);
+    CopyAndAssignCidr(Node, Newnode->Bits, Cidr, Bits);
+
+    ChooseAndConnectNode(Node, Down);
+    ChooseAndConnectNode(Node, Newnode);
+    if (!Parent)
+        ConnectNode(Trie, 2, Node);
+    else
+        ChooseAndConnectNode(Parent, Node);
+    return STATUS_SUCCESS;
+}
+
+/* Aggregation: once every address below a node resolves to that node's own peer, whatever hangs below it only costs
+ * lookups depth and cache misses. Collapse() cuts the subtree off, frees its branches and aggregates, and moves the
+ * peer's entries over to its AllowedIpsDetachedList, so that they are still reported by the ioctl, still go away with
+ * the peer, and can be linked back in by Expand() when another peer's entry has to go below the node.
+ */
+#pragma warning(suppress : 6262) /* Using 1044 bytes of stack is still below 1280. */
+_Requires_lock_held_(Lock)
+static VOID
+Collapse(_Inout_ ALLOWEDIPS_NODE *Node, _In_ EX_PUSH_LOCK *Lock)
+{
+    WG_PEER *Peer = RcuDereferenceProtected(WG_PEER, Node->Peer, Lock);
+    ALLOWEDIPS_NODE *Child, *Stack[STACK_ENTRIES];
+    ULONG Len = 0;
+
+    PushRcu(Stack, Node->Bit[0], &Len);
+    PushRcu(Stack, Node->Bit[1], &Len);
+    RcuInitPointer(Node->Bit[0], NULL);
+    RcuInitPointer(Node->Bit[1], NULL);
+    Node->Flags |= ALLOWEDIPS_NODE_ABSORBING;
+    while (Len > 0)
+    {
+        Child = Stack[--Len];
+        PushRcu(Stack, Child->Bit[0], &Len);
+        PushRcu(Stack, Child->Bit[1], &Len);
+        if (Child->Flags & ALLOWEDIPS_NODE_AGGREGATE)
+            RemoveEntryList(&Child->PeerList);
+        else if (RcuAccessPointer(Child->Peer))
+        {
+            /* Lookups still inside of the subtree find the same peer here as they would have above. */
+            RcuInitPointer(Child->Bit[0], NULL);
+            RcuInitPointer(Child->Bit[1], NULL);
+            Child->Flags = ALLOWEDIPS_NODE_DETACHED;
+            RemoveEntryList(&Child->PeerList);
+            InsertTailList(&Peer->AllowedIpsDetachedList, &Child->PeerList);
+            continue;
+        }
+        RcuCall(&Child->Rcu, NodeFreeRcu);
+    }
+}
+
+/* Absorbs Node into its parent for as long as its sibling is a leaf of the same peer and the parent is free to take
+ * over both halves. Only leaves are merged, so nothing of another peer is ever hidden underneath. */
+_Requires_lock_held_(Lock)
+static VOID
+Merge(_In_ ALLOWEDIPS_NODE *Node, _In_ EX_PUSH_LOCK *Lock)
+{
+    WG_PEER *Peer = RcuDereferenceProtected(WG_PEER, Node->Peer, Lock);
+
+    while (Peer && (Node->ParentBitPacked & 3) <= 1 && !RcuAccessPointer(Node->Bit[0]) &&
+           !RcuAccessPointer(Node->Bit[1]))
+    {
+        ALLOWEDIPS_NODE *Parent = ParentOf(Node);
+        ALLOWEDIPS_NODE *Sibling =
+            RcuDereferenceProtected(ALLOWEDIPS_NODE, Parent->Bit[!(Node->ParentBitPacked & 1)], Lock);
+        WG_PEER *ParentPeer = RcuDereferenceProtected(WG_PEER, Parent->Peer, Lock);
+
+        if (Parent->Cidr + 1U != Node->Cidr || !Sibling || Sibling->Cidr != Node->Cidr ||
+            RcuAccessPointer(Sibling->Peer) != Peer || RcuAccessPointer(Sibling->Bit[0]) ||
+            RcuAccessPointer(Sibling->Bit[1]) || (ParentPeer && ParentPeer != Peer))
+            break;
+        if (!ParentPeer)
+        {
+            /* Publish the covering peer before the halves are cut off, so that lookups never come up empty. */
+            RcuAssignPointer(Parent->Peer, Peer);
+            InsertTailList(&Peer->AllowedIpsList, &Parent->PeerList);
+            Parent->Flags |= ALLOWEDIPS_NODE_AGGREGATE;
+        }
+        Collapse(Parent, Lock);
+        Node = Parent;
+    }
+}
+
+/* Links the detached entries below an absorbing node back into the trie, turning an aggregate back into a branch. */
+_Requires_lock_held_(Lock)
+static NTSTATUS
+Expand(_Inout_ ALLOWEDIPS_NODE __rcu **Trie, _Inout_ ALLOWEDIPS_NODE *Node, _In_ EX_PUSH_LOCK *Lock)
+{
+    WG_PEER *Peer = RcuDereferenceProtected(WG_PEER, Node->Peer, Lock);
+    ALLOWEDIPS_NODE *Entry, *Tmp, *Parent;
+    NTSTATUS Status;
+
+    LIST_FOR_EACH_ENTRY_SAFE (Entry, Tmp, &Peer->AllowedIpsDetachedList, ALLOWEDIPS_NODE, PeerList)
+    {
+        if (Entry->Bitlen != Node->Bitlen || Entry->Cidr <= Node->Cidr ||
+            !PrefixMatches(Node, Entry->Bits, Node->Bitlen))
+            continue;
+        Entry->Flags = 0;
+        RemoveEntryList(&Entry->PeerList);
+        InsertTailList(&Peer->AllowedIpsList, &Entry->PeerList);
+        if (NodePlacement(*Trie, Entry->Bits, Entry->Cidr, Node->Bitlen, &Parent, Lock))
+        {
+            /* Nothing but branches can be in the way, so the entry simply takes the branch's place. */
+            for (UINT8 Bit = 0; Bit < 2; ++Bit)
+            {
+                ALLOWEDIPS_NODE *Child = RcuDereferenceProtected(ALLOWEDIPS_NODE, Parent->Bit[Bit], Lock);
+                if (Child)
+                    ConnectNode(&Entry->Bit[Bit], Bit, Child);
+            }
+            ConnectNode(
+                (ALLOWEDIPS_NODE **)(Parent->ParentBitPacked & ~(ULONG_PTR)3),
+                (UINT8)(Parent->ParentBitPacked & 3),
+                Entry);
+            RcuCall(&Parent->Rcu, NodeFreeRcu);
+            continue;
+        }
+        Status = Link(Trie, Node->Bitlen, Parent, Entry, Lock);
+        if (!NT_SUCCESS(Status))
+        {
+            Entry->Flags = ALLOWEDIPS_NODE_DETACHED;
+            RemoveEntryList(&Entry->PeerList);
+            InsertTailList(&Peer->AllowedIpsDetachedList, &Entry->PeerList);
+            Collapse(Node, Lock);
+            return Status;
+        }
+    }
+    Node->Flags &= ~ALLOWEDIPS_NODE_ABSORBING;
+    if (Node->Flags & ALLOWEDIPS_NODE_AGGREGATE)
+    {
+        Node->Flags = 0;
+        RemoveEntryList(&Node->PeerList);
+        InitializeListHead(&Node->PeerList);
+        RcuInitPointer(Node->Peer, NULL);
+    }
+    return STATUS_SUCCESS;
+}
+
+/* Records an entry of a peer that falls below one of its absorbing nodes, which leaves lookups as they are. */
+static NTSTATUS
+AddDetached(_In_ UINT8 Bits, _In_ CONST UINT8 *Key, _In_ UINT8 Cidr, _In_ WG_PEER *Peer)
+{
+    ALLOWEDIPS_NODE *Node;
+
+    LIST_FOR_EACH_ENTRY (Node, &Peer->AllowedIpsDetachedList, ALLOWEDIPS_NODE, PeerList)
+    {
+        if (Node->Bitlen == Bits && Node->Cidr == Cidr && PrefixMatches(Node, Key, Bits))
+        {
+            RemoveEntryList(&Node->PeerList);
+            InsertTailList(&Peer->AllowedIpsDetachedList, &Node->PeerList);
+            return STATUS_SUCCESS;
+        }
+    }
+    Node = MemCacheAllocate(&NodeCache);
+    if (!Node)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlZeroMemory(Node, sizeof(*Node));
+    RcuInitPointer(Node->Peer, Peer);
+    Node->Flags = ALLOWEDIPS_NODE_DETACHED;
+    InsertTailList(&Peer->AllowedIpsDetachedList, &Node->PeerList);
+    CopyAndAssignCidr(Node, Key, Cidr, Bits);
+    return STATUS_SUCCESS;
+}
+
 _Requires_lock_held_(Lock)
 static NTSTATUS
 Add(_Inout_ ALLOWEDIPS_NODE __rcu **Trie,
@@ -224,14 +450,16 @@ Add(_Inout_ ALLOWEDIPS_NODE __rcu **Trie,
     _In_ WG_PEER *Peer,
     _In_ EX_PUSH_LOCK *Lock)
 {
-    ALLOWEDIPS_NODE *Node, *Parent, *Down, *Newnode;
+    ALLOWEDIPS_NODE *Node, *Newnode;
+    BOOLEAN Exact;
+    NTSTATUS Status;
 
     if (Cidr > Bits || !Peer)
         return STATUS_INVALID_PARAMETER;
 
     if (!RcuAccessPointer(*Trie))
     {
-        Node = ExAllocateFromLookasideListEx(&NodeCache);
+        Node = MemCacheAllocate(&NodeCache);
         if (!Node)
             return STATUS_INSUFFICIENT_RESOURCES;
         RtlZeroMemory(Node, sizeof(*Node));
@@ -241,15 +469,33 @@ Add(_Inout_ ALLOWEDIPS_NODE __rcu **Trie,
         ConnectNode(Trie, 2, Node);
         return STATUS_SUCCESS;
     }
-    if (NodePlacement(*Trie, Key, Cidr, Bits, &Node, Lock))
+    Exact = NodePlacement(*Trie, Key, Cidr, Bits, &Node, Lock);
+    if (Node && (Node->Flags & ALLOWEDIPS_NODE_ABSORBING))
+    {
+        if (RcuDereferenceProtected(WG_PEER, Node->Peer, Lock) == Peer)
+        {
+            if (!Exact)
+                return AddDetached(Bits, Key, Cidr, Peer);
+            Node->Flags &= ~ALLOWEDIPS_NODE_AGGREGATE;
+            RemoveEntryList(&Node->PeerList);
+            InsertTailList(&Peer->AllowedIpsList, &Node->PeerList);
+            return STATUS_SUCCESS;
+        }
+        Status = Expand(Trie, Node, Lock);
+        if (!NT_SUCCESS(Status))
+            return Status;
+        Exact = NodePlacement(*Trie, Key, Cidr, Bits, &Node, Lock);
+    }
+    if (Exact)
     {
         RcuAssignPointer(Node->Peer, Peer);
         RemoveEntryList(&Node->PeerList);
         InsertTailList(&Peer->AllowedIpsList, &Node->PeerList);
+        Merge(Node, Lock);
         return STATUS_SUCCESS;
     }
 
-    Newnode = ExAllocateFromLookasideListEx(&NodeCache);
+    Newnode = MemCacheAllocate(&NodeCache);
     if (!Newnode)
         return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(Newnode, sizeof(*Newnode));
@@ -257,50 +503,14 @@ Add(_Inout_ ALLOWEDIPS_NODE __rcu **Trie,
     InsertTailList(&Peer->AllowedIpsList, &Newnode->PeerList);
     CopyAndAssignCidr(Newnode, Key, Cidr, Bits);
 
-    if (!Node)
-    {
-        Down = RcuDereferenceProtected(ALLOWEDIPS_NODE, *Trie, Lock);
-    }
-    else
-    {
-        CONST UINT8 Bit = Choose(Node, Key);
-        Down = RcuDereferenceProtected(ALLOWEDIPS_NODE, Node->Bit[Bit], Lock);
-        if (!Down)
-        {
-            ConnectNode(&Node->Bit[Bit], Bit, Newnode);
-            return STATUS_SUCCESS;
-        }
-    }
-    Cidr = min(Cidr, CommonBits(Down, Key, Bits));
-    Parent = Node;
-
-    if (Newnode->Cidr == Cidr)
-    {
-        ChooseAndConnectNode(Newnode, Down);
-        if (!Parent)
-            ConnectNode(Trie, 2, Newnode);
-        else
-            ChooseAndConnectNode(Parent, Newnode);
-        return 0;
-    }
-
-    Node = ExAllocateFromLookasideListEx(&NodeCache);
-    if (!Node)
+    Status = Link(Trie, Bits, Node, Newnode, Lock);
+    if (!NT_SUCCESS(Status))
     {
         RemoveEntryList(&Newnode->PeerList);
-        ExFreeToLookasideListEx(&NodeCache, Newnode);
-        return STATUS_INSUFFICIENT_RESOURCES;
+        MemCacheFree(&NodeCache, Newnode);
+        return Status;
     }
-    RtlZeroMemory(Node, sizeof(*Node));
-    InitializeListHead(&Node->PeerList);
-    CopyAndAssignCidr(Node, Newnode->Bits, Cidr, Bits);
-
-    ChooseAndConnectNode(Node, Down);
-    ChooseAndConnectNode(Node, Newnode);
-    if (!Parent)
-        ConnectNode(Trie, 2, Node);
-    else
-        ChooseAndConnectNode(Parent, Node);
+    Merge(Newnode, Lock);
     return STATUS_SUCCESS;
 }
 
@@ -368,11 +578,13 @@ AllowedIpsRemoveByPeer(ALLOWEDIPS_TABLE *Table, WG_PEER *Peer, EX_PUSH_LOCK *Loc
     if (IsListEmpty(&Peer->AllowedIpsList))
         return;
     ++Table->Seq;
+    FreeDetached(Peer);
     LIST_FOR_EACH_ENTRY_SAFE (Node, Tmp, &Peer->AllowedIpsList, ALLOWEDIPS_NODE, PeerList)
     {
         RemoveEntryList(&Node->PeerList);
         InitializeListHead(&Node->PeerList);
         RcuInitPointer(Node->Peer, NULL);
+        Node->Flags = 0;
         if (Node->Bit[0] && Node->Bit[1])
             continue;
         Child = RcuDereferenceProtected(ALLOWEDIPS_NODE, Node->Bit[!RcuAccessPointer(Node->Bit[0])], Lock);
@@ -434,6 +646,45 @@ AllowedIpsLookupSrc(ALLOWEDIPS_TABLE *Table, UINT16_BE Proto, CONST VOID *IpHdr)
     return NULL;
 }
 
+#pragma warning(suppress : 6262) /* Using 1044 bytes of stack is still below 1280. */
+static BOOLEAN
+OwnedBy(_In_ ALLOWEDIPS_NODE *Root, _In_ WG_PEER *Peer)
+{
+    ALLOWEDIPS_NODE *Node, *Stack[STACK_ENTRIES] = { Root };
+    ULONG Len = 1;
+    while (Len > 0 && (Node = Stack[--Len]) != NULL)
+    {
+        if (RcuAccessPointer(Node->Peer) && RcuAccessPointer(Node->Peer) != Peer)
+            return FALSE;
+        PushRcu(Stack, Node->Bit[0], &Len);
+        PushRcu(Stack, Node->Bit[1], &Len);
+    }
+    return TRUE;
+}
+
+_Use_decl_annotations_
+WG_PEER *
+AllowedIpsSolePeer(ALLOWEDIPS_TABLE *Table, EX_PUSH_LOCK *Lock)
+{
+    ALLOWEDIPS_NODE *Root4 = RcuDereferenceProtected(ALLOWEDIPS_NODE, Table->Root4, Lock);
+    ALLOWEDIPS_NODE *Root6 = RcuDereferenceProtected(ALLOWEDIPS_NODE, Table->Root6, Lock);
+    WG_PEER *Peer;
+
+    if (!Root4 || !Root6 || Root4->Cidr || Root6->Cidr)
+        return NULL;
+    Peer = RcuDereferenceProtected(WG_PEER, Root4->Peer, Lock);
+    if (!Peer || RcuAccessPointer(Root6->Peer) != Peer || !OwnedBy(Root4, Peer) || !OwnedBy(Root6, Peer))
+        return NULL;
+    return Peer;
+}
+
+_Use_decl_annotations_
+SIZE_T
+AllowedIpsTrimCache(BOOLEAN UnderPressure)
+{
+    return MemTrimCache(&NodeCache, UnderPressure);
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, AllowedIpsDriverEntry)
 #endif
@@ -441,14 +692,14 @@ _Use_decl_annotations_
 NTSTATUS
 AllowedIpsDriverEntry(VOID)
 {
-    return ExInitializeLookasideListEx(&NodeCache, NULL, NULL, NonPagedPool, 0, sizeof(ALLOWEDIPS_NODE), MEMORY_TAG, 0);
+    return MemCacheInit(&NodeCache, sizeof(ALLOWEDIPS_NODE));
 }
 
 _Use_decl_annotations_
 VOID AllowedIpsUnload(VOID)
 {
     RcuBarrier();
-    ExDeleteLookasideListEx(&NodeCache);
+    MemCacheDelete(&NodeCache);
 }
 
 #ifdef DBG
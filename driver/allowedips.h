@@ -13,12 +13,24 @@
 
 typedef struct _WG_PEER WG_PEER;
 
+typedef enum _ALLOWEDIPS_NODE_FLAGS
+{
+    /* An entry of its peer that is covered by an absorbing node, and hence not linked into the trie, but kept on the
+     * peer's AllowedIpsDetachedList instead. */
+    ALLOWEDIPS_NODE_DETACHED = 1U << 0,
+    /* A node that only stands in for the detached entries below it, and is not an entry itself. */
+    ALLOWEDIPS_NODE_AGGREGATE = 1U << 1,
+    /* A leaf whose peer owns every address below it, some of them by way of detached entries. */
+    ALLOWEDIPS_NODE_ABSORBING = 1U << 2
+} ALLOWEDIPS_NODE_FLAGS;
+
 typedef struct _ALLOWEDIPS_NODE ALLOWEDIPS_NODE;
 struct _ALLOWEDIPS_NODE
 {
     WG_PEER __rcu *Peer;
     ALLOWEDIPS_NODE __rcu *Bit[2];
     UINT8 Cidr, BitAtA, BitAtB, Bitlen;
+    UINT8 Flags;
     __declspec(align(8)) UINT8 Bits[16];
 
     /* Keep rarely used members at bottom to be beyond cache line. */
@@ -66,6 +78,13 @@ _Requires_lock_held_(Lock)
 VOID
 AllowedIpsRemoveByPeer(_Inout_ ALLOWEDIPS_TABLE *Table, _In_ WG_PEER *Peer, _In_ EX_PUSH_LOCK *Lock);
 
+/* Entries on a peer's AllowedIpsList are reported unless they are aggregates. */
+static inline BOOLEAN
+AllowedIpsIsEntry(_In_ CONST ALLOWEDIPS_NODE *Node)
+{
+    return !(Node->Flags & ALLOWEDIPS_NODE_AGGREGATE);
+}
+
 /* The Ip pointer should be 8 byte aligned */
 ADDRESS_FAMILY
 AllowedIpsReadNode(_In_ CONST ALLOWEDIPS_NODE *Node, _Out_ UINT8 Ip[16], _Out_ UINT8 *Cidr);
@@ -81,12 +100,23 @@ _Post_maybenull_
 WG_PEER *
 AllowedIpsLookupSrc(_In_ ALLOWEDIPS_TABLE *Table, _In_ UINT16_BE Proto, _In_ CONST VOID *IpHdr);
 
+/* Returns the peer that every address of both families resolves to, or NULL if there is none. */
+_Requires_lock_held_(Lock)
+_Must_inspect_result_
+_Post_maybenull_
+WG_PEER *
+AllowedIpsSolePeer(_In_ ALLOWEDIPS_TABLE *Table, _In_ EX_PUSH_LOCK *Lock);
+
 #ifdef DBG
 _IRQL_requires_max_(PASSIVE_LEVEL)
 BOOLEAN
 AllowedIpsSelftest(VOID);
 #endif
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+SIZE_T
+AllowedIpsTrimCache(_In_ BOOLEAN UnderPressure);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS
 AllowedIpsDriverEntry(VOID);
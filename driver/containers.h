@@ -398,3 +398,129 @@ NetBufferListInterlockedDequeue(NET_BUFFER_LIST_QUEUE *NblQueue)
     KeReleaseSpinLock(&NblQueue->Lock, Irql);
     return Nbl;
 }
+
+/* A bounded queue that any number of producers add to and any number of consumers take everything from at once,
+ * without a lock. NBLs sit newest first on a stack that is only ever pushed to with a compare-exchange or swapped
+ * out whole, so there is no ABA hazard. Taking them is constant time, and leaves it to the consumer to put them in
+ * arrival order if it needs to. Capacity is enforced by the consumer, which keeps the newest Capacity of what it
+ * takes and drops the oldest. Producers never wait for room, and only use Count as a soft bound that tells them when
+ * to have the queue drained. It is approximate: it is bumped before an NBL is pushed and cleared after the stack is
+ * swapped out, so that each producer racing a consumer can leave it one short until the next time the queue is emptied.
+ */
+typedef struct _NET_BUFFER_LIST_LOCKLESS_QUEUE
+{
+    PNET_BUFFER_LIST volatile Head;
+    LONG Count;
+    ULONG Capacity;
+} NET_BUFFER_LIST_LOCKLESS_QUEUE;
+
+static inline VOID
+NetBufferListLocklessInitQueue(_Out_ NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue, _In_ ULONG Capacity)
+{
+    NblQueue->Head = NULL;
+    NblQueue->Count = 0;
+    NblQueue->Capacity = Capacity;
+}
+
+_Must_inspect_result_
+static inline BOOLEAN
+NetBufferListLocklessIsQueueEmpty(_In_ CONST NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue)
+{
+    return !ReadPointerNoFence((PVOID *)&NblQueue->Head);
+}
+
+/* Pushes First through Last, which must already be linked newest first, as a single unit. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+__NetBufferListLocklessPush(
+    _Inout_ NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue,
+    __drv_aliasesMem _In_ PNET_BUFFER_LIST First,
+    _Inout_ PNET_BUFFER_LIST Last)
+{
+    PNET_BUFFER_LIST Head = ReadPointerNoFence((PVOID *)&NblQueue->Head);
+    for (;;)
+    {
+        NET_BUFFER_LIST_NEXT_NBL(Last) = Head;
+        PNET_BUFFER_LIST Prev = InterlockedCompareExchangePointer((PVOID *)&NblQueue->Head, First, Head);
+        if (Prev == Head)
+            break;
+        Head = Prev;
+    }
+}
+
+/* Returns TRUE once the queue holds at least its capacity, meaning that it should be drained soon. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline BOOLEAN
+NetBufferListLocklessEnqueue(
+    _Inout_ NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue,
+    __drv_aliasesMem _In_ PNET_BUFFER_LIST Nbl)
+{
+    LONG Count = InterlockedIncrement(&NblQueue->Count);
+    __NetBufferListLocklessPush(NblQueue, Nbl, Nbl);
+    return Count >= (LONG)NblQueue->Capacity;
+}
+
+/* Takes every queued NBL, as a chain linked newest first. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static inline PNET_BUFFER_LIST
+NetBufferListLocklessDequeueAll(_Inout_ NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue)
+{
+    PNET_BUFFER_LIST First = InterlockedExchangePointer((PVOID *)&NblQueue->Head, NULL);
+    if (First)
+        InterlockedExchange(&NblQueue->Count, 0);
+    return First;
+}
+
+/* Cuts a chain taken by NetBufferListLocklessDequeueAll down to the queue's capacity, and returns what was past it,
+ * which are the oldest NBLs, still linked newest first, for the caller to drop. Only the part that is kept is walked.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static inline PNET_BUFFER_LIST
+NetBufferListLocklessTrimOldest(_In_ CONST NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue, _Inout_ PNET_BUFFER_LIST Newest)
+{
+    PNET_BUFFER_LIST Last = Newest;
+    for (ULONG i = 1; i < NblQueue->Capacity && Last; ++i)
+        Last = NET_BUFFER_LIST_NEXT_NBL(Last);
+    if (!Last)
+        return NULL;
+    PNET_BUFFER_LIST Oldest = NET_BUFFER_LIST_NEXT_NBL(Last);
+    NET_BUFFER_LIST_NEXT_NBL(Last) = NULL;
+    return Oldest;
+}
+
+/* Puts back NBLs taken by NetBufferListLocklessDequeueAll, still linked newest first, in one go. They land on top of
+ * whatever was queued in the meantime, even though that is newer, so once the queue is next put in arrival order they
+ * come out after it, and it is what gets trimmed first if the queue is then over capacity. They count against
+ * capacity again.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+NetBufferListLocklessRequeueAll(
+    _Inout_ NET_BUFFER_LIST_LOCKLESS_QUEUE *NblQueue,
+    __drv_aliasesMem _In_ PNET_BUFFER_LIST First,
+    _Inout_ PNET_BUFFER_LIST Last,
+    _In_ ULONG Length)
+{
+    InterlockedAdd(&NblQueue->Count, (LONG)Length);
+    __NetBufferListLocklessPush(NblQueue, First, Last);
+}
+
+/* Turns a chain linked newest first, as taken by NetBufferListLocklessDequeueAll, into a queue in arrival order. */
+static inline VOID
+NetBufferListReverseIntoQueue(_Out_ NET_BUFFER_LIST_QUEUE *NblQueue, _In_opt_ PNET_BUFFER_LIST Nbl)
+{
+    NetBufferListInitQueue(NblQueue);
+    NblQueue->Tail = Nbl;
+    while (Nbl)
+    {
+        PNET_BUFFER_LIST Next = NET_BUFFER_LIST_NEXT_NBL(Nbl);
+        NET_BUFFER_LIST_NEXT_NBL(Nbl) = NblQueue->Head;
+        NblQueue->Head = Nbl;
+        ++NblQueue->Length;
+        Nbl = Next;
+    }
+}
@@ -250,6 +250,7 @@ CookieMessageConsume(MESSAGE_HANDSHAKE_COOKIE *Src, WG_DEVICE *Wg)
         Peer->LatestCookie.IsValid = TRUE;
         Peer->LatestCookie.HaveSentMac1 = FALSE;
         MuReleasePushLockExclusive(&Peer->LatestCookie.Lock);
+        InterlockedIncrement(&Peer->HandshakeStats.CookieReplies);
     }
     else
         LogInfoRatelimited(Wg, "Could not decrypt invalid cookie response");
@@ -6,6 +6,7 @@
 #include "crypto.h"
 #include "arithmetic.h"
 #include "memory.h"
+#include "timers.h"
 
 #pragma warning(disable : 4244)  /* '=': conversion from 'UINT32' to 'UINT8', possible loss of data */
 #pragma warning(disable : 4267)  /* '=': conversion from 'SIZE_T' to 'ULONG', possible loss of data */
@@ -1161,6 +1162,76 @@ ChaCha20Poly1305EncryptMdl(
     return TRUE;
 }
 
+_Use_decl_annotations_
+VOID
+ChaCha20Poly1305Precompute(
+    CHACHA20POLY1305_PRECOMPUTED *Precomputed,
+    CONST UINT64 Nonce,
+    CONST UINT8 Key[CHACHA20POLY1305_KEY_SIZE],
+    CONST SIMD_STATE *Simd)
+{
+    CHACHA20_CTX ChaCha20State;
+
+    C_ASSERT(sizeof(Precomputed->PolyKey) == POLY1305_KEY_SIZE);
+    C_ASSERT(!(sizeof(Precomputed->Stream) % CHACHA20_BLOCK_SIZE));
+    RtlZeroMemory(Precomputed, sizeof(*Precomputed));
+    ChaCha20Init(&ChaCha20State, Key, Nonce);
+    ChaCha20(&ChaCha20State, Precomputed->PolyKey, Precomputed->PolyKey, sizeof(Precomputed->PolyKey), Simd);
+    ChaCha20(&ChaCha20State, Precomputed->Stream, Precomputed->Stream, sizeof(Precomputed->Stream), Simd);
+    RtlSecureZeroMemory(&ChaCha20State, sizeof(ChaCha20State));
+}
+
+_Use_decl_annotations_
+BOOLEAN
+ChaCha20Poly1305EncryptMdlPrecomputed(
+    UINT8 *Dst,
+    MDL *Src,
+    CONST ULONG SrcLen,
+    CONST ULONG SrcOffset,
+    CONST CHACHA20POLY1305_PRECOMPUTED *Precomputed,
+    CONST SIMD_STATE *Simd)
+{
+    POLY1305_CTX Poly1305State;
+    UINT8 *SrcBuf, *Out = Dst;
+    MDL *Mdl = Src;
+    ULONG LenMdl, OffsetMdl = SrcOffset;
+    CONST UINT8 *Stream = Precomputed->Stream;
+    UINT64 Lens[2];
+
+    if (SrcLen > sizeof(Precomputed->Stream))
+        return FALSE;
+
+    while (Mdl && OffsetMdl >= MmGetMdlByteCount(Mdl))
+    {
+        OffsetMdl -= MmGetMdlByteCount(Mdl);
+        Mdl = Mdl->Next;
+    }
+    for (ULONG Remaining = SrcLen; Remaining; Remaining -= LenMdl)
+    {
+        if (!Mdl)
+            return FALSE;
+        LenMdl = min(MmGetMdlByteCount(Mdl) - OffsetMdl, Remaining);
+        SrcBuf = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority | MdlMappingNoExecute | MdlMappingNoWrite);
+        if (!SrcBuf)
+            return FALSE;
+        XorCpy(Out, SrcBuf + OffsetMdl, Stream, LenMdl);
+        Out += LenMdl;
+        Stream += LenMdl;
+        Mdl = Mdl->Next;
+        OffsetMdl = 0;
+    }
+
+    Poly1305Init(&Poly1305State, Precomputed->PolyKey, Simd);
+    _Analysis_assume_((RtlFillMemory(Dst, SrcLen, 'A'), TRUE));
+    Poly1305Update(&Poly1305State, Dst, SrcLen);
+    Poly1305Update(&Poly1305State, Pad0, (0x10 - SrcLen) & 0xf);
+    Lens[0] = 0;
+    Lens[1] = CpuToLe64(SrcLen);
+    Poly1305Update(&Poly1305State, (UINT8 *)Lens, sizeof(Lens));
+    Poly1305Final(&Poly1305State, Out);
+    return TRUE;
+}
+
 _Use_decl_annotations_
 VOID
 XChaCha20Poly1305Encrypt(
@@ -1201,6 +1272,147 @@ XChaCha20Poly1305Decrypt(
     return Ret;
 }
 
+#pragma warning(disable : 28159) /* We're bug checking in case somebody's RNG is borked. */
+static VOID
+SystemRandom(_Out_writes_bytes_all_(Len) PVOID RandomData, _In_ SIZE_T Len)
+{
+#ifdef SDV_HACKS
+    /* SDV refuses to run if we link against cng.lib, so for SDV mode, we just insert a stub
+     * function instead. Then, out of an abundance of caution, we make sure that this always
+     * bug checks in case somebody's build system somehow winds up building this by accident.
+     */
+    if (Len)
+        KeBugCheck(CRYPTO_LIBRARY_INTERNAL_ERROR);
+    RtlFillMemory(RandomData, Len, 'A');
+#else
+    /* SystemPrng is documented as "Always returns TRUE." We see from reverse engineering that
+     * it returns FALSE if AesRNGState_generate fails, and that fails if a size addition overflows,
+     * which presumably it won't given that we only ever pass small values of Len. So just assert
+     * here that the documentation is correct.
+     */
+    if (!SystemPrng(RandomData, Len))
+        KeBugCheck(CRYPTO_LIBRARY_INTERNAL_ERROR);
+#endif
+}
+
+enum RNG_VALUES
+{
+    RNG_STREAM_BLOCKS = 8,
+    RNG_STREAM_SIZE = RNG_STREAM_BLOCKS * CHACHA20_BLOCK_SIZE,
+    RNG_RESEED_INTERVAL = 60
+};
+
+/* This is a fast key erasure generator: each refill produces a few blocks of keystream, the first CHACHA20_KEY_SIZE
+ * bytes of which replace the key that generated them, and the remainder is handed out and zeroed as it is consumed.
+ * So a later compromise of the state reveals nothing about prior outputs.
+ */
+typedef struct _RNG_STATE
+{
+    UINT32 Stream[RNG_STREAM_BLOCKS * CHACHA20_BLOCK_WORDS];
+    ULONG Position;
+    UINT64 Birthdate;
+} RNG_STATE;
+
+static RNG_STATE *RngStates;
+static ULONG NumRngStates;
+
+static VOID
+RngRefill(_Inout_ RNG_STATE *Rng)
+{
+    CHACHA20_CTX Ctx;
+
+    ChaCha20Init(&Ctx, (CONST UINT8 *)Rng->Stream, 0);
+    for (ULONG i = 0; i < RNG_STREAM_BLOCKS; ++i)
+        ChaCha20Block(&Ctx, &Rng->Stream[i * CHACHA20_BLOCK_WORDS], NULL);
+    RtlSecureZeroMemory(&Ctx, sizeof(Ctx));
+    Rng->Position = CHACHA20_KEY_SIZE;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+RngReseed(_Inout_ RNG_STATE *Rng)
+{
+    UINT8 Seed[CHACHA20_KEY_SIZE];
+
+    SystemRandom(Seed, sizeof(Seed));
+    for (ULONG i = 0; i < sizeof(Seed); ++i)
+        ((UINT8 *)Rng->Stream)[i] ^= Seed[i];
+    RtlSecureZeroMemory(Seed, sizeof(Seed));
+    /* Discard anything that was buffered from the old key. */
+    RngRefill(Rng);
+    Rng->Birthdate = KeQueryInterruptTime();
+}
+
+static VOID
+RngExtract(_Inout_ RNG_STATE *Rng, _Out_writes_bytes_all_(Len) UINT8 *Out, _In_ SIZE_T Len)
+{
+    UINT8 *Stream = (UINT8 *)Rng->Stream;
+
+    while (Len)
+    {
+        if (Rng->Position == RNG_STREAM_SIZE)
+            RngRefill(Rng);
+        CONST ULONG Chunk = (ULONG)min(Len, RNG_STREAM_SIZE - Rng->Position);
+        RtlCopyMemory(Out, Stream + Rng->Position, Chunk);
+        RtlSecureZeroMemory(Stream + Rng->Position, Chunk);
+        Rng->Position += Chunk;
+        Out += Chunk;
+        Len -= Chunk;
+    }
+}
+
+_Use_decl_annotations_
+VOID
+CryptoRandom(PVOID RandomData, SIZE_T Len)
+{
+    if (!RngStates || Len > RNG_STREAM_SIZE - CHACHA20_KEY_SIZE)
+    {
+        SystemRandom(RandomData, Len);
+        return;
+    }
+
+    /* Being at DISPATCH_LEVEL gives us exclusive use of this processor's state. */
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    CONST ULONG Processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (Processor >= NumRngStates)
+    {
+        KeLowerIrql(Irql);
+        SystemRandom(RandomData, Len);
+        return;
+    }
+    RNG_STATE *Rng = &RngStates[Processor];
+    if (!Rng->Birthdate ||
+        KeQueryInterruptTime() - Rng->Birthdate >= (UINT64)SEC_TO_SYS_TIME_UNITS(RNG_RESEED_INTERVAL))
+        RngReseed(Rng);
+    RngExtract(Rng, RandomData, Len);
+    KeLowerIrql(Irql);
+}
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, CryptoRandomDriverEntry)
+#endif
+_Use_decl_annotations_
+NTSTATUS
+CryptoRandomDriverEntry(VOID)
+{
+    CONST ULONG NumProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    RNG_STATE *States = MemAllocateArrayAndZero(NumProcessors, sizeof(*States));
+    if (!States)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    for (ULONG i = 0; i < NumProcessors; ++i)
+        States[i].Position = RNG_STREAM_SIZE;
+    NumRngStates = NumProcessors;
+    RngStates = States;
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+VOID CryptoRandomUnload(VOID)
+{
+    MemFreeSensitive(RngStates, (SIZE_T)NumRngStates * sizeof(*RngStates));
+    RngStates = NULL;
+}
+
 static CONST UINT32 Blake2sIv[8] = { 0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
                                      0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL };
 
@@ -2860,6 +3072,7 @@ Curve25519(
 
 #ifdef DBG
 #    include "selftest/chacha20poly1305.c"
+#    include "selftest/rng.c"
 #    ifdef ALLOC_PRAGMA
 #        pragma alloc_text(INIT, CryptoSelftest)
 #    endif
@@ -2881,6 +3094,8 @@ BOOLEAN CryptoSelftest(VOID)
         Simd.CpuFeatures = ((ULONG)Simd.CpuFeatures - FullSet) & FullSet;
     } while (Simd.CpuFeatures);
     SimdPut(&Simd);
+    if (!RngSelftest())
+        Success = FALSE;
     if (Success)
         LogDebug("crypto self-tests: pass");
     return Success;
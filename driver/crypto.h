@@ -114,28 +114,11 @@ CryptoIsZero32(_In_reads_bytes_(32) CONST VOID *Data)
     return !NotZero;
 }
 
-#pragma warning(disable : 28159) /* We're bug checking in case somebody's RNG is borked. */
-static inline VOID
-CryptoRandom(_Out_writes_bytes_all_(Len) PVOID RandomData, _In_ SIZE_T Len)
-{
-#ifdef SDV_HACKS
-    /* SDV refuses to run if we link against cng.lib, so for SDV mode, we just insert a stub
-     * function instead. Then, out of an abundance of caution, we make sure that this always
-     * bug checks in case somebody's build system somehow winds up building this by accident.
-     */
-    if (Len)
-        KeBugCheck(CRYPTO_LIBRARY_INTERNAL_ERROR);
-    RtlFillMemory(RandomData, Len, 'A');
-#else
-    /* CryptoRandom is documented as "Always returns TRUE." We see from reverse engineering that
-     * it returns FALSE if AesRNGState_generate fails, and that fails if a size addition overflows,
-     * which presumably it won't given that we only ever pass small values of Len. So just assert
-     * here that the documentation is correct.
-     */
-    if (!SystemPrng(RandomData, Len))
-        KeBugCheck(CRYPTO_LIBRARY_INTERNAL_ERROR);
-#endif
-}
+/* Small requests are served from a per-CPU fast-key-erasure ChaCha20 generator, which is periodically reseeded from the
+ * system PRNG. Larger ones go straight to the system PRNG. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CryptoRandom(_Out_writes_bytes_all_(Len) PVOID RandomData, _In_ SIZE_T Len);
 
 enum CHACHA20POLY1305_LENGTHS
 {
@@ -191,6 +174,39 @@ ChaCha20Poly1305DecryptMdl(
     _In_ CONST UINT8 Key[CHACHA20POLY1305_KEY_SIZE],
     _In_opt_ CONST SIMD_STATE *Simd);
 
+/* The Poly1305 one-time key and the first bytes of ChaCha20 keystream for a single nonce, computed ahead of time so
+ * that encrypting a small packet later on is just an XOR and a MAC. Whoever holds this holds keystream, so it must
+ * be used at most once and zeroed afterwards.
+ */
+enum
+{
+    CHACHA20POLY1305_PRECOMPUTED_LEN = 256
+};
+
+typedef struct _CHACHA20POLY1305_PRECOMPUTED
+{
+    UINT8 PolyKey[32];
+    UINT8 Stream[CHACHA20POLY1305_PRECOMPUTED_LEN];
+} CHACHA20POLY1305_PRECOMPUTED;
+
+VOID
+ChaCha20Poly1305Precompute(
+    _Out_ CHACHA20POLY1305_PRECOMPUTED *Precomputed,
+    _In_ CONST UINT64 Nonce,
+    _In_ CONST UINT8 Key[CHACHA20POLY1305_KEY_SIZE],
+    _In_opt_ CONST SIMD_STATE *Simd);
+
+/* Like ChaCha20Poly1305EncryptMdl without associated data, for SrcLen up to CHACHA20POLY1305_PRECOMPUTED_LEN. */
+_Must_inspect_result_
+BOOLEAN
+ChaCha20Poly1305EncryptMdlPrecomputed(
+    _Out_writes_bytes_all_(SrcLen + CHACHA20POLY1305_AUTHTAG_SIZE) UINT8 *Dst,
+    _In_ MDL *Src,
+    _In_ CONST ULONG SrcLen,
+    _In_ CONST ULONG SrcOffset,
+    _In_ CONST CHACHA20POLY1305_PRECOMPUTED *Precomputed,
+    _In_opt_ CONST SIMD_STATE *Simd);
+
 VOID
 XChaCha20Poly1305Encrypt(
     _Out_writes_bytes_all_(SrcLen + CHACHA20POLY1305_AUTHTAG_SIZE) UINT8 *Dst,
@@ -362,6 +378,14 @@ Curve25519GenerateSecret(_Out_writes_bytes_all_(CURVE25519_KEY_SIZE) UINT8 Secre
 
 VOID CryptoDriverEntry(VOID);
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+CryptoRandomDriverEntry(VOID);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID CryptoRandomUnload(VOID);
+
 #ifdef DBG
 _IRQL_requires_max_(PASSIVE_LEVEL)
 BOOLEAN
@@ -0,0 +1,324 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "cryptoengine.h"
+#include "memory.h"
+
+typedef _Function_class_(CRYPTO_ENGINE_BACKEND_INIT)
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+CRYPTO_ENGINE_BACKEND_INIT(_Inout_ CRYPTO_ENGINE *Engine, _In_ ULONG LatencyUs);
+
+typedef _Function_class_(CRYPTO_ENGINE_BACKEND_SUBMIT)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CRYPTO_ENGINE_BACKEND_SUBMIT(
+    _Inout_ CRYPTO_ENGINE *Engine,
+    _In_ __drv_aliasesMem NET_BUFFER_LIST *First,
+    _In_ CONST SIMD_STATE *Simd);
+
+typedef _Function_class_(CRYPTO_ENGINE_BACKEND_STOP)
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CRYPTO_ENGINE_BACKEND_STOP(_Inout_ CRYPTO_ENGINE *Engine);
+
+typedef _Function_class_(CRYPTO_ENGINE_BACKEND_DESTROY)
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CRYPTO_ENGINE_BACKEND_DESTROY(_Inout_ CRYPTO_ENGINE *Engine);
+
+struct _CRYPTO_ENGINE_BACKEND
+{
+    CONST CHAR *Name;
+    CRYPTO_ENGINE_BACKEND_INIT *Init;
+    CRYPTO_ENGINE_BACKEND_SUBMIT *Submit;
+    CRYPTO_ENGINE_BACKEND_STOP *Stop;
+    CRYPTO_ENGINE_BACKEND_DESTROY *Destroy;
+};
+
+static CRYPTO_ENGINE_BACKEND_INIT SoftwareInit;
+_Use_decl_annotations_
+static NTSTATUS
+SoftwareInit(CRYPTO_ENGINE *Engine, ULONG LatencyUs)
+{
+    UNREFERENCED_PARAMETER(Engine);
+    UNREFERENCED_PARAMETER(LatencyUs);
+    return STATUS_SUCCESS;
+}
+
+static CRYPTO_ENGINE_BACKEND_SUBMIT SoftwareSubmit;
+_Use_decl_annotations_
+static VOID
+SoftwareSubmit(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, CONST SIMD_STATE *Simd)
+{
+    Engine->Complete(Engine, First, Engine->Transform(Engine, First, Simd));
+}
+
+static CRYPTO_ENGINE_BACKEND_STOP SoftwareStop;
+_Use_decl_annotations_
+static VOID
+SoftwareStop(CRYPTO_ENGINE *Engine)
+{
+    UNREFERENCED_PARAMETER(Engine);
+}
+
+static CRYPTO_ENGINE_BACKEND_DESTROY SoftwareDestroy;
+_Use_decl_annotations_
+static VOID
+SoftwareDestroy(CRYPTO_ENGINE *Engine)
+{
+    UNREFERENCED_PARAMETER(Engine);
+}
+
+/* The simulated offload engine does the work on the submitting CPU just like the software one, but only reports it
+ * done once the configured latency has elapsed, from a high resolution timer, the way a completion interrupt of a real
+ * accelerator would. Jobs sit in a fixed ring, preallocated like a device's descriptor ring, and are only ever
+ * completed from its head, under Lock, which keeps completions in submission order. Where a real device would stall
+ * the submitter once its ring is full, the oldest job is retired early instead, since submitters may not wait.
+ */
+
+#define SIMULATED_OFFLOAD_MAX_JOBS 1024
+
+struct _SIMULATED_OFFLOAD_JOB
+{
+    NET_BUFFER_LIST *First;
+    LONG64 Deadline;
+    BOOLEAN Success;
+};
+
+_Requires_lock_held_(Engine->Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static VOID
+SimulatedOffloadArm(_Inout_ CRYPTO_ENGINE *Engine, _In_ LONG64 Deadline, _In_ LONG64 Now)
+{
+    LONG64 DueTime = Deadline > Now ? -max((Deadline - Now) * 10000000 / Engine->Frequency, 1) : -1;
+#if NTDDI_VERSION >= NTDDI_WINBLUE
+    ExSetTimer(Engine->Timer, DueTime, 0, NULL);
+#else
+    KeSetTimer(&Engine->Timer, (LARGE_INTEGER){ .QuadPart = DueTime }, &Engine->Dpc);
+#endif
+}
+
+_Requires_lock_held_(Engine->Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static VOID
+SimulatedOffloadRetire(_Inout_ CRYPTO_ENGINE *Engine)
+{
+    SIMULATED_OFFLOAD_JOB *Job = &Engine->Jobs[Engine->Head];
+    Engine->Head = (Engine->Head + 1) % SIMULATED_OFFLOAD_MAX_JOBS;
+    --Engine->Count;
+    Engine->Complete(Engine, Job->First, Job->Success);
+}
+
+_Requires_lock_not_held_(Engine->Lock)
+_IRQL_requires_(DISPATCH_LEVEL)
+static VOID
+SimulatedOffloadCompleteDue(_Inout_ CRYPTO_ENGINE *Engine, _In_ BOOLEAN All)
+{
+    BOOLEAN Completed = FALSE;
+
+    KeAcquireSpinLockAtDpcLevel(&Engine->Lock);
+    LONG64 Now = KeQueryPerformanceCounter(NULL).QuadPart;
+    while (Engine->Count)
+    {
+        LONG64 Deadline = Engine->Jobs[Engine->Head].Deadline;
+        if (!All && Deadline > Now)
+        {
+            if (!Engine->Stopped)
+                SimulatedOffloadArm(Engine, Deadline, Now);
+            break;
+        }
+        SimulatedOffloadRetire(Engine);
+        Completed = TRUE;
+    }
+    KeReleaseSpinLockFromDpcLevel(&Engine->Lock);
+
+    if (Completed)
+        Engine->Notify(Engine);
+}
+
+#if NTDDI_VERSION >= NTDDI_WINBLUE
+static EXT_CALLBACK SimulatedOffloadTimer;
+_Use_decl_annotations_
+static VOID
+SimulatedOffloadTimer(PEX_TIMER Timer, PVOID Context)
+{
+    _Analysis_assume_(Context != NULL);
+    SimulatedOffloadCompleteDue((CRYPTO_ENGINE *)Context, FALSE);
+}
+#else
+static KDEFERRED_ROUTINE SimulatedOffloadDpc;
+_Use_decl_annotations_
+static VOID
+SimulatedOffloadDpc(KDPC *Dpc, PVOID DeferredContext, PVOID SystemArgument1, PVOID SystemArgument2)
+{
+    _Analysis_assume_(DeferredContext != NULL);
+    SimulatedOffloadCompleteDue((CRYPTO_ENGINE *)DeferredContext, FALSE);
+}
+#endif
+
+static CRYPTO_ENGINE_BACKEND_SUBMIT SimulatedOffloadSubmit;
+_Use_decl_annotations_
+static VOID
+SimulatedOffloadSubmit(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, CONST SIMD_STATE *Simd)
+{
+    BOOLEAN Success = Engine->Transform(Engine, First, Simd);
+
+    KIRQL Irql;
+    KeAcquireSpinLock(&Engine->Lock, &Irql);
+    if (Engine->Stopped)
+    {
+        /* Our caller picks up the completions, just like with the software engine. */
+        while (Engine->Count)
+            SimulatedOffloadRetire(Engine);
+        Engine->Complete(Engine, First, Success);
+        KeReleaseSpinLock(&Engine->Lock, Irql);
+        return;
+    }
+    if (Engine->Count == SIMULATED_OFFLOAD_MAX_JOBS)
+        SimulatedOffloadRetire(Engine);
+    SIMULATED_OFFLOAD_JOB *Job = &Engine->Jobs[(Engine->Head + Engine->Count) % SIMULATED_OFFLOAD_MAX_JOBS];
+    LONG64 Now = KeQueryPerformanceCounter(NULL).QuadPart;
+    Job->First = First;
+    Job->Success = Success;
+    Job->Deadline = Now + Engine->Latency;
+    if (!Engine->Count++)
+        SimulatedOffloadArm(Engine, Job->Deadline, Now);
+    KeReleaseSpinLock(&Engine->Lock, Irql);
+}
+
+static CRYPTO_ENGINE_BACKEND_INIT SimulatedOffloadInit;
+_Use_decl_annotations_
+static NTSTATUS
+SimulatedOffloadInit(CRYPTO_ENGINE *Engine, ULONG LatencyUs)
+{
+    LARGE_INTEGER Frequency;
+
+    KeInitializeSpinLock(&Engine->Lock);
+    KeQueryPerformanceCounter(&Frequency);
+    Engine->Frequency = Frequency.QuadPart;
+    Engine->Latency = (LONG64)LatencyUs * Frequency.QuadPart / 1000000;
+    Engine->Head = Engine->Count = 0;
+    Engine->Stopped = FALSE;
+    Engine->Jobs = MemAllocateArray(SIMULATED_OFFLOAD_MAX_JOBS, sizeof(*Engine->Jobs));
+    if (!Engine->Jobs)
+        return STATUS_INSUFFICIENT_RESOURCES;
+#if NTDDI_VERSION >= NTDDI_WINBLUE
+    Engine->Timer = ExAllocateTimer(SimulatedOffloadTimer, Engine, EX_TIMER_HIGH_RESOLUTION);
+    if (!Engine->Timer)
+    {
+        MemFree(Engine->Jobs);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+#else
+    KeInitializeTimer(&Engine->Timer);
+    KeInitializeDpc(&Engine->Dpc, SimulatedOffloadDpc, Engine);
+#endif
+    return STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+SimulatedOffloadDisarm(_Inout_ CRYPTO_ENGINE *Engine)
+{
+#if NTDDI_VERSION >= NTDDI_WINBLUE
+    if (!Engine->Timer)
+        return;
+    /* This also waits for a callback that is already running. */
+    ExDeleteTimer(Engine->Timer, TRUE, TRUE, NULL);
+    Engine->Timer = NULL;
+#else
+    if (!KeCancelTimer(&Engine->Timer))
+        KeRemoveQueueDpc(&Engine->Dpc);
+    KeFlushQueuedDpcs();
+#endif
+}
+
+/* Once Stopped is set, under Lock, the timer is never armed again, so it can be torn down while submitters are still
+ * running, and whatever was queued before is completed right away, with the packet pipeline still around to take it.
+ */
+static CRYPTO_ENGINE_BACKEND_STOP SimulatedOffloadStop;
+_Use_decl_annotations_
+static VOID
+SimulatedOffloadStop(CRYPTO_ENGINE *Engine)
+{
+    KIRQL Irql;
+    KeAcquireSpinLock(&Engine->Lock, &Irql);
+    Engine->Stopped = TRUE;
+    KeReleaseSpinLock(&Engine->Lock, Irql);
+    SimulatedOffloadDisarm(Engine);
+    Irql = KeRaiseIrqlToDpcLevel();
+    SimulatedOffloadCompleteDue(Engine, TRUE);
+    KeLowerIrql(Irql);
+}
+
+static CRYPTO_ENGINE_BACKEND_DESTROY SimulatedOffloadDestroy;
+_Use_decl_annotations_
+static VOID
+SimulatedOffloadDestroy(CRYPTO_ENGINE *Engine)
+{
+    NT_ASSERT(!Engine->Count);
+    SimulatedOffloadDisarm(Engine);
+    MemFree(Engine->Jobs);
+}
+
+static CONST CRYPTO_ENGINE_BACKEND Backends[CRYPTO_ENGINE_TYPE_MAX] = {
+    [CRYPTO_ENGINE_SOFTWARE] = { .Name = "software",
+                                 .Init = SoftwareInit,
+                                 .Submit = SoftwareSubmit,
+                                 .Stop = SoftwareStop,
+                                 .Destroy = SoftwareDestroy },
+    [CRYPTO_ENGINE_SIMULATED_OFFLOAD] = { .Name = "simulated offload",
+                                          .Init = SimulatedOffloadInit,
+                                          .Submit = SimulatedOffloadSubmit,
+                                          .Stop = SimulatedOffloadStop,
+                                          .Destroy = SimulatedOffloadDestroy }
+};
+
+_Use_decl_annotations_
+NTSTATUS
+CryptoEngineInit(
+    CRYPTO_ENGINE *Engine,
+    CRYPTO_ENGINE_TYPE Type,
+    ULONG LatencyUs,
+    PCRYPTO_ENGINE_TRANSFORM Transform,
+    PCRYPTO_ENGINE_COMPLETION Complete,
+    PCRYPTO_ENGINE_NOTIFY Notify)
+{
+    Engine->Backend = &Backends[(ULONG)Type < CRYPTO_ENGINE_TYPE_MAX ? Type : CRYPTO_ENGINE_SOFTWARE];
+    Engine->Transform = Transform;
+    Engine->Complete = Complete;
+    Engine->Notify = Notify;
+    return Engine->Backend->Init(Engine, LatencyUs);
+}
+
+_Use_decl_annotations_
+VOID
+CryptoEngineSubmit(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, CONST SIMD_STATE *Simd)
+{
+    Engine->Backend->Submit(Engine, First, Simd);
+}
+
+_Use_decl_annotations_
+VOID
+CryptoEngineStop(CRYPTO_ENGINE *Engine)
+{
+    Engine->Backend->Stop(Engine);
+}
+
+_Use_decl_annotations_
+VOID
+CryptoEngineDestroy(CRYPTO_ENGINE *Engine)
+{
+    Engine->Backend->Destroy(Engine);
+}
+
+_Use_decl_annotations_
+CONST CHAR *
+CryptoEngineName(CONST CRYPTO_ENGINE *Engine)
+{
+    return Engine->Backend->Name;
+}
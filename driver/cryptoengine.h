@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#pragma once
+
+#include "crypto.h"
+#include <ndis.h>
+
+/* A crypto engine accepts jobs, each a chain of NBLs bound for the same peer, and later hands every one of them back
+ * through its completion routine, in submission order. The packet pipeline only ever talks to the engine, so the
+ * work itself may be done inline, by an accelerator, or anywhere else.
+ */
+
+typedef enum _CRYPTO_ENGINE_TYPE
+{
+    CRYPTO_ENGINE_SOFTWARE,
+    CRYPTO_ENGINE_SIMULATED_OFFLOAD,
+    CRYPTO_ENGINE_TYPE_MAX
+} CRYPTO_ENGINE_TYPE;
+
+typedef struct _CRYPTO_ENGINE CRYPTO_ENGINE;
+typedef struct _CRYPTO_ENGINE_BACKEND CRYPTO_ENGINE_BACKEND;
+typedef struct _SIMULATED_OFFLOAD_JOB SIMULATED_OFFLOAD_JOB;
+
+/* Encrypts or decrypts a job in place with the CPU, returning FALSE if any packet of it failed. */
+typedef _Function_class_(CRYPTO_ENGINE_TRANSFORM)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+BOOLEAN
+CRYPTO_ENGINE_TRANSFORM(_Inout_ CRYPTO_ENGINE *Engine, _Inout_ NET_BUFFER_LIST *First, _In_ CONST SIMD_STATE *Simd);
+typedef CRYPTO_ENGINE_TRANSFORM *PCRYPTO_ENGINE_TRANSFORM;
+
+/* Hands a finished job back to the packet pipeline. */
+typedef _Function_class_(CRYPTO_ENGINE_COMPLETION)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CRYPTO_ENGINE_COMPLETION(
+    _Inout_ CRYPTO_ENGINE *Engine,
+    _In_ __drv_aliasesMem NET_BUFFER_LIST *First,
+    _In_ BOOLEAN Success);
+typedef CRYPTO_ENGINE_COMPLETION *PCRYPTO_ENGINE_COMPLETION;
+
+/* Called after completions were delivered from outside of CryptoEngineSubmit, so that whoever consumes them can be
+ * scheduled.
+ */
+typedef _Function_class_(CRYPTO_ENGINE_NOTIFY)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CRYPTO_ENGINE_NOTIFY(_Inout_ CRYPTO_ENGINE *Engine);
+typedef CRYPTO_ENGINE_NOTIFY *PCRYPTO_ENGINE_NOTIFY;
+
+struct _CRYPTO_ENGINE
+{
+    CONST CRYPTO_ENGINE_BACKEND *Backend;
+    PCRYPTO_ENGINE_TRANSFORM Transform;
+    PCRYPTO_ENGINE_COMPLETION Complete;
+    PCRYPTO_ENGINE_NOTIFY Notify;
+
+    /* Simulated offload: */
+    KSPIN_LOCK Lock;
+    SIMULATED_OFFLOAD_JOB *Jobs;
+    ULONG Head, Count;
+    BOOLEAN Stopped;
+#if NTDDI_VERSION >= NTDDI_WINBLUE
+    PEX_TIMER Timer;
+#else
+    KTIMER Timer;
+    KDPC Dpc;
+#endif
+    LONG64 Latency, Frequency; /* In performance counter ticks, and ticks per second. */
+};
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+CryptoEngineInit(
+    _Out_ CRYPTO_ENGINE *Engine,
+    _In_ CRYPTO_ENGINE_TYPE Type,
+    _In_ ULONG LatencyUs,
+    _In_ PCRYPTO_ENGINE_TRANSFORM Transform,
+    _In_ PCRYPTO_ENGINE_COMPLETION Complete,
+    _In_ PCRYPTO_ENGINE_NOTIFY Notify);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+CryptoEngineSubmit(
+    _Inout_ CRYPTO_ENGINE *Engine,
+    _In_ __drv_aliasesMem NET_BUFFER_LIST *First,
+    _In_ CONST SIMD_STATE *Simd);
+
+/* Completes whatever is still outstanding, and every job submitted from then on as soon as it is submitted, so this
+ * must be called while whoever consumes the completions is still running.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CryptoEngineStop(_Inout_ CRYPTO_ENGINE *Engine);
+
+/* Frees an engine that was stopped, or that never had anything submitted to it. No new jobs may be submitted after
+ * this starts.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+CryptoEngineDestroy(_Inout_ CRYPTO_ENGINE *Engine);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Ret_z_
+CONST CHAR *
+CryptoEngineName(_In_ CONST CRYPTO_ENGINE *Engine);
@@ -34,6 +34,13 @@ static PKTHREAD IpInterfaceNotifierBugWorkaroundThread;
 static KEVENT IpInterfaceNotifierBugWorkaroundTerminate;
 static LIST_ENTRY DeviceList;
 static EX_PUSH_LOCK DeviceListLock;
+static struct
+{
+    KEVENT Terminate;
+    PKTHREAD Thread;
+    PKEVENT LowMemory;
+    ULONG64 Trims, BytesTrimmed;
+} CacheTrimmer;
 
 MINIPORT_UNLOAD Unload;
 
@@ -59,7 +66,7 @@ Restart(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_RESTART_PARAMETERS Mi
     WG_DEVICE *Wg = (WG_DEVICE *)MiniportAdapterContext;
 
     MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
-    ExReInitializeRundownProtection(&Wg->ItemsInFlight);
+    ExReInitializeRundownProtectionCacheAware(Wg->ItemsInFlight);
     if (ReadBooleanNoFence(&Wg->IsUp))
         DeviceStart(Wg);
     MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
@@ -91,7 +98,7 @@ Pause(NDIS_HANDLE MiniportAdapterContext, PNDIS_MINIPORT_PAUSE_PARAMETERS Minipo
     WG_DEVICE *Wg = (WG_DEVICE *)MiniportAdapterContext;
 
     MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
-    ExWaitForRundownProtectionRelease(&Wg->ItemsInFlight);
+    ExWaitForRundownProtectionReleaseCacheAware(Wg->ItemsInFlight);
     if (ReadBooleanNoFence(&Wg->IsUp))
         DeviceStop(Wg);
     MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
@@ -122,6 +129,120 @@ DeviceIndicateConnectionStatus(NDIS_HANDLE MiniportAdapterHandle, NDIS_MEDIA_CON
     NdisMIndicateStatusEx(MiniportAdapterHandle, &Indication);
 }
 
+/* Packets from one call to SendNetBufferLists are staged first and only then flushed, so that each peer gets one key
+ * lookup, one nonce run and one encryption queue entry for the whole lot, rather than one per packet. A huge chain is
+ * flushed part way through, both so that the first packets don't wait on the last ones for too long, and so that a
+ * peer's staged queue isn't left over capacity while we keep adding to it.
+ */
+typedef struct _SEND_BATCH
+{
+    WG_PEER *Peers[SEND_BATCH_MAX_PEERS];
+    ULONG NumPeers, NumPackets;
+    ULONG Staged; /* Bitmap of the Peers that got packets since the last flush. */
+    LONG64 Deadline, Interval;
+} SEND_BATCH;
+static_assert(SEND_BATCH_MAX_PEERS <= sizeof(ULONG) * 8, "Staged bitmap too small for maximum number of peers");
+
+/* Takes over the caller's reference to SolePeer, if any. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+SendBatchInit(_Out_ SEND_BATCH *Batch, _In_opt_ __drv_aliasesMem WG_PEER *SolePeer)
+{
+    LARGE_INTEGER Frequency, Now = KeQueryPerformanceCounter(&Frequency);
+    Batch->NumPeers = Batch->NumPackets = Batch->Staged = 0;
+    if (SolePeer)
+        Batch->Peers[Batch->NumPeers++] = SolePeer;
+    Batch->Interval = Frequency.QuadPart * SEND_BATCH_DEADLINE_US / 1000000;
+    Batch->Deadline = Now.QuadPart + Batch->Interval;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+SendBatchFlush(_Inout_ SEND_BATCH *Batch)
+{
+    for (ULONG i = 0; i < Batch->NumPeers; ++i)
+    {
+        if (Batch->Staged & (1U << i))
+            PacketSendStagedPackets(Batch->Peers[i]);
+    }
+    Batch->NumPackets = Batch->Staged = 0;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+SendBatchRelease(_Inout_ SEND_BATCH *Batch)
+{
+    for (ULONG i = 0; i < Batch->NumPeers; ++i)
+        PeerPut(Batch->Peers[i]);
+    Batch->NumPeers = 0;
+}
+
+/* Stages onto Batch->Peers[Index]. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+SendBatchQueue(_Inout_ SEND_BATCH *Batch, _In_ ULONG Index, _In_ __drv_aliasesMem NET_BUFFER_LIST *Nbl)
+{
+    WG_PEER *Peer = Batch->Peers[Index];
+    Batch->Staged |= 1U << Index;
+
+    /* A peer's staged queue that has filled up is flushed right away, which drops its oldest packets if it is still
+     * waiting on a handshake.
+     */
+    if (!NetBufferListLocklessEnqueue(&Peer->StagedPacketQueue, Nbl) && ++Batch->NumPackets < SEND_BATCH_MAX_PACKETS)
+    {
+        /* Reading the clock costs more than staging a packet does, so only look every few packets. */
+        if (Batch->NumPackets % SEND_BATCH_DEADLINE_STRIDE)
+            return;
+        LONG64 Now = KeQueryPerformanceCounter(NULL).QuadPart;
+        if (Now < Batch->Deadline)
+            return;
+        Batch->Deadline = Now + Batch->Interval;
+    }
+    SendBatchFlush(Batch);
+}
+
+/* Takes over the caller's reference to Peer. */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+SendBatchStage(
+    _Inout_ SEND_BATCH *Batch,
+    _In_ __drv_aliasesMem WG_PEER *Peer,
+    _In_ __drv_aliasesMem NET_BUFFER_LIST *Nbl)
+{
+    ULONG i;
+    for (i = 0; i < Batch->NumPeers; ++i)
+    {
+        if (Batch->Peers[i] == Peer)
+        {
+            PeerPut(Peer); /* The batch already holds a reference. */
+            goto stage;
+        }
+    }
+    if (Batch->NumPeers == ARRAYSIZE(Batch->Peers))
+    {
+        SendBatchFlush(Batch);
+        SendBatchRelease(Batch);
+    }
+    i = Batch->NumPeers++;
+    Batch->Peers[i] = Peer;
+
+stage:
+    SendBatchQueue(Batch, i, Nbl);
+}
+
+/* Returns a strong reference to a peer */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static WG_PEER *
+SolePeerGet(_In_ WG_DEVICE *Wg)
+{
+    KIRQL Irql = RcuReadLock();
+    WG_PEER *Peer = PeerGetMaybeZero(RcuDereference(WG_PEER, Wg->SolePeer));
+    RcuReadUnlock(Irql);
+    return Peer;
+}
+
 static MINIPORT_SEND_NET_BUFFER_LISTS SendNetBufferLists;
 _Use_decl_annotations_
 static VOID
@@ -135,18 +256,29 @@ SendNetBufferLists(
     ULONG CompleteFlags = 0;
     if (SendFlags & NDIS_SEND_FLAGS_DISPATCH_LEVEL)
         CompleteFlags |= NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL;
+
+    /* Take a reference for the whole chain at once. Each packet still drops its own when it completes. */
+    ULONG NumNbls = 0;
+    for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+        ++NumNbls;
+    if (!ExAcquireRundownProtectionCacheAwareEx(Wg->ItemsInFlight, NumNbls))
+    {
+        for (NET_BUFFER_LIST *Nbl = NetBufferLists; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+            NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_PAUSED;
+        NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, NetBufferLists, CompleteFlags);
+        Wg->Statistics.ifOutDiscards += NumNbls;
+        return;
+    }
+
+    /* With a sole peer, there is nothing to look up, and one reference covers the whole chain. */
+    WG_PEER *SolePeer = SolePeerGet(Wg);
+    SEND_BATCH Batch;
+    SendBatchInit(&Batch, SolePeer);
     for (NET_BUFFER_LIST *Nbl = NetBufferLists, *NextNbl; Nbl; Nbl = NextNbl)
     {
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
         NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
 
-        if (!ExAcquireRundownProtection(&Wg->ItemsInFlight))
-        {
-            NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_PAUSED;
-            NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, Nbl, CompleteFlags);
-            ++Wg->Statistics.ifOutDiscards;
-            continue;
-        }
         if (!ReadBooleanNoFence(&Wg->IsUp))
         {
             NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_MEDIA_DISCONNECTED;
@@ -200,7 +332,7 @@ SendNetBufferLists(
             goto returnNbl;
         }
 
-        WG_PEER *Peer = AllowedIpsLookupDst(&Wg->PeerAllowedIps, Protocol, Header);
+        WG_PEER *Peer = SolePeer ? SolePeer : AllowedIpsLookupDst(&Wg->PeerAllowedIps, Protocol, Header);
         if (!Peer)
         {
             NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_FAILURE;
@@ -216,35 +348,35 @@ SendNetBufferLists(
             ++Wg->Statistics.ifOutErrors;
             goto cleanupPeer;
         }
-
-        KIRQL Irql;
-        KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
-        /* If the queue is getting too big, we start removing the oldest packets
-         * until it's small again. We do this before adding the new packet, so
-         * we don't remove GSO segments that are in excess.
-         */
-        while (NetBufferListQueueLength(&Peer->StagedPacketQueue) > MAX_STAGED_PACKETS)
+        if (RcuAccessPointer(Peer->Acl))
         {
-            NET_BUFFER_LIST *NblToDiscard = NetBufferListDequeue(&Peer->StagedPacketQueue);
-            _Analysis_assume_(NblToDiscard); /* NetBufferListQueueLength() > MAX_STAGED_PACKETS implies
-                                                NetBufferListDequeue() returns a NBL. */
-            NET_BUFFER_LIST_STATUS(NblToDiscard) = NDIS_STATUS_FAILURE;
-            ++Wg->Statistics.ifOutDiscards;
-            FreeSendNetBufferList(Wg, NblToDiscard, CompleteFlags | NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
+            KIRQL Irql = RcuReadLock();
+            ACL_TABLE *Acl = RcuDereference(ACL_TABLE, Peer->Acl);
+            BOOLEAN Allowed = !Acl || AclAllowsNetBufferList(Acl, Nbl, Protocol, FALSE);
+            RcuReadUnlock(Irql);
+            if (!Allowed)
+            {
+                LogInfoRatelimited(Wg, "Packet to peer %llu denied by its ACL", Peer->InternalId);
+                NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_FAILURE;
+                goto cleanupPeer;
+            }
         }
-        NetBufferListEnqueue(&Peer->StagedPacketQueue, Nbl);
-        KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
 
-        PacketSendStagedPackets(Peer);
-        PeerPut(Peer);
+        if (Peer == SolePeer)
+            SendBatchQueue(&Batch, 0, Nbl);
+        else
+            SendBatchStage(&Batch, Peer, Nbl);
         continue;
 
     cleanupPeer:
-        PeerPut(Peer);
+        if (Peer != SolePeer)
+            PeerPut(Peer);
     returnNbl:
         FreeSendNetBufferList(Wg, Nbl, CompleteFlags);
         ++Wg->Statistics.ifOutDiscards;
     }
+    SendBatchFlush(&Batch);
+    SendBatchRelease(&Batch);
 }
 
 static MINIPORT_CANCEL_SEND CancelSend;
@@ -367,6 +499,114 @@ static VOID UninitIpInterfaceNotifierBugWorkaround(VOID)
     ObDereferenceObject(IpInterfaceNotifierBugWorkaroundThread);
 }
 
+enum
+{
+    CACHE_TRIM_IDLE_INTERVAL = 10,
+    CACHE_TRIM_PRESSURE_BACKOFF = 2
+};
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+ReportCacheTrim(_In_ BOOLEAN UnderPressure, _In_ SIZE_T Bytes)
+{
+    ++CacheTrimmer.Trims;
+    CacheTrimmer.BytesTrimmed += Bytes;
+    MuAcquirePushLockShared(&DeviceListLock);
+    WG_DEVICE *Wg;
+    LIST_FOR_EACH_ENTRY (Wg, &DeviceList, WG_DEVICE, DeviceList)
+    {
+        LogInfoRatelimited(
+            Wg,
+            "Released %llu bytes of cached memory due to %s (%llu KiB over %llu trims so far)",
+            (ULONG64)Bytes,
+            UnderPressure ? "low memory" : "idleness",
+            CacheTrimmer.BytesTrimmed / 1024,
+            CacheTrimmer.Trims);
+    }
+    MuReleasePushLockShared(&DeviceListLock);
+}
+
+/* Lookaside lists otherwise keep whatever a burst of traffic or a flood of handshakes left them with, so hand that
+ * back when the system signals that nonpaged pool is running low, and flush the lists that have gone idle. The
+ * NBL pools are managed by NDIS itself, and the packet arena is a fixed reservation, so neither is touched here.
+ */
+static KSTART_ROUTINE CacheTrimmerRoutine;
+_Use_decl_annotations_
+static VOID
+CacheTrimmerRoutine(PVOID StartContext)
+{
+    PVOID Objects[] = { &CacheTrimmer.Terminate, CacheTrimmer.LowMemory };
+
+    for (;;)
+    {
+        NTSTATUS Status = KeWaitForMultipleObjects(
+            CacheTrimmer.LowMemory ? 2 : 1,
+            Objects,
+            WaitAny,
+            Executive,
+            KernelMode,
+            FALSE,
+            &(LARGE_INTEGER){ .QuadPart = -SEC_TO_SYS_TIME_UNITS(CACHE_TRIM_IDLE_INTERVAL) },
+            NULL);
+        if (Status != STATUS_WAIT_1 && Status != STATUS_TIMEOUT)
+            break;
+        CONST BOOLEAN UnderPressure = Status == STATUS_WAIT_1;
+        SIZE_T Bytes = AllowedIpsTrimCache(UnderPressure) + RatelimiterTrimCache(UnderPressure) +
+                       PeerTrimCache(UnderPressure) + SocketTrimCache(UnderPressure);
+        if (Bytes)
+            ReportCacheTrim(UnderPressure, Bytes);
+        if (!UnderPressure)
+            continue;
+        /* The condition stays signaled for as long as memory is low, so don't spin on it. */
+        LARGE_INTEGER Backoff = { .QuadPart = -SEC_TO_SYS_TIME_UNITS(CACHE_TRIM_PRESSURE_BACKOFF) };
+        if (KeWaitForSingleObject(&CacheTrimmer.Terminate, Executive, KernelMode, FALSE, &Backoff) == STATUS_SUCCESS)
+            break;
+    }
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static NTSTATUS InitCacheTrimmer(VOID)
+{
+    KeInitializeEvent(&CacheTrimmer.Terminate, NotificationEvent, FALSE);
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    UNICODE_STRING LowMemoryName = RTL_CONSTANT_STRING(L"\\KernelObjects\\LowNonPagedPoolCondition");
+    InitializeObjectAttributes(&ObjectAttributes, &LowMemoryName, OBJ_KERNEL_HANDLE, NULL, NULL);
+    HANDLE Handle;
+    /* Without the low memory signal, idle trimming still works, so this is not fatal. */
+    if (NT_SUCCESS(ZwOpenEvent(&Handle, SYNCHRONIZE, &ObjectAttributes)))
+    {
+        if (!NT_SUCCESS(ObReferenceObjectByHandle(
+                Handle, SYNCHRONIZE, *ExEventObjectType, KernelMode, &CacheTrimmer.LowMemory, NULL)))
+            CacheTrimmer.LowMemory = NULL;
+        ZwClose(Handle);
+    }
+
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    NTSTATUS Status =
+        PsCreateSystemThread(&Handle, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, CacheTrimmerRoutine, NULL);
+    if (!NT_SUCCESS(Status))
+        goto cleanupLowMemory;
+    ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &CacheTrimmer.Thread, NULL);
+    ZwClose(Handle);
+    return STATUS_SUCCESS;
+
+cleanupLowMemory:
+    if (CacheTrimmer.LowMemory)
+        ObDereferenceObject(CacheTrimmer.LowMemory);
+    CacheTrimmer.LowMemory = NULL;
+    return Status;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID UninitCacheTrimmer(VOID)
+{
+    KeSetEvent(&CacheTrimmer.Terminate, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(CacheTrimmer.Thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(CacheTrimmer.Thread);
+    if (CacheTrimmer.LowMemory)
+        ObDereferenceObject(CacheTrimmer.LowMemory);
+}
+
 static MINIPORT_HALT HaltEx;
 _Use_decl_annotations_
 static VOID
@@ -386,10 +626,12 @@ HaltEx(NDIS_HANDLE MiniportAdapterContext, NDIS_HALT_ACTION HaltAction)
         Wg->SocketOwnerProcess = NULL;
     }
     PeerRemoveAll(Wg);
-    MulticoreWorkQueueDestroy(&Wg->DecryptThreads);
-    MulticoreWorkQueueDestroy(&Wg->EncryptThreads);
-    MulticoreWorkQueueDestroy(&Wg->HandshakeRxThreads);
-    MulticoreWorkQueueDestroy(&Wg->HandshakeTxThreads);
+    /* The engines hand what they still hold to the workers, and then the workers are the last ones to submit. */
+    CryptoEngineStop(&Wg->DecryptEngine);
+    CryptoEngineStop(&Wg->EncryptEngine);
+    MulticoreWorkQueueDestroy(&Wg->Workers);
+    CryptoEngineDestroy(&Wg->DecryptEngine);
+    CryptoEngineDestroy(&Wg->EncryptEngine);
     PtrRingFree(&Wg->DecryptQueue);
     PtrRingFree(&Wg->EncryptQueue);
     RcuBarrier();
@@ -402,6 +644,7 @@ HaltEx(NDIS_HANDLE MiniportAdapterContext, NDIS_HALT_ACTION HaltAction)
 
     WritePointerNoFence(&Wg->MiniportAdapterHandle, NULL);
     LogInfo(Wg, "Interface destroyed");
+    ExFreeCacheAwareRundownProtection(Wg->ItemsInFlight);
     MemFree(Wg);
 }
 
@@ -536,6 +779,58 @@ RegisterAdapter(_In_ NDIS_HANDLE MiniportAdapterHandle, _In_ __drv_aliasesMem WG
     return NDIS_STATUS_SUCCESS;
 }
 
+/* The crypto engine is selected by the CryptoEngine adapter keyword, where 0 is software and 1 is a simulated offload
+ * engine, whose completion latency in microseconds comes from CryptoEngineLatency. A nonzero PrecomputeKeystream
+ * has encryption workers spend idle time on keystream for the next packets of peers sending small packets. A nonzero
+ * PacketArenaSize asks for a packet arena of that many megabytes, which is shared by all adapters, and so sized by
+ * the first one that asks for it. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+ReadAdapterConfiguration(
+    _In_ NDIS_HANDLE MiniportAdapterHandle,
+    _Out_ CRYPTO_ENGINE_TYPE *Type,
+    _Out_ ULONG *LatencyUs,
+    _Out_ BOOLEAN *PrecomputeKeystream,
+    _Out_ ULONG *PacketArenaMegabytes)
+{
+    NDIS_CONFIGURATION_OBJECT ConfigurationObject = { .Header = { .Type = NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT,
+                                                                  .Revision = NDIS_CONFIGURATION_OBJECT_REVISION_1,
+                                                                  .Size = NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1 },
+                                                      .NdisHandle = MiniportAdapterHandle };
+    NDIS_HANDLE Configuration;
+    NDIS_CONFIGURATION_PARAMETER *Parameter;
+    NDIS_STATUS Status;
+
+    *Type = CRYPTO_ENGINE_SOFTWARE;
+    *LatencyUs = 0;
+    *PrecomputeKeystream = FALSE;
+    *PacketArenaMegabytes = 0;
+    if (NdisOpenConfigurationEx(&ConfigurationObject, &Configuration) != NDIS_STATUS_SUCCESS)
+        return;
+
+    NDIS_STRING EngineKeyword = NDIS_STRING_CONST("CryptoEngine");
+    NdisReadConfiguration(&Status, &Parameter, Configuration, &EngineKeyword, NdisParameterInteger);
+    if (Status == NDIS_STATUS_SUCCESS && Parameter->ParameterData.IntegerData < CRYPTO_ENGINE_TYPE_MAX)
+        *Type = (CRYPTO_ENGINE_TYPE)Parameter->ParameterData.IntegerData;
+
+    NDIS_STRING LatencyKeyword = NDIS_STRING_CONST("CryptoEngineLatency");
+    NdisReadConfiguration(&Status, &Parameter, Configuration, &LatencyKeyword, NdisParameterInteger);
+    if (Status == NDIS_STATUS_SUCCESS)
+        *LatencyUs = Parameter->ParameterData.IntegerData;
+
+    NDIS_STRING PrecomputeKeyword = NDIS_STRING_CONST("PrecomputeKeystream");
+    NdisReadConfiguration(&Status, &Parameter, Configuration, &PrecomputeKeyword, NdisParameterInteger);
+    if (Status == NDIS_STATUS_SUCCESS)
+        *PrecomputeKeystream = !!Parameter->ParameterData.IntegerData;
+
+    NDIS_STRING ArenaKeyword = NDIS_STRING_CONST("PacketArenaSize");
+    NdisReadConfiguration(&Status, &Parameter, Configuration, &ArenaKeyword, NdisParameterInteger);
+    if (Status == NDIS_STATUS_SUCCESS)
+        *PacketArenaMegabytes = Parameter->ParameterData.IntegerData;
+
+    NdisCloseConfiguration(Configuration);
+}
+
 static MINIPORT_INITIALIZE InitializeEx;
 _Use_decl_annotations_
 static NDIS_STATUS
@@ -567,12 +862,21 @@ InitializeEx(
      * Revisit this when we drop support for old Windows versions. */
     Wg->FunctionalDeviceObject->Reserved = Wg;
 
-    ExInitializeRundownProtection(&Wg->ItemsInFlight);
-    ExRundownCompleted(&Wg->ItemsInFlight); /* Wait until Restart is called to mark this active. */
+    /* Every packet on its way out holds a reference on this, taken by whichever CPU NDIS calls us on, so spread the
+     * count over per-CPU cache lines rather than having every sender bounce a single one around.
+     */
+    Wg->ItemsInFlight = ExAllocateCacheAwareRundownProtection(NonPagedPool, MEMORY_TAG);
+    if (!Wg->ItemsInFlight)
+    {
+        Status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanupWg;
+    }
+    ExRundownCompletedCacheAware(Wg->ItemsInFlight); /* Wait until Restart is called to mark this active. */
 
     MuInitializePushLock(&Wg->StaticIdentity.Lock);
     MuInitializePushLock(&Wg->SocketUpdateLock);
     MuInitializePushLock(&Wg->DeviceUpdateLock);
+    SeqcountInit(&Wg->ConfigSeq);
     PeerSerialInit(&Wg->TxQueue);
     PeerSerialInit(&Wg->RxQueue);
     PeerSerialInit(&Wg->HandshakeTxQueue);
@@ -584,7 +888,7 @@ InitializeEx(
 
     Wg->PeerHashtable = PubkeyHashtableAlloc();
     if (!Wg->PeerHashtable)
-        goto cleanupWg;
+        goto cleanupItemsInFlight;
 
     Wg->IndexHashtable = IndexHashtableAlloc();
     if (!Wg->IndexHashtable)
@@ -604,10 +908,35 @@ InitializeEx(
         NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_RCV | NDIS_STATISTICS_FLAGS_VALID_DIRECTED_BYTES_XMIT |
         NDIS_STATISTICS_FLAGS_VALID_MULTICAST_BYTES_XMIT | NDIS_STATISTICS_FLAGS_VALID_BROADCAST_BYTES_XMIT;
 
-    Status = PtrRingInit(&Wg->EncryptQueue, MAX_QUEUED_PACKETS);
+    CRYPTO_ENGINE_TYPE EngineType;
+    ULONG EngineLatencyUs, PacketArenaMegabytes;
+    ReadAdapterConfiguration(
+        MiniportAdapterHandle, &EngineType, &EngineLatencyUs, &Wg->PrecomputeKeystream, &PacketArenaMegabytes);
+    MemPacketArenaInit(PacketArenaMegabytes);
+    Status = CryptoEngineInit(
+        &Wg->EncryptEngine,
+        EngineType,
+        EngineLatencyUs,
+        PacketEncryptTransform,
+        PacketEncryptComplete,
+        PacketEncryptNotify);
     if (!NT_SUCCESS(Status))
         goto cleanupIndexHashtable;
 
+    Status = CryptoEngineInit(
+        &Wg->DecryptEngine,
+        EngineType,
+        EngineLatencyUs,
+        PacketDecryptTransform,
+        PacketDecryptComplete,
+        PacketDecryptNotify);
+    if (!NT_SUCCESS(Status))
+        goto cleanupEncryptEngine;
+
+    Status = PtrRingInit(&Wg->EncryptQueue, MAX_QUEUED_PACKETS);
+    if (!NT_SUCCESS(Status))
+        goto cleanupDecryptEngine;
+
     Status = PtrRingInit(&Wg->DecryptQueue, MAX_QUEUED_PACKETS);
     if (!NT_SUCCESS(Status))
         goto cleanupEncryptQueue;
@@ -616,52 +945,44 @@ InitializeEx(
     if (!NT_SUCCESS(Status))
         goto cleanupDecryptQueue;
 
-    Status = MulticoreWorkQueueInit(&Wg->EncryptThreads, PacketEncryptWorker);
+    Status = MulticoreWorkQueueInit(&Wg->Workers, PacketWorker);
     if (!NT_SUCCESS(Status))
         goto cleanupHandshakeRxQueue;
 
-    Status = MulticoreWorkQueueInit(&Wg->DecryptThreads, PacketDecryptWorker);
-    if (!NT_SUCCESS(Status))
-        goto cleanupEncryptThreads;
-
-    Status = MulticoreWorkQueueInit(&Wg->HandshakeTxThreads, PacketHandshakeTxWorker);
-    if (!NT_SUCCESS(Status))
-        goto cleanupDecryptThreads;
-
-    Status = MulticoreWorkQueueInit(&Wg->HandshakeRxThreads, PacketHandshakeRxWorker);
-    if (!NT_SUCCESS(Status))
-        goto cleanupHandshakeTxThreads;
-
     Status = RegisterAdapter(MiniportAdapterHandle, Wg);
     if (!NT_SUCCESS(Status))
-        goto cleanupHandshakeRxThreads;
+        goto cleanupWorkers;
 
     MuAcquirePushLockExclusive(&DeviceListLock);
     InsertHeadList(&DeviceList, &Wg->DeviceList);
     MuReleasePushLockExclusive(&DeviceListLock);
 
+    if (EngineType != CRYPTO_ENGINE_SOFTWARE)
+        LogInfo(Wg, "Using %s crypto engine with %u us latency", CryptoEngineName(&Wg->EncryptEngine), EngineLatencyUs);
     LogInfo(Wg, "Interface created");
 
     return NDIS_STATUS_SUCCESS;
 
-cleanupHandshakeRxThreads:
-    MulticoreWorkQueueDestroy(&Wg->HandshakeRxThreads);
-cleanupHandshakeTxThreads:
-    MulticoreWorkQueueDestroy(&Wg->HandshakeTxThreads);
-cleanupDecryptThreads:
-    MulticoreWorkQueueDestroy(&Wg->DecryptThreads);
-cleanupEncryptThreads:
-    MulticoreWorkQueueDestroy(&Wg->EncryptThreads);
+cleanupWorkers:
+    CryptoEngineStop(&Wg->DecryptEngine);
+    CryptoEngineStop(&Wg->EncryptEngine);
+    MulticoreWorkQueueDestroy(&Wg->Workers);
 cleanupHandshakeRxQueue:
     PtrRingFree(&Wg->HandshakeRxQueue);
 cleanupDecryptQueue:
     PtrRingFree(&Wg->DecryptQueue);
 cleanupEncryptQueue:
     PtrRingFree(&Wg->EncryptQueue);
+cleanupDecryptEngine:
+    CryptoEngineDestroy(&Wg->DecryptEngine);
+cleanupEncryptEngine:
+    CryptoEngineDestroy(&Wg->EncryptEngine);
 cleanupIndexHashtable:
     MemFree(Wg->IndexHashtable);
 cleanupPeerHashtable:
     MemFree(Wg->PeerHashtable);
+cleanupItemsInFlight:
+    ExFreeCacheAwareRundownProtection(Wg->ItemsInFlight);
 cleanupWg:
     MemFree(Wg);
     if (Status == STATUS_INSUFFICIENT_RESOURCES)
@@ -951,6 +1272,10 @@ DeviceDriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
     if (NdisVersion > NDIS_MINIPORT_VERSION_MAX)
         NdisVersion = NDIS_MINIPORT_VERSION_MAX;
 
+    Status = InitCacheTrimmer();
+    if (!NT_SUCCESS(Status))
+        goto cleanupIpInterfaceNotifierBugWorkaround;
+
     NDIS_MINIPORT_DRIVER_CHARACTERISTICS Miniport = {
         .Header = { .Type = NDIS_OBJECT_TYPE_MINIPORT_DRIVER_CHARACTERISTICS,
                     .Revision = NdisVersion < NDIS_RUNTIME_VERSION_680
@@ -984,10 +1309,12 @@ DeviceDriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
     };
     Status = NdisMRegisterMiniportDriver(DriverObject, RegistryPath, NULL, &Miniport, &NdisMiniportDriverHandle);
     if (!NT_SUCCESS(Status))
-        goto cleanupIpInterfaceNotifierBugWorkaround;
+        goto cleanupCacheTrimmer;
     IoctlDriverEntry(DriverObject);
     return STATUS_SUCCESS;
 
+cleanupCacheTrimmer:
+    UninitCacheTrimmer();
 cleanupIpInterfaceNotifierBugWorkaround:
     UninitIpInterfaceNotifierBugWorkaround();
 cleanupIpInterfaceNotifier:
@@ -998,6 +1325,7 @@ cleanupIpInterfaceNotifier:
 VOID DeviceUnload(VOID)
 {
     NdisMDeregisterMiniportDriver(NdisMiniportDriverHandle);
+    UninitCacheTrimmer();
     UninitIpInterfaceNotifierBugWorkaround();
     CancelMibChangeNotify2(IpInterfaceNotifier);
     RcuBarrier();
@@ -8,6 +8,7 @@
 #include "allowedips.h"
 #include "containers.h"
 #include "cookie.h"
+#include "cryptoengine.h"
 #include "noise.h"
 #include "peerlookup.h"
 #include "rcu.h"
@@ -56,13 +57,15 @@ typedef struct _PEER_SERIAL_ENTRY PEER_SERIAL_ENTRY;
 struct _PEER_SERIAL_ENTRY
 {
     PEER_SERIAL_ENTRY *Next;
-    SHORT Requeue;
+    LONG State;
 };
 
 typedef struct _PEER_SERIAL
 {
-    PEER_SERIAL_ENTRY *First, **Last;
-    KSPIN_LOCK Lock;
+    DECLSPEC_CACHEALIGN PEER_SERIAL_ENTRY *Head;
+    DECLSPEC_CACHEALIGN PEER_SERIAL_ENTRY *Tail;
+    KSPIN_LOCK ConsumerLock;
+    PEER_SERIAL_ENTRY Empty;
 } PEER_SERIAL;
 
 typedef struct _WG_DEVICE
@@ -70,18 +73,20 @@ typedef struct _WG_DEVICE
     NDIS_HANDLE MiniportAdapterHandle; /* This is actually a pointer to NDIS_MINIPORT_BLOCK struct. */
     DEVICE_OBJECT *FunctionalDeviceObject;
     NDIS_STATISTICS_INFO Statistics;
-    EX_RUNDOWN_REF ItemsInFlight;
+    EX_RUNDOWN_REF_CACHE_AWARE *ItemsInFlight;
     PTR_RING EncryptQueue, DecryptQueue, HandshakeRxQueue;
     PEER_SERIAL TxQueue, RxQueue, HandshakeTxQueue;
-    MULTICORE_WORKQUEUE EncryptThreads, DecryptThreads;
-    MULTICORE_WORKQUEUE HandshakeTxThreads, HandshakeRxThreads;
+    MULTICORE_WORKQUEUE Workers;
+    CRYPTO_ENGINE EncryptEngine, DecryptEngine;
     SOCKET __rcu *Sock4, *Sock6;
     NOISE_STATIC_IDENTITY StaticIdentity;
     COOKIE_CHECKER CookieChecker;
     PUBKEY_HASHTABLE *PeerHashtable;
     INDEX_HASHTABLE *IndexHashtable;
     ALLOWEDIPS_TABLE PeerAllowedIps;
+    WG_PEER __rcu *SolePeer; /* Set when every address routes to one peer, letting packets skip the lookups. */
     EX_PUSH_LOCK DeviceUpdateLock, SocketUpdateLock;
+    SEQCOUNT ConfigSeq; /* Written while holding DeviceUpdateLock exclusively, so that readers can skip it. */
     LIST_ENTRY PeerList;
     ULONG NumPeers;
     NET_IFINDEX InterfaceIndex;
@@ -89,6 +94,7 @@ typedef struct _WG_DEVICE
     PEPROCESS SocketOwnerProcess;
     UINT16 IncomingPort;
     BOOLEAN IsUp, IsDeviceRemoving;
+    BOOLEAN PrecomputeKeystream;
     ULONG Mtu4, Mtu6;
     ULONG HandshakeRxQueueLen;
     LOG_RING Log;
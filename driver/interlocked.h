@@ -43,6 +43,20 @@ static inline VOID WriteMemoryBarrier(VOID)
     _ReadWriteBarrier();
 }
 
+static inline VOID ReadMemoryBarrier(VOID)
+{
+#if defined(_ARM64_)
+    __dmb(_ARM64_BARRIER_ISHLD);
+#elif defined(_ARM_)
+    __dmb(_ARM_BARRIER_ISH);
+#elif defined(_AMD64_) || defined(_X86_)
+    /* Strong ordering on Intel */
+#else
+#    error "Unknown arch. Consult smp_rmb."
+#endif
+    _ReadWriteBarrier();
+}
+
 #ifdef _WIN64
 #    define InterlockedBitTestAndSetPtr(Addr, Nr) InterlockedBitTestAndSet64(Addr, Nr)
 #else
@@ -130,6 +144,45 @@ KrefPut(_Inout_ KREF *Kref, _In_ VOID (*Release)(_In_ KREF *Kref))
     return FALSE;
 }
 
+/* Writers must be serialized by some other lock. Readers sample the count, read the data, and then retry if the count
+ * has moved, which means that they never block writers nor each other. */
+typedef LONG SEQCOUNT;
+
+static inline VOID
+SeqcountInit(_Out_ SEQCOUNT *Seq)
+{
+    WriteRaw(Seq, 0);
+}
+
+static inline VOID
+SeqcountWriteBegin(_Inout_ SEQCOUNT *Seq)
+{
+    InterlockedIncrement(Seq);
+}
+
+static inline VOID
+SeqcountWriteEnd(_Inout_ SEQCOUNT *Seq)
+{
+    InterlockedIncrement(Seq);
+}
+
+/* Returns FALSE while a writer is active, in which case the caller should back off and try again later. */
+_Must_inspect_result_
+static inline BOOLEAN
+SeqcountTryReadBegin(_In_ SEQCOUNT *Seq, _Out_ LONG *Start)
+{
+    *Start = ReadAcquire(Seq);
+    return !(*Start & 1);
+}
+
+_Must_inspect_result_
+static inline BOOLEAN
+SeqcountReadRetry(_In_ SEQCOUNT *Seq, _In_ LONG Start)
+{
+    ReadMemoryBarrier();
+    return ReadNoFence(Seq) != Start;
+}
+
 _IRQL_requires_max_(APC_LEVEL)
 static inline VOID
 MuInitializePushLock(_Out_ PEX_PUSH_LOCK PushLock)
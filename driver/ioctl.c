@@ -84,43 +84,39 @@ HasAccess(_In_ ACCESS_MASK DesiredAccess, _In_ KPROCESSOR_MODE AccessMode, _Out_
     return HasAccess;
 }
 
-_IRQL_requires_max_(PASSIVE_LEVEL)
-static VOID
-Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+enum
 {
-    Irp->IoStatus.Information = 0;
-    if (!HasAccess(FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
-        return;
-
-    WG_IOCTL_INTERFACE *IoctlInterface = NULL;
-    if (Irp->MdlAddress)
-    {
-        IoctlInterface = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
-        if (!IoctlInterface)
-        {
-            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
-            return;
-        }
-    }
-
-    WG_DEVICE *Wg = DeviceObject->Reserved;
-    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
-    {
-        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
-        return;
-    }
+    GET_LOCKLESS_ATTEMPTS = 8,
+    GET_RETRY_DELAY_SYS_TIME_UNITS = 10000, /* 1 ms */
+    GET_ENTRIES_PER_RCU_SECTION = 512
+};
 
-    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+/* This walks PeerList and each peer's allowed IPs lists without holding DeviceUpdateLock. Those lists are only changed
+ * inside of ConfigSeq write sections, or after IoctlHalt has shut GET out, and everything on them is freed via RCU, so
+ * it is safe to follow each link as long as ConfigSeq is checked before the link is dereferenced. Returns FALSE if a
+ * writer raced us, in which case the partially filled output must be discarded and the snapshot taken again.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static BOOLEAN
+GetSnapshot(
+    _In_ WG_DEVICE *Wg,
+    _Out_writes_bytes_opt_(OutSize) WG_IOCTL_INTERFACE *IoctlInterface,
+    _In_ ULONG OutSize,
+    _Out_ ULONG64 *FinalSizeOut)
+{
+    LONG Seq;
+    if (!SeqcountTryReadBegin(&Wg->ConfigSeq, &Seq))
+        return FALSE;
 
-    ULONG OutSize = IoctlInterface ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
     ULONG64 FinalSize = sizeof(WG_IOCTL_INTERFACE);
     if (OutSize >= FinalSize)
     {
         IoctlInterface->Flags = 0;
         IoctlInterface->PeersCount = 0;
-        if (Wg->IncomingPort != 0)
+        UINT16 IncomingPort = ReadUShortNoFence(&Wg->IncomingPort);
+        if (IncomingPort != 0)
         {
-            IoctlInterface->ListenPort = Wg->IncomingPort;
+            IoctlInterface->ListenPort = IncomingPort;
             IoctlInterface->Flags |= WG_IOCTL_INTERFACE_HAS_LISTEN_PORT;
         }
         MuAcquirePushLockShared(&Wg->StaticIdentity.Lock);
@@ -134,9 +130,16 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
     }
 
     WG_IOCTL_PEER *IoctlPeer = (WG_IOCTL_PEER *)((UCHAR *)IoctlInterface + sizeof(WG_IOCTL_INTERFACE));
-    WG_PEER *Peer;
-    LIST_FOR_EACH_ENTRY (Peer, &Wg->PeerList, WG_PEER, PeerList)
+    ULONG EntriesInSection = 0;
+    KIRQL Irql = RcuReadLock();
+    for (LIST_ENTRY *PeerEntry = RcuDereference(LIST_ENTRY, Wg->PeerList.Flink);;)
     {
+        if (SeqcountReadRetry(&Wg->ConfigSeq, Seq))
+            goto raced;
+        if (PeerEntry == &Wg->PeerList)
+            break;
+        WG_PEER *Peer = CONTAINING_RECORD(PeerEntry, WG_PEER, PeerList);
+
         FinalSize += sizeof(WG_IOCTL_PEER);
         if (OutSize >= FinalSize)
         {
@@ -144,11 +147,12 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
             IoctlPeer->Flags = WG_IOCTL_PEER_HAS_PERSISTENT_KEEPALIVE;
             IoctlPeer->ProtocolVersion = 1;
             IoctlPeer->PersistentKeepalive = Peer->PersistentKeepaliveInterval;
-            IoctlPeer->RxBytes = Peer->RxBytes;
-            IoctlPeer->TxBytes = Peer->TxBytes;
-            IoctlPeer->LastHandshake = Peer->WalltimeLastHandshake.QuadPart;
+            IoctlPeer->RxBytes = ReadULong64NoFence(&Peer->RxBytes);
+            IoctlPeer->TxBytes = ReadULong64NoFence(&Peer->TxBytes);
+            IoctlPeer->LastHandshake = ReadNoFence64(&Peer->WalltimeLastHandshake.QuadPart);
             IoctlPeer->AllowedIPsCount = 0;
-            MuAcquirePushLockShared(&Peer->Handshake.Lock);
+            /* The remote static key never changes, and the preshared key is only written under DeviceUpdateLock, so
+             * ConfigSeq covers both, without needing Handshake.Lock, which cannot be taken at DISPATCH_LEVEL. */
             RtlCopyMemory(IoctlPeer->PublicKey, Peer->Handshake.RemoteStatic, NOISE_PUBLIC_KEY_LEN);
             IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_PUBLIC_KEY;
             if (!CryptoIsZero32(Peer->Handshake.PresharedKey))
@@ -156,9 +160,7 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
                 RtlCopyMemory(IoctlPeer->PresharedKey, Peer->Handshake.PresharedKey, NOISE_SYMMETRIC_KEY_LEN);
                 IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_PRESHARED_KEY;
             }
-            MuReleasePushLockShared(&Peer->Handshake.Lock);
-            KIRQL Irql;
-            Irql = ExAcquireSpinLockShared(&Peer->EndpointLock);
+            ExAcquireSpinLockSharedAtDpcLevel(&Peer->EndpointLock);
             if (Peer->Endpoint.Addr.si_family == AF_INET)
             {
                 IoctlPeer->Endpoint.Ipv4 = Peer->Endpoint.Addr.Ipv4;
@@ -169,28 +171,115 @@ Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
                 IoctlPeer->Endpoint.Ipv6 = Peer->Endpoint.Addr.Ipv6;
                 IoctlPeer->Flags |= WG_IOCTL_PEER_HAS_ENDPOINT;
             }
-            ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
+            ExReleaseSpinLockSharedFromDpcLevel(&Peer->EndpointLock);
         }
 
         WG_IOCTL_ALLOWED_IP *IoctlAllowedIp = (WG_IOCTL_ALLOWED_IP *)((UCHAR *)IoctlPeer + sizeof(WG_IOCTL_PEER));
-        ALLOWEDIPS_NODE *AllowedIpsNode;
         ULONG AllowedIpsLimit = MAXULONG;
-        LIST_FOR_EACH_ENTRY (AllowedIpsNode, &Peer->AllowedIpsList, ALLOWEDIPS_NODE, PeerList)
+        /* Entries hidden below one of the peer's aggregates are kept on a list of their own. */
+        LIST_ENTRY *AllowedIpsLists[] = { &Peer->AllowedIpsList, &Peer->AllowedIpsDetachedList };
+        for (ULONG i = 0; i < ARRAYSIZE(AllowedIpsLists) && AllowedIpsLimit; ++i)
         {
-            if (!(--AllowedIpsLimit))
-                break;
-            FinalSize += sizeof(WG_IOCTL_ALLOWED_IP);
-            if (OutSize >= FinalSize)
+            for (LIST_ENTRY *AllowedIpsEntry = RcuDereference(LIST_ENTRY, AllowedIpsLists[i]->Flink);;)
             {
-                ++IoctlPeer->AllowedIPsCount;
-                IoctlAllowedIp->AddressFamily =
-                    AllowedIpsReadNode(AllowedIpsNode, (UINT8 *)&IoctlAllowedIp->Address, &IoctlAllowedIp->Cidr);
+                if (SeqcountReadRetry(&Wg->ConfigSeq, Seq))
+                    goto raced;
+                if (AllowedIpsEntry == AllowedIpsLists[i])
+                    break;
+                ALLOWEDIPS_NODE *AllowedIpsNode = CONTAINING_RECORD(AllowedIpsEntry, ALLOWEDIPS_NODE, PeerList);
+                if (!(--AllowedIpsLimit))
+                    break;
+                if (AllowedIpsIsEntry(AllowedIpsNode))
+                {
+                    FinalSize += sizeof(WG_IOCTL_ALLOWED_IP);
+                    if (OutSize >= FinalSize)
+                    {
+                        ++IoctlPeer->AllowedIPsCount;
+                        IoctlAllowedIp->AddressFamily = AllowedIpsReadNode(
+                            AllowedIpsNode, (UINT8 *)&IoctlAllowedIp->Address, &IoctlAllowedIp->Cidr);
+                    }
+                    ++IoctlAllowedIp;
+                }
+                ++EntriesInSection;
+                AllowedIpsEntry = RcuDereference(LIST_ENTRY, AllowedIpsNode->PeerList.Flink);
             }
-            ++IoctlAllowedIp;
         }
         IoctlPeer = (WG_IOCTL_PEER *)IoctlAllowedIp;
+        PeerEntry = RcuDereference(LIST_ENTRY, Peer->PeerList.Flink);
+
+        /* Don't sit at DISPATCH_LEVEL for the whole dump. If ConfigSeq is unchanged after we return, then Peer is still
+         * on the list, and hence was not freed, so PeerEntry remains good. */
+        if (++EntriesInSection >= GET_ENTRIES_PER_RCU_SECTION)
+        {
+            RcuReadUnlock(Irql);
+            EntriesInSection = 0;
+            Irql = RcuReadLock();
+        }
+    }
+    RcuReadUnlock(Irql);
+
+    *FinalSizeOut = FinalSize;
+    return TRUE;
+
+raced:
+    RcuReadUnlock(Irql);
+    return FALSE;
+}
+
+/* Takes a snapshot without holding off configuration changes if it can, and by holding them off if they keep racing
+ * it. Returns how many passes that took, which is more than GET_LOCKLESS_ATTEMPTS if the last one held them off.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static ULONG
+GetConfiguration(
+    _In_ WG_DEVICE *Wg,
+    _Out_writes_bytes_opt_(OutSize) WG_IOCTL_INTERFACE *IoctlInterface,
+    _In_ ULONG OutSize,
+    _Out_ ULONG64 *FinalSize)
+{
+    for (ULONG Attempt = 1; Attempt <= GET_LOCKLESS_ATTEMPTS; ++Attempt)
+    {
+        if (GetSnapshot(Wg, IoctlInterface, OutSize, FinalSize))
+            return Attempt;
+        if (Attempt < GET_LOCKLESS_ATTEMPTS)
+            KeDelayExecutionThread(KernelMode, FALSE, &(LARGE_INTEGER){ .QuadPart = -GET_RETRY_DELAY_SYS_TIME_UNITS });
+    }
+    /* Configuration changes keep racing us, so hold them off for one final pass, which cannot fail. */
+    MuAcquirePushLockShared(&Wg->DeviceUpdateLock);
+    GetSnapshot(Wg, IoctlInterface, OutSize, FinalSize);
+    MuReleasePushLockShared(&Wg->DeviceUpdateLock);
+    return GET_LOCKLESS_ATTEMPTS + 1;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+Get(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    Irp->IoStatus.Information = 0;
+    if (!HasAccess(FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+
+    WG_IOCTL_INTERFACE *IoctlInterface = NULL;
+    if (Irp->MdlAddress)
+    {
+        IoctlInterface = MmGetSystemAddressForMdlSafe(Irp->MdlAddress, NormalPagePriority | MdlMappingNoExecute);
+        if (!IoctlInterface)
+        {
+            Irp->IoStatus.Status = STATUS_INSUFFICIENT_RESOURCES;
+            return;
+        }
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
     }
-    MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+
+    ULONG OutSize = IoctlInterface ? MmGetMdlByteCount(Irp->MdlAddress) : 0;
+    ULONG64 FinalSize;
+    GetConfiguration(Wg, IoctlInterface, OutSize, &FinalSize);
 
     Irp->IoStatus.Status = OutSize >= FinalSize    ? STATUS_SUCCESS
                            : FinalSize <= MAXULONG ? STATUS_BUFFER_OVERFLOW
@@ -218,7 +307,7 @@ SetListenPort(_Inout_ WG_DEVICE *Wg, _In_ USHORT ListenPort)
 _Requires_lock_held_(Wg->DeviceUpdateLock)
 _Must_inspect_result_
 static NTSTATUS
-SetPrivateKey(_Inout_ WG_DEVICE *Wg, _In_ CONST UCHAR PrivateKey[WG_KEY_LEN])
+SetPrivateKey(_Inout_ WG_DEVICE *Wg, _In_ CONST UCHAR PrivateKey[WG_KEY_LEN], _Inout_ LIST_ENTRY *Removed)
 {
     UINT8 PublicKey[NOISE_PUBLIC_KEY_LEN];
     WG_PEER *Peer, *Temp;
@@ -233,7 +322,8 @@ SetPrivateKey(_Inout_ WG_DEVICE *Wg, _In_ CONST UCHAR PrivateKey[WG_KEY_LEN])
         {
             PeerPut(Peer);
             _Analysis_assume_same_lock_(Peer->Device->DeviceUpdateLock, Wg->DeviceUpdateLock);
-            PeerRemove(Peer);
+            PeerUnlink(Peer);
+            InsertTailList(Removed, &Peer->PeerList);
         }
     }
 
@@ -254,7 +344,11 @@ SetPrivateKey(_Inout_ WG_DEVICE *Wg, _In_ CONST UCHAR PrivateKey[WG_KEY_LEN])
 _Requires_lock_held_(Wg->DeviceUpdateLock)
 _Must_inspect_result_
 static NTSTATUS
-SetPeer(_Inout_ WG_DEVICE *Wg, _Inout_ CONST volatile WG_IOCTL_PEER **UnsafeIoctlPeerPtr, _Inout_ ULONG *RemainingSize)
+SetPeer(
+    _Inout_ WG_DEVICE *Wg,
+    _Inout_ CONST volatile WG_IOCTL_PEER **UnsafeIoctlPeerPtr,
+    _Inout_ ULONG *RemainingSize,
+    _Inout_ LIST_ENTRY *Removed)
 {
     if (*RemainingSize < sizeof(WG_IOCTL_PEER))
         return STATUS_INVALID_PARAMETER;
@@ -317,7 +411,8 @@ SetPeer(_Inout_ WG_DEVICE *Wg, _Inout_ CONST volatile WG_IOCTL_PEER **UnsafeIoct
     if (IoctlPeer.Flags & WG_IOCTL_PEER_REMOVE)
     {
         _Analysis_assume_same_lock_(Peer->Device->DeviceUpdateLock, Wg->DeviceUpdateLock);
-        PeerRemove(Peer);
+        PeerUnlink(Peer);
+        InsertTailList(Removed, &Peer->PeerList);
         Status = STATUS_SUCCESS;
         goto cleanupPeer;
     }
@@ -387,6 +482,11 @@ cleanupStack:
     return Status;
 }
 
+#ifdef DBG
+/* How long the last SetInterface held DeviceUpdateLock, in performance counter ticks, for the scale self-test. */
+static LONG64 SetInterfaceLockHeld;
+#endif
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 static NTSTATUS
 SetInterface(
@@ -400,9 +500,23 @@ SetInterface(
 
     WG_IOCTL_INTERFACE IoctlInterface = *UnsafeIoctlInterface;
 
+#ifdef DBG
+    LARGE_INTEGER Frequency, Begin = KeQueryPerformanceCounter(&Frequency);
+#endif
     MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+#ifdef DBG
+    LONG64 Locked = KeQueryPerformanceCounter(NULL).QuadPart;
+#endif
 
+    /* Whatever blocks is kept out of the ConfigSeq write section, so that GET only ever has to wait for the new
+     * configuration to be published: the listen port is a single value that GET reads on its own, peers that are
+     * replaced are stopped while GET may still report them, and peers that are removed are only stopped after.
+     */
     NTSTATUS Status;
+    ULONG PeersSet = 0;
+    LIST_ENTRY Replaced, Removed;
+    InitializeListHead(&Replaced);
+    InitializeListHead(&Removed);
     if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_HAS_LISTEN_PORT)
     {
         Status = SetListenPort(Wg, IoctlInterface.ListenPort);
@@ -411,28 +525,55 @@ SetInterface(
     }
 
     if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_REPLACE_PEERS)
-        PeerRemoveAll(Wg);
+        PeerStopAll(Wg);
+
+    SeqcountWriteBegin(&Wg->ConfigSeq);
+    /* Packets go through the full lookups until the new configuration has been looked at. */
+    RcuInitPointer(Wg->SolePeer, NULL);
+
+    if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_REPLACE_PEERS)
+        PeerUnlinkAll(Wg, &Replaced);
 
     if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_HAS_PRIVATE_KEY)
     {
-        Status = SetPrivateKey(Wg, IoctlInterface.PrivateKey);
+        Status = SetPrivateKey(Wg, IoctlInterface.PrivateKey, &Removed);
         if (!NT_SUCCESS(Status))
-            goto cleanupLock;
+            goto cleanupSection;
     }
 
     CONST volatile WG_IOCTL_PEER *UnsafeIoctlPeer =
         (CONST volatile WG_IOCTL_PEER *)((UCHAR *)UnsafeIoctlInterface + sizeof(WG_IOCTL_INTERFACE));
-    for (ULONG i = 0; i < IoctlInterface.PeersCount; ++i)
+    for (; PeersSet < IoctlInterface.PeersCount; ++PeersSet)
     {
-        Status = SetPeer(Wg, &UnsafeIoctlPeer, RemainingSize);
+        Status = SetPeer(Wg, &UnsafeIoctlPeer, RemainingSize, &Removed);
         if (!NT_SUCCESS(Status))
-            goto cleanupLock;
+            goto cleanupSection;
     }
 
     Status = STATUS_SUCCESS;
+cleanupSection:
+    RcuAssignPointer(Wg->SolePeer, AllowedIpsSolePeer(&Wg->PeerAllowedIps, &Wg->DeviceUpdateLock));
+    SeqcountWriteEnd(&Wg->ConfigSeq);
+    PeerPutUnlinked(Wg, &Removed, FALSE);
+    if (IoctlInterface.Flags & WG_IOCTL_INTERFACE_REPLACE_PEERS)
+    {
+        PeerPutUnlinked(Wg, &Replaced, TRUE);
+        RcuSynchronize();
+    }
 cleanupLock:
     MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+#ifdef DBG
+    LONG64 Unlocked = KeQueryPerformanceCounter(NULL).QuadPart;
+    WriteNoFence64(&SetInterfaceLockHeld, Unlocked - Locked);
+#endif
     RtlSecureZeroMemory(&IoctlInterface, sizeof(IoctlInterface));
+#ifdef DBG
+    LogDebug(
+        "Configuration of %lu peers applied in %llu us, holding the update lock for %llu us",
+        PeersSet,
+        (Unlocked - Begin.QuadPart) * 1000000 / Frequency.QuadPart,
+        (Unlocked - Locked) * 1000000 / Frequency.QuadPart);
+#endif
     return Status;
 }
 
@@ -534,10 +675,9 @@ AdapterState(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
         Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
         return;
     }
-    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
-    switch (Op)
+    if (Op == WG_IOCTL_ADAPTER_STATE_QUERY)
     {
-    case WG_IOCTL_ADAPTER_STATE_QUERY:
+        /* IsUp is a single flag, so this neither needs the update lock nor disturbs GET's snapshots. */
         if (Stack->Parameters.DeviceIoControl.OutputBufferLength == sizeof(Op))
         {
             Op = ReadBooleanNoFence(&Wg->IsUp) ? WG_IOCTL_ADAPTER_STATE_UP : WG_IOCTL_ADAPTER_STATE_DOWN;
@@ -546,7 +686,14 @@ AdapterState(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
         }
         else
             Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
-        break;
+        return;
+    }
+
+    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+    /* Up picks the listen port that GET reports when none was set. */
+    SeqcountWriteBegin(&Wg->ConfigSeq);
+    switch (Op)
+    {
     case WG_IOCTL_ADAPTER_STATE_DOWN:
         Irp->IoStatus.Status = Down(Wg);
         break;
@@ -556,6 +703,7 @@ AdapterState(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
     default:
         Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
     }
+    SeqcountWriteEnd(&Wg->ConfigSeq);
     MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
 }
 
@@ -585,6 +733,159 @@ ReadLogLine(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
         Irp->IoStatus.Information = sizeof(WG_IOCTL_LOG_ENTRY);
 }
 
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+SetPeerAcl(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    Irp->IoStatus.Information = 0;
+    if (!HasAccess(FILE_WRITE_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG InSize = Stack->Parameters.DeviceIoControl.InputBufferLength;
+    CONST WG_IOCTL_PEER_ACL *IoctlAcl = Irp->AssociatedIrp.SystemBuffer;
+    if (InSize < sizeof(*IoctlAcl) || IoctlAcl->RulesCount > WG_IOCTL_ACL_MAX_RULES ||
+        InSize != sizeof(*IoctlAcl) + IoctlAcl->RulesCount * sizeof(WG_IOCTL_ACL_RULE))
+    {
+        Irp->IoStatus.Status = STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    ACL_TABLE *Acl = NULL;
+    if (IoctlAcl->RulesCount)
+    {
+        Irp->IoStatus.Status = AclCompile((CONST WG_IOCTL_ACL_RULE *)(IoctlAcl + 1), IoctlAcl->RulesCount, &Acl);
+        if (!NT_SUCCESS(Irp->IoStatus.Status))
+            return;
+    }
+
+    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+    WG_PEER *Peer = PubkeyHashtableLookup(Wg->PeerHashtable, IoctlAcl->PublicKey);
+    if (!Peer)
+    {
+        MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+        AclFree(Acl);
+        Irp->IoStatus.Status = STATUS_NOT_FOUND;
+        return;
+    }
+    ACL_TABLE *OldAcl = RcuDereferenceProtected(ACL_TABLE, Peer->Acl, &Wg->DeviceUpdateLock);
+    RcuAssignPointer(Peer->Acl, Acl);
+    AclFreeRcu(OldAcl);
+    LogInfo(Wg, "Peer %llu ACL set to %lu rules", Peer->InternalId, IoctlAcl->RulesCount);
+    PeerPut(Peer);
+    MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+GetPeerAcl(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    Irp->IoStatus.Information = 0;
+    if (!HasAccess(FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    ULONG OutSize = Stack->Parameters.DeviceIoControl.OutputBufferLength;
+    WG_IOCTL_PEER_ACL *IoctlAcl = Irp->AssociatedIrp.SystemBuffer;
+    if (Stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*IoctlAcl) || OutSize < sizeof(*IoctlAcl))
+    {
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    WG_PEER *Peer = PubkeyHashtableLookup(Wg->PeerHashtable, IoctlAcl->PublicKey);
+    if (!Peer)
+    {
+        Irp->IoStatus.Status = STATUS_NOT_FOUND;
+        return;
+    }
+    ULONG NumRules = 0;
+    KIRQL Irql = RcuReadLock();
+    CONST ACL_TABLE *Acl = RcuDereference(ACL_TABLE, Peer->Acl);
+    if (Acl)
+    {
+        CONST WG_IOCTL_ACL_RULE *Rules = AclRules(Acl, &NumRules);
+        if (OutSize >= sizeof(*IoctlAcl) + NumRules * sizeof(*Rules))
+            RtlCopyMemory(IoctlAcl + 1, Rules, NumRules * sizeof(*Rules));
+    }
+    RcuReadUnlock(Irql);
+    PeerPut(Peer);
+
+    /* With METHOD_BUFFERED, Information is how much gets copied back, so it must never exceed the output buffer. */
+    IoctlAcl->RulesCount = NumRules;
+    if (OutSize < sizeof(*IoctlAcl) + NumRules * sizeof(WG_IOCTL_ACL_RULE))
+    {
+        Irp->IoStatus.Information = sizeof(*IoctlAcl);
+        Irp->IoStatus.Status = STATUS_BUFFER_OVERFLOW;
+        return;
+    }
+    Irp->IoStatus.Information = sizeof(*IoctlAcl) + NumRules * sizeof(WG_IOCTL_ACL_RULE);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+GetPeerStats(_In_ DEVICE_OBJECT *DeviceObject, _Inout_ IRP *Irp)
+{
+    Irp->IoStatus.Information = 0;
+    if (!HasAccess(FILE_READ_DATA, Irp->RequestorMode, &Irp->IoStatus.Status))
+        return;
+    IO_STACK_LOCATION *Stack = IoGetCurrentIrpStackLocation(Irp);
+    WG_IOCTL_PEER_STATS *IoctlStats = Irp->AssociatedIrp.SystemBuffer;
+    if (Stack->Parameters.DeviceIoControl.InputBufferLength < sizeof(*IoctlStats) ||
+        Stack->Parameters.DeviceIoControl.OutputBufferLength < sizeof(*IoctlStats))
+    {
+        Irp->IoStatus.Status = STATUS_BUFFER_TOO_SMALL;
+        return;
+    }
+
+    WG_DEVICE *Wg = DeviceObject->Reserved;
+    if (!Wg || ReadBooleanNoFence(&Wg->IsDeviceRemoving))
+    {
+        Irp->IoStatus.Status = NDIS_STATUS_ADAPTER_REMOVED;
+        return;
+    }
+
+    WG_PEER *Peer = PubkeyHashtableLookup(Wg->PeerHashtable, IoctlStats->PublicKey);
+    if (!Peer)
+    {
+        Irp->IoStatus.Status = STATUS_NOT_FOUND;
+        return;
+    }
+    CONST PEER_HANDSHAKE_STATS *Stats = &Peer->HandshakeStats;
+    LONG64 StagedWaitTime = ReadNoFence64(&Stats->StagedWaitTime), StagedSince = ReadNoFence64(&Stats->StagedSince);
+    if (StagedSince) /* Count a wait that is still going on, too. */
+        StagedWaitTime += (LONG64)KeQueryInterruptTime() - StagedSince;
+    /* These are written without any lock, so a racing update can leave one briefly behind, and negative after a
+     * subtraction. Report those as zero rather than as a huge unsigned value.
+     */
+    LONG64 LastRtt = ReadNoFence64(&Stats->LastRtt), MinRtt = ReadNoFence64(&Stats->MinRtt);
+    LONG64 SmoothedRtt = ReadNoFence64(&Stats->SmoothedRtt);
+    IoctlStats->LastHandshakeRtt = max(LastRtt, 0);
+    IoctlStats->MinHandshakeRtt = max(MinRtt, 0);
+    IoctlStats->SmoothedHandshakeRtt = max(SmoothedRtt, 0);
+    IoctlStats->StagedWaitTime = max(StagedWaitTime, 0);
+    IoctlStats->HandshakesCompleted = ReadNoFence(&Stats->HandshakesCompleted);
+    IoctlStats->HandshakeRetransmits = ReadNoFence(&Stats->Retransmits);
+    IoctlStats->CookieReplies = ReadNoFence(&Stats->CookieReplies);
+    PeerPut(Peer);
+    Irp->IoStatus.Information = sizeof(*IoctlStats);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+}
+
 _Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
 static DRIVER_DISPATCH_PAGED DispatchDeviceControl;
 _Use_decl_annotations_
@@ -606,6 +907,15 @@ DispatchDeviceControl(DEVICE_OBJECT *DeviceObject, IRP *Irp)
     case WG_IOCTL_READ_LOG_LINE:
         ReadLogLine(DeviceObject, Irp);
         break;
+    case WG_IOCTL_SET_PEER_ACL:
+        SetPeerAcl(DeviceObject, Irp);
+        break;
+    case WG_IOCTL_GET_PEER_ACL:
+        GetPeerAcl(DeviceObject, Irp);
+        break;
+    case WG_IOCTL_GET_PEER_STATS:
+        GetPeerStats(DeviceObject, Irp);
+        break;
     default:
         return NdisDispatchDeviceControl(DeviceObject, Irp);
     }
@@ -672,3 +982,7 @@ IoctlDriverEntry(DRIVER_OBJECT *DriverObject)
     DriverObject->MajorFunction[IRP_MJ_CREATE] = DispatchCreate;
     DriverObject->MajorFunction[IRP_MJ_PNP] = DispatchPnp;
 }
+
+#ifdef DBG
+#    include "selftest/ioctl.c"
+#endif
@@ -33,6 +33,43 @@ typedef __declspec(align(8)) struct _WG_IOCTL_ALLOWED_IP
     UCHAR Cidr;
 } WG_IOCTL_ALLOWED_IP;
 
+#define WG_IOCTL_ACL_MAX_RULES 64
+
+typedef __declspec(align(8)) struct _WG_IOCTL_ACL_RULE
+{
+    union
+    {
+        IN_ADDR V4;
+        IN6_ADDR V6;
+    } Address;
+    ADDRESS_FAMILY AddressFamily;
+    UCHAR Cidr;
+    UCHAR Protocol;  /* IPPROTO_* value, or 0 for any protocol. */
+    USHORT PortLow;  /* Inclusive, in host byte order. */
+    USHORT PortHigh; /* Inclusive, in host byte order. */
+} WG_IOCTL_ACL_RULE;
+
+typedef __declspec(align(8)) struct _WG_IOCTL_PEER_ACL
+{
+    UCHAR PublicKey[WG_KEY_LEN];
+    ULONG RulesCount;
+} WG_IOCTL_PEER_ACL;
+
+/* Durations are in 100ns units. Handshake round trips are measured from sending an initiation to processing the
+ * response to it, and are zero until one has completed.
+ */
+typedef __declspec(align(8)) struct _WG_IOCTL_PEER_STATS
+{
+    UCHAR PublicKey[WG_KEY_LEN];
+    ULONG64 LastHandshakeRtt;
+    ULONG64 MinHandshakeRtt;
+    ULONG64 SmoothedHandshakeRtt;
+    ULONG64 StagedWaitTime; /* Spent with packets staged but no session to send them with. */
+    ULONG HandshakesCompleted;
+    ULONG HandshakeRetransmits;
+    ULONG CookieReplies;
+} WG_IOCTL_PEER_STATS;
+
 typedef enum
 {
     WG_IOCTL_PEER_HAS_PUBLIC_KEY = 1 << 0,
@@ -111,6 +148,38 @@ typedef __declspec(align(8)) struct _WG_IOCTL_LOG_ENTRY
 /* Read the next line in the adapter log. */
 #define WG_IOCTL_READ_LOG_LINE CTL_CODE(45208U, 324, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
 
+/* Replace the inner traffic ACL of a peer.
+ *
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must describe a WG_IOCTL_PEER_ACL struct followed
+ * by RulesCount times WG_IOCTL_ACL_RULE struct, where RulesCount is at most WG_IOCTL_ACL_MAX_RULES. Rules describe
+ * this side of the tunnel: once a peer has any, only packets received from it with a destination, or sent to it with a
+ * source, that matches the prefix, protocol and port range of at least one rule are let through. Port ranges apply to
+ * TCP, UDP and SCTP, and other protocols only match rules that cover every port. Fragments past the first carry no
+ * ports, so they are matched on prefix and protocol alone, and cannot be reassembled without the first one anyway. A
+ * RulesCount of zero removes the ACL. The ACL belongs to the peer object, not to its public key: it is dropped when the
+ * peer is removed, and so a peer that is removed and added again, including by WG_IOCTL_INTERFACE_REPLACE_PEERS,
+ * comes back without one and needs its ACL set again.
+ */
+#define WG_IOCTL_SET_PEER_ACL CTL_CODE(45208U, 325, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Get handshake statistics of a peer.
+ *
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must describe a WG_IOCTL_PEER_STATS struct with
+ * PublicKey set, and lpOutBuffer and nOutBufferSize one to be filled with the statistics of that peer. Retransmits
+ * count initiations sent again because the previous one went unanswered, and cookie replies count the times the peer
+ * was under load and asked us to prove our address first.
+ */
+#define WG_IOCTL_GET_PEER_STATS CTL_CODE(45208U, 326, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
+/* Get the inner traffic ACL of a peer.
+ *
+ * The lpInBuffer and nInBufferSize parameters of DeviceIoControl() must describe a WG_IOCTL_PEER_ACL struct with
+ * PublicKey set, and lpOutBuffer and nOutBufferSize one to be filled with the rules of that peer, in the layout that
+ * WG_IOCTL_SET_PEER_ACL takes. A RulesCount of zero means the peer has no ACL. If the rules do not fit, only the
+ * WG_IOCTL_PEER_ACL struct is filled in and ERROR_MORE_DATA is returned, so that RulesCount gives the size needed.
+ */
+#define WG_IOCTL_GET_PEER_ACL CTL_CODE(45208U, 327, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+
 #ifdef _KERNEL_MODE
 
 typedef struct _WG_DEVICE WG_DEVICE;
@@ -124,6 +193,12 @@ _IRQL_requires_max_(APC_LEVEL)
 VOID
 IoctlDriverEntry(_In_ DRIVER_OBJECT *DriverObject);
 
+#    ifdef DBG
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+IoctlScaleSelftest(VOID);
+#    endif
+
 #endif
 
 #pragma warning(pop)
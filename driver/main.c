@@ -3,7 +3,9 @@
  * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include "acl.h"
 #include "device.h"
+#include "ioctl.h"
 #include "noise.h"
 #include "queueing.h"
 #include "ratelimiter.h"
@@ -33,10 +35,14 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
     if (!NT_SUCCESS(Ret))
         return Ret;
 
-    Ret = RcuDriverEntry();
+    Ret = CryptoRandomDriverEntry();
     if (!NT_SUCCESS(Ret))
         goto cleanupMem;
 
+    Ret = RcuDriverEntry();
+    if (!NT_SUCCESS(Ret))
+        goto cleanupCryptoRandom;
+
     Ret = AllowedIpsDriverEntry();
     if (!NT_SUCCESS(Ret))
         goto cleanupRcu;
@@ -54,7 +60,9 @@ DriverEntry(DRIVER_OBJECT *DriverObject, UNICODE_STRING *RegistryPath)
         goto cleanupPeer;
 
 #ifdef DBG
-    if (!CryptoSelftest() || !AllowedIpsSelftest() || !PacketCounterSelftest() || !RatelimiterSelftest())
+    if (!CryptoSelftest() || !AllowedIpsSelftest() || !PacketCounterSelftest() || !RatelimiterSelftest() ||
+        !AclSelftest() || !PacketStagedQueueSelftest() || !PeerSerialSelftest() || !MemTrimSelftest() ||
+        !IoctlScaleSelftest())
     {
         Ret = STATUS_INTERNAL_ERROR;
         goto cleanupDevice;
@@ -74,6 +82,8 @@ cleanupAllowedIps:
     AllowedIpsUnload();
 cleanupRcu:
     RcuUnload();
+cleanupCryptoRandom:
+    CryptoRandomUnload();
 cleanupMem:
     MemUnload();
     return Ret;
@@ -90,5 +100,6 @@ Unload(PDRIVER_OBJECT DriverObject)
     RatelimiterUnload();
     AllowedIpsUnload();
     RcuUnload();
+    CryptoRandomUnload();
     MemUnload();
 }
@@ -3,6 +3,7 @@
  * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
  */
 
+#include "interlocked.h"
 #include "memory.h"
 #include "messages.h"
 
@@ -10,6 +11,146 @@ static CONST ULONG PacketCacheSizes[] = { 192, 512, 1024, 1500, 9000 };
 static NDIS_HANDLE LooseNbPool, LooseNblPool;
 static NDIS_HANDLE NbDataPools[ARRAYSIZE(PacketCacheSizes)], NblDataPools[ARRAYSIZE(PacketCacheSizes)];
 
+/* The packet arena is an optional preallocated set of fixed size packet buffers, carved out of physically contiguous
+ * large-page-sized chunks, so that the memory manager can map them with large pages, which keeps the TLB footprint
+ * of the crypto and copy loops small. Every buffer comes with its own MDL and NBL, which are handed out as a unit.
+ * Free NBLs live in small per-processor caches, which exchange batches with a global depot when they run empty or
+ * full, so that the common case touches no shared cache lines. When the arena is exhausted, or a packet does not fit,
+ * allocations fall back to the NDIS pools above.
+ */
+enum PACKET_ARENA_VALUES
+{
+    PACKET_ARENA_BUFFER_SIZE = 2048,
+    PACKET_ARENA_CHUNK_SIZE = 2 * 1024 * 1024,
+    PACKET_ARENA_BUFFERS_PER_CHUNK = PACKET_ARENA_CHUNK_SIZE / PACKET_ARENA_BUFFER_SIZE,
+    PACKET_ARENA_MAX_MEGABYTES = 1024,
+    PACKET_ARENA_CACHE_SIZE = 64,
+    PACKET_ARENA_CACHE_BATCH = PACKET_ARENA_CACHE_SIZE / 2
+};
+
+typedef struct _PACKET_ARENA_CACHE
+{
+    DECLSPEC_CACHEALIGN ULONG Count;
+    NET_BUFFER_LIST *Nbls[PACKET_ARENA_CACHE_SIZE];
+} PACKET_ARENA_CACHE;
+
+static struct
+{
+    NDIS_HANDLE NblPool;
+    UCHAR **Chunks;
+    ULONG NumChunks;
+    PACKET_ARENA_CACHE *Caches;
+    ULONG NumCaches;
+    KSPIN_LOCK DepotLock;
+    _Guarded_by_(DepotLock) NET_BUFFER_LIST **Depot;
+    _Guarded_by_(DepotLock) ULONG DepotCount;
+    LONG NumNbls; /* Written last, with release semantics, so that the arena is in use once this is non-zero. */
+} PacketArena;
+static EX_PUSH_LOCK PacketArenaLock;
+
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_not_held_(PacketArena.DepotLock)
+static VOID
+PacketArenaDepotExchange(_Inout_ PACKET_ARENA_CACHE *Cache, _In_ BOOLEAN Refill)
+{
+    KeAcquireSpinLockAtDpcLevel(&PacketArena.DepotLock);
+    if (Refill)
+    {
+        ULONG Count = min(PacketArena.DepotCount, PACKET_ARENA_CACHE_BATCH);
+        PacketArena.DepotCount -= Count;
+        RtlCopyMemory(
+            &Cache->Nbls[Cache->Count], &PacketArena.Depot[PacketArena.DepotCount], Count * sizeof(*Cache->Nbls));
+        Cache->Count += Count;
+    }
+    else
+    {
+        Cache->Count -= PACKET_ARENA_CACHE_BATCH;
+        RtlCopyMemory(
+            &PacketArena.Depot[PacketArena.DepotCount],
+            &Cache->Nbls[Cache->Count],
+            PACKET_ARENA_CACHE_BATCH * sizeof(*Cache->Nbls));
+        PacketArena.DepotCount += PACKET_ARENA_CACHE_BATCH;
+    }
+    KeReleaseSpinLockFromDpcLevel(&PacketArena.DepotLock);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static NET_BUFFER_LIST *
+PacketArenaAllocate(_In_ ULONG SpaceBefore, _In_ ULONG Size)
+{
+    NET_BUFFER_LIST *Nbl = NULL;
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    CONST ULONG Processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (Processor < PacketArena.NumCaches)
+    {
+        PACKET_ARENA_CACHE *Cache = &PacketArena.Caches[Processor];
+        if (!Cache->Count)
+            PacketArenaDepotExchange(Cache, TRUE);
+        if (Cache->Count)
+            Nbl = Cache->Nbls[--Cache->Count];
+    }
+    else
+    {
+        KeAcquireSpinLockAtDpcLevel(&PacketArena.DepotLock);
+        if (PacketArena.DepotCount)
+            Nbl = PacketArena.Depot[--PacketArena.DepotCount];
+        KeReleaseSpinLockFromDpcLevel(&PacketArena.DepotLock);
+    }
+    KeLowerIrql(Irql);
+    if (!Nbl)
+        return NULL;
+
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    NET_BUFFER_CURRENT_MDL(Nb) = NET_BUFFER_FIRST_MDL(Nb);
+    NET_BUFFER_DATA_LENGTH(Nb) = Size;
+    NET_BUFFER_DATA_OFFSET(Nb) = NET_BUFFER_CURRENT_MDL_OFFSET(Nb) = SpaceBefore;
+    return Nbl;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+PacketArenaFree(_In_ NET_BUFFER_LIST *Nbl)
+{
+    /* Hand it back the way a fresh allocation from an NDIS pool would look, as whoever gets it next may well assume
+     * that fields they never set, like the crypt state in MiniportReserved, start out zeroed.
+     */
+    NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+    Nbl->ParentNetBufferList = NULL;
+    Nbl->SourceHandle = NULL;
+    Nbl->ChildRefCount = 0;
+    Nbl->Flags = 0;
+    Nbl->Status = NDIS_STATUS_SUCCESS;
+    Nbl->Scratch = NULL;
+    RtlZeroMemory(Nbl->MiniportReserved, sizeof(Nbl->MiniportReserved));
+    RtlZeroMemory(Nbl->ProtocolReserved, sizeof(Nbl->ProtocolReserved));
+    RtlZeroMemory(Nbl->NetBufferListInfo, sizeof(Nbl->NetBufferListInfo));
+    NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl);
+    NET_BUFFER_NEXT_NB(Nb) = NULL;
+    NET_BUFFER_CURRENT_MDL(Nb) = NET_BUFFER_FIRST_MDL(Nb);
+    NET_BUFFER_DATA_LENGTH(Nb) = NET_BUFFER_DATA_OFFSET(Nb) = NET_BUFFER_CURRENT_MDL_OFFSET(Nb) = 0;
+    NET_BUFFER_CHECKSUM_BIAS(Nb) = 0;
+    RtlZeroMemory(Nb->MiniportReserved, sizeof(Nb->MiniportReserved));
+    RtlZeroMemory(Nb->ProtocolReserved, sizeof(Nb->ProtocolReserved));
+
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    CONST ULONG Processor = KeGetCurrentProcessorNumberEx(NULL);
+    if (Processor < PacketArena.NumCaches)
+    {
+        PACKET_ARENA_CACHE *Cache = &PacketArena.Caches[Processor];
+        if (Cache->Count == PACKET_ARENA_CACHE_SIZE)
+            PacketArenaDepotExchange(Cache, FALSE);
+        Cache->Nbls[Cache->Count++] = Nbl;
+    }
+    else
+    {
+        KeAcquireSpinLockAtDpcLevel(&PacketArena.DepotLock);
+        PacketArena.Depot[PacketArena.DepotCount++] = Nbl;
+        KeReleaseSpinLockFromDpcLevel(&PacketArena.DepotLock);
+    }
+    KeLowerIrql(Irql);
+}
+
 #pragma warning(suppress : 28195) /* IoAllocateMdl allocates, even if missing the SAL annotation. */
 _Use_decl_annotations_
 MDL *
@@ -52,6 +193,12 @@ MemAllocateNetBufferList(ULONG SpaceBefore, ULONG Size, ULONG SpaceAfter)
     if (!NT_SUCCESS(RtlULongAdd(Sum, SpaceBefore, &Sum) || !NT_SUCCESS(RtlULongAdd(Sum, SpaceAfter, &Sum))) ||
         Sum > MTU_MAX)
         return NULL;
+    if (Sum <= PACKET_ARENA_BUFFER_SIZE && ReadAcquire(&PacketArena.NumNbls))
+    {
+        NET_BUFFER_LIST *Nbl = PacketArenaAllocate(SpaceBefore, Size);
+        if (Nbl)
+            return Nbl;
+    }
     for (ULONG i = 0; i < ARRAYSIZE(PacketCacheSizes); ++i)
     {
         if (PacketCacheSizes[i] >= Sum)
@@ -90,6 +237,11 @@ _Use_decl_annotations_
 VOID
 MemFreeNetBufferList(NET_BUFFER_LIST *Nbl)
 {
+    if (PacketArena.NblPool && Nbl->NdisPoolHandle == PacketArena.NblPool)
+    {
+        PacketArenaFree(Nbl);
+        return;
+    }
     if (Nbl->NdisPoolHandle == LooseNblPool)
     {
         while (NET_BUFFER_LIST_FIRST_NB(Nbl))
@@ -171,7 +323,7 @@ _Use_decl_annotations_
 BOOLEAN
 MemNetBufferListIsOurs(NET_BUFFER_LIST *Nbl)
 {
-    if (Nbl->NdisPoolHandle == LooseNblPool)
+    if (Nbl->NdisPoolHandle == LooseNblPool || (PacketArena.NblPool && Nbl->NdisPoolHandle == PacketArena.NblPool))
         return TRUE;
     for (ULONG i = 0; i < ARRAYSIZE(PacketCacheSizes); ++i)
     {
@@ -209,6 +361,153 @@ MemCopyFromMdl(VOID *Dst, MDL *Src, ULONG Offset, ULONG Size)
     return STATUS_SUCCESS;
 }
 
+#pragma warning(suppress : 6014) /* IoFreeMdl and MmFreeContiguousMemory free, even if missing the SAL annotation. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+PacketArenaFreeAll(VOID)
+{
+    if (PacketArena.Depot)
+    {
+        for (ULONG i = 0; PacketArena.Caches && i < PacketArena.NumCaches; ++i)
+        {
+            PACKET_ARENA_CACHE *Cache = &PacketArena.Caches[i];
+            while (Cache->Count)
+                PacketArena.Depot[PacketArena.DepotCount++] = Cache->Nbls[--Cache->Count];
+        }
+        NT_ASSERT(!PacketArena.NumNbls || PacketArena.DepotCount == (ULONG)PacketArena.NumNbls);
+        for (ULONG i = 0; i < PacketArena.DepotCount; ++i)
+        {
+            MDL *Mdl = NET_BUFFER_FIRST_MDL(NET_BUFFER_LIST_FIRST_NB(PacketArena.Depot[i]));
+            NdisFreeNetBufferList(PacketArena.Depot[i]);
+            IoFreeMdl(Mdl);
+        }
+    }
+    for (ULONG i = 0; PacketArena.Chunks && i < PacketArena.NumChunks; ++i)
+        MmFreeContiguousMemory(PacketArena.Chunks[i]);
+    if (PacketArena.NblPool)
+        NdisFreeNetBufferListPool(PacketArena.NblPool);
+    MemFree(PacketArena.Chunks);
+    MemFree(PacketArena.Caches);
+    MemFree(PacketArena.Depot);
+    RtlZeroMemory(&PacketArena, sizeof(PacketArena));
+}
+
+static LOOKASIDE_FREE_EX MemCacheFreeToPool;
+_Use_decl_annotations_
+static VOID
+MemCacheFreeToPool(PVOID Buffer, PLOOKASIDE_LIST_EX Lookaside)
+{
+    MEM_CACHE *Cache = CONTAINING_RECORD(Lookaside, MEM_CACHE, List);
+    InterlockedAdd64(&Cache->Released, (LONG64)Cache->EntrySize);
+    ExFreePoolWithTag(Buffer, MEMORY_TAG);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+MemCacheInit(MEM_CACHE *Cache, SIZE_T EntrySize)
+{
+    Cache->EntrySize = EntrySize;
+    Cache->Use = MEM_CACHE_FLUSHED;
+    Cache->Released = 0;
+    return ExInitializeLookasideListEx(
+        &Cache->List, NULL, MemCacheFreeToPool, NonPagedPool, 0, EntrySize, MEMORY_TAG, 0);
+}
+
+/* Lookaside lists only ever give entries back to the pool when they are freed into a full list, so after a burst they
+ * keep holding on to its high-water mark. Under memory pressure, the list is flushed. Otherwise, it is only flushed
+ * once a whole period between two calls has gone by without an allocation. Returns how many bytes went back to pool
+ * while flushing, which may include frees racing with it that found the list full. Calls for the same cache must be
+ * serialized by the caller.
+ */
+_Use_decl_annotations_
+SIZE_T
+MemTrimCache(MEM_CACHE *Cache, BOOLEAN UnderPressure)
+{
+    CONST LONG Previous = ReadNoFence(&Cache->Use);
+
+    if (!UnderPressure && Previous != MEM_CACHE_QUIET)
+    {
+        if (Previous == MEM_CACHE_BUSY)
+            WriteNoFence(&Cache->Use, MEM_CACHE_QUIET);
+        return 0;
+    }
+    WriteNoFence(&Cache->Use, MEM_CACHE_FLUSHED);
+    CONST LONG64 Released = ReadNoFence64(&Cache->Released);
+    ExFlushLookasideListEx(&Cache->List);
+    return (SIZE_T)(ReadNoFence64(&Cache->Released) - Released);
+}
+
+#pragma warning(suppress : 6014) /* `Mdl` is aliased in the NBL or freed on failure. */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+PacketArenaInit(_In_ ULONG Megabytes)
+{
+    PHYSICAL_ADDRESS Lowest = { .QuadPart = 0 }, Highest = { .QuadPart = -1 },
+                     Boundary = { .QuadPart = PACKET_ARENA_CHUNK_SIZE };
+    CONST ULONG NumChunks = min(Megabytes, PACKET_ARENA_MAX_MEGABYTES) / (PACKET_ARENA_CHUNK_SIZE / (1024 * 1024));
+    if (!NumChunks)
+        return;
+
+    KeInitializeSpinLock(&PacketArena.DepotLock);
+    NET_BUFFER_LIST_POOL_PARAMETERS NblPoolParameters = {
+        .Header = { .Type = NDIS_OBJECT_TYPE_DEFAULT,
+                    .Revision = NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1,
+                    .Size = NDIS_SIZEOF_NET_BUFFER_LIST_POOL_PARAMETERS_REVISION_1 },
+        .ProtocolId = NDIS_PROTOCOL_ID_DEFAULT,
+        .PoolTag = MEMORY_TAG,
+        .fAllocateNetBuffer = TRUE
+    };
+    PacketArena.NblPool = NdisAllocateNetBufferListPool(NULL, &NblPoolParameters);
+    PacketArena.NumCaches = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    PacketArena.Caches = MemAllocateArrayAndZero(PacketArena.NumCaches, sizeof(*PacketArena.Caches));
+    PacketArena.Chunks = MemAllocateArrayAndZero(NumChunks, sizeof(*PacketArena.Chunks));
+    PacketArena.Depot =
+        MemAllocateArray((SIZE_T)NumChunks * PACKET_ARENA_BUFFERS_PER_CHUNK, sizeof(*PacketArena.Depot));
+    if (!PacketArena.NblPool || !PacketArena.Caches || !PacketArena.Chunks || !PacketArena.Depot)
+        goto cleanup;
+
+    while (PacketArena.NumChunks < NumChunks)
+    {
+        UCHAR *Chunk = MmAllocateContiguousNodeMemory(
+            PACKET_ARENA_CHUNK_SIZE, Lowest, Highest, Boundary, PAGE_READWRITE, MM_ANY_NODE_OK);
+        if (!Chunk)
+            goto cleanup;
+        PacketArena.Chunks[PacketArena.NumChunks++] = Chunk;
+        for (ULONG i = 0; i < PACKET_ARENA_BUFFERS_PER_CHUNK; ++i)
+        {
+            MDL *Mdl =
+                IoAllocateMdl(Chunk + i * PACKET_ARENA_BUFFER_SIZE, PACKET_ARENA_BUFFER_SIZE, FALSE, FALSE, NULL);
+            if (!Mdl)
+                goto cleanup;
+            MmBuildMdlForNonPagedPool(Mdl);
+            NET_BUFFER_LIST *Nbl = NdisAllocateNetBufferAndNetBufferList(PacketArena.NblPool, 0, 0, Mdl, 0, 0);
+            if (!Nbl)
+            {
+                IoFreeMdl(Mdl);
+                goto cleanup;
+            }
+            PacketArena.Depot[PacketArena.DepotCount++] = Nbl;
+        }
+    }
+    WriteRelease(&PacketArena.NumNbls, (LONG)PacketArena.DepotCount);
+    return;
+
+cleanup:
+    PacketArenaFreeAll();
+}
+
+_Use_decl_annotations_
+VOID
+MemPacketArenaInit(ULONG Megabytes)
+{
+    if (!Megabytes || ReadAcquire(&PacketArena.NumNbls))
+        return;
+    MuAcquirePushLockExclusive(&PacketArenaLock);
+    if (!PacketArena.NumNbls)
+        PacketArenaInit(Megabytes);
+    MuReleasePushLockExclusive(&PacketArenaLock);
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, MemDriverEntry)
 #endif
@@ -288,6 +587,7 @@ cleanup:
 _Use_decl_annotations_
 VOID MemUnload(VOID)
 {
+    PacketArenaFreeAll();
     NdisFreeNetBufferPool(LooseNbPool);
     NdisFreeNetBufferListPool(LooseNblPool);
     for (ULONG i = 0; i < ARRAYSIZE(PacketCacheSizes); ++i)
@@ -296,3 +596,7 @@ VOID MemUnload(VOID)
         NdisFreeNetBufferListPool(NblDataPools[i]);
     }
 }
+
+#ifdef DBG
+#    include "selftest/memory.c"
+#endif
@@ -158,6 +158,76 @@ _Must_inspect_result_
 NTSTATUS
 MemCopyFromMdl(_Out_writes_bytes_all_(Size) VOID *Dst, _In_ MDL *Src, _In_ ULONG Offset, _In_ ULONG Size);
 
+/* How recently a cache has been allocated from, as noted by MemCacheAllocate for MemTrimCache. */
+typedef enum _MEM_CACHE_USE
+{
+    MEM_CACHE_FLUSHED = 0,
+    MEM_CACHE_QUIET,
+    MEM_CACHE_BUSY
+} MEM_CACHE_USE;
+
+/* A lookaside list that the cache trimmer flushes once it goes idle or memory runs low. Whatever it hands back to
+ * pool, be it because of a flush or because the list was full, goes through its free routine and is counted there, so
+ * that trims can tell how much they reclaimed without looking inside of the list.
+ */
+typedef struct _MEM_CACHE
+{
+    LOOKASIDE_LIST_EX List;
+    SIZE_T EntrySize;
+    LONG Use;
+    LONG64 Released;
+} MEM_CACHE;
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+NTSTATUS
+MemCacheInit(_Out_ MEM_CACHE *Cache, _In_ SIZE_T EntrySize);
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+MemCacheDelete(_Inout_ MEM_CACHE *Cache)
+{
+    ExDeleteLookasideListEx(&Cache->List);
+}
+
+/* The use state is only a hint, so the write is skipped when the cache is already busy, to keep the cache line shared
+ * on hot paths.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Must_inspect_result_
+static inline VOID *
+MemCacheAllocate(_Inout_ MEM_CACHE *Cache)
+{
+    VOID *Entry = ExAllocateFromLookasideListEx(&Cache->List);
+    if (Entry && ReadNoFence(&Cache->Use) != MEM_CACHE_BUSY)
+        WriteNoFence(&Cache->Use, MEM_CACHE_BUSY);
+    return Entry;
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+MemCacheFree(_Inout_ MEM_CACHE *Cache, _In_ __drv_freesMem(Mem) VOID *Entry)
+{
+    ExFreeToLookasideListEx(&Cache->List, Entry);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+SIZE_T
+MemTrimCache(_Inout_ MEM_CACHE *Cache, _In_ BOOLEAN UnderPressure);
+
+#ifdef DBG
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+MemTrimSelftest(VOID);
+#endif
+
+/* Sets up the packet arena, which all adapters share, with the given size unless it is already set up. The arena is
+ * only an optimization, so failing to set it up is not an error.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+VOID
+MemPacketArenaInit(_In_ ULONG Megabytes);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS
 MemDriverEntry(VOID);
@@ -112,6 +112,13 @@ KeypairCreate(_In_ WG_PEER *Peer)
     Keypair->InternalId = InterlockedIncrement64(&KeypairCounter);
     Keypair->Entry.Type = INDEX_HASHTABLE_KEYPAIR;
     Keypair->Entry.Peer = Peer;
+    if (Peer->Device->PrecomputeKeystream)
+    {
+        /* Carry on without it if this fails, as it is only ever a shortcut. */
+        Keypair->Keystream = MemAllocateAndZero(sizeof(*Keypair->Keystream));
+        for (ULONG i = 0; Keypair->Keystream && i < ARRAYSIZE(Keypair->Keystream->Slots); ++i)
+            Keypair->Keystream->Slots[i].Nonce = NOISE_KEYSTREAM_EMPTY;
+    }
     KrefInit(&Keypair->Refcount);
     return Keypair;
 }
@@ -121,7 +128,10 @@ _Use_decl_annotations_
 static VOID
 KeypairFreeRcu(RCU_CALLBACK *Rcu)
 {
-    MemFreeSensitive(CONTAINING_RECORD(Rcu, NOISE_KEYPAIR, Rcu), sizeof(NOISE_KEYPAIR));
+    NOISE_KEYPAIR *Keypair = CONTAINING_RECORD(Rcu, NOISE_KEYPAIR, Rcu);
+    if (Keypair->Keystream)
+        MemFreeSensitive(Keypair->Keystream, sizeof(*Keypair->Keystream));
+    MemFreeSensitive(Keypair, sizeof(*Keypair));
 }
 
 static VOID
@@ -158,6 +168,22 @@ NoiseKeypairGet(NOISE_KEYPAIR *Keypair)
     return Keypair;
 }
 
+_Use_decl_annotations_
+NOISE_KEYPAIR *
+NoiseKeypairsFind(NOISE_KEYPAIRS *Keypairs, UINT32_LE Index)
+{
+    NOISE_KEYPAIR *Keypair = RcuDereference(NOISE_KEYPAIR, Keypairs->CurrentKeypair);
+    if (Keypair && Keypair->Entry.Index == Index)
+        return Keypair;
+    Keypair = RcuDereference(NOISE_KEYPAIR, Keypairs->PreviousKeypair);
+    if (Keypair && Keypair->Entry.Index == Index)
+        return Keypair;
+    Keypair = RcuDereference(NOISE_KEYPAIR, Keypairs->NextKeypair);
+    if (Keypair && Keypair->Entry.Index == Index)
+        return Keypair;
+    return NULL;
+}
+
 _Use_decl_annotations_
 VOID
 NoiseKeypairsClear(NOISE_KEYPAIRS *Keypairs)
@@ -836,7 +862,8 @@ NoiseHandshakeBeginSession(NOISE_HANDSHAKE *Handshake, NOISE_KEYPAIRS *Keypairs)
     if (!NewKeypair)
         goto out;
     NewKeypair->IAmTheInitiator = Handshake->State == HANDSHAKE_CONSUMED_RESPONSE;
-    NewKeypair->RemoteIndex = Handshake->RemoteIndex;
+    MESSAGE_DATA Template = { .Header.Type = CpuToLe32(MESSAGE_TYPE_DATA), .KeyIdx = Handshake->RemoteIndex };
+    RtlCopyMemory(&NewKeypair->SendingHeader, &Template, sizeof(NewKeypair->SendingHeader));
 
     if (NewKeypair->IAmTheInitiator)
         DeriveKeys(&NewKeypair->Sending, &NewKeypair->Receiving, Handshake->ChainingKey);
@@ -25,6 +25,29 @@ typedef struct _NOISE_SYMMETRIC_KEY
     BOOLEAN IsValid;
 } NOISE_SYMMETRIC_KEY;
 
+#define NOISE_KEYSTREAM_SLOTS 8
+
+enum
+{
+    NOISE_KEYSTREAM_EMPTY = -1,
+    NOISE_KEYSTREAM_BUSY = -2
+};
+
+/* Keystream for upcoming sending nonces of a keypair, each slot tagged with the nonce that it is for. Whoever moves a
+ * slot's tag from a nonce to NOISE_KEYSTREAM_BUSY owns the slot, which is how a slot is used at most once, and how a
+ * slot left behind by a nonce that never got sent is recycled.
+ */
+typedef struct _NOISE_KEYSTREAM_SLOT
+{
+    LONG64 Nonce;
+    CHACHA20POLY1305_PRECOMPUTED Precomputed;
+} NOISE_KEYSTREAM_SLOT;
+
+typedef struct _NOISE_KEYSTREAM_CACHE
+{
+    NOISE_KEYSTREAM_SLOT Slots[NOISE_KEYSTREAM_SLOTS];
+} NOISE_KEYSTREAM_CACHE;
+
 typedef struct _NOISE_KEYPAIR
 {
     INDEX_HASHTABLE_ENTRY Entry;
@@ -32,8 +55,9 @@ typedef struct _NOISE_KEYPAIR
     LONG64 SendingCounter;
     NOISE_SYMMETRIC_KEY Receiving;
     NOISE_REPLAY_COUNTER ReceivingCounter;
-    UINT32_LE RemoteIndex;
+    UINT64 SendingHeader; /* MESSAGE_DATA's Header and KeyIdx, the same for every packet sent with this keypair. */
     BOOLEAN IAmTheInitiator;
+    NOISE_KEYSTREAM_CACHE *Keystream; /* Only when the device precomputes keystream. */
     KREF Refcount;
     RCU_CALLBACK Rcu;
     UINT64 InternalId;
@@ -126,6 +150,13 @@ _Post_maybenull_
 NOISE_KEYPAIR *
 NoiseKeypairGet(_Inout_opt_ NOISE_KEYPAIR *Keypair);
 
+/* Finds the keypair with the given local index among the peer's own, without taking a reference. */
+_Requires_rcu_held_
+_Must_inspect_result_
+_Post_maybenull_
+NOISE_KEYPAIR *
+NoiseKeypairsFind(_In_ NOISE_KEYPAIRS *Keypairs, _In_ UINT32_LE Index);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Requires_lock_not_held_(Keypairs->KeypairUpdateLock)
 VOID
@@ -13,7 +13,7 @@
 #include "timers.h"
 #include "logging.h"
 
-static LOOKASIDE_ALIGN LOOKASIDE_LIST_EX PeerCache;
+static LOOKASIDE_ALIGN MEM_CACHE PeerCache;
 static LONG64 PeerCounter = 0;
 
 _Use_decl_annotations_
@@ -27,7 +27,7 @@ PeerCreate(
     if (Wg->NumPeers >= MAX_PEERS_PER_DEVICE)
         return STATUS_TOO_MANY_NODES;
 
-    *Peer = ExAllocateFromLookasideListEx(&PeerCache);
+    *Peer = MemCacheAllocate(&PeerCache);
     if (!*Peer)
         return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(*Peer, sizeof(**Peer));
@@ -42,11 +42,12 @@ PeerCreate(
     PrevQueueInit(&(*Peer)->TxQueue);
     PrevQueueInit(&(*Peer)->RxQueue);
     KrefInit(&(*Peer)->Refcount);
-    NetBufferListInitQueue(&(*Peer)->StagedPacketQueue);
+    NetBufferListLocklessInitQueue(&(*Peer)->StagedPacketQueue, MAX_STAGED_PACKETS);
     ExInitializeRundownProtection(&(*Peer)->InUse);
     NoiseResetLastSentHandshake(&(*Peer)->LastSentHandshake);
     InsertTailList(&Wg->PeerList, &(*Peer)->PeerList);
     InitializeListHead(&(*Peer)->AllowedIpsList);
+    InitializeListHead(&(*Peer)->AllowedIpsDetachedList);
     PubkeyHashtableAdd(Wg->PeerHashtable, *Peer);
     ++Wg->NumPeers;
     LogInfo(Wg, "Peer %llu created", (*Peer)->InternalId);
@@ -64,7 +65,9 @@ PeerGetMaybeZero(WG_PEER *Peer)
 
 /* We have a separate "remove" function make sure that all active places where
  * a peer is currently operating will eventually come to an end and not pass
- * their reference onto another context.
+ * their reference onto another context. It is split up into PeerUnlink, which
+ * never blocks, and PeerStop, which does, so that the configuration can be
+ * changed without making GET wait for the latter.
  */
 _Use_decl_annotations_
 VOID
@@ -72,25 +75,52 @@ PeerRemove(WG_PEER *Peer)
 {
     if (!Peer)
         return;
+    PeerUnlink(Peer);
+    PeerStop(Peer);
+    PeerPut(Peer);
+}
 
+_Use_decl_annotations_
+VOID
+PeerUnlink(WG_PEER *Peer)
+{
     /* Remove from configuration-time lookup structures. */
+    if (RcuAccessPointer(Peer->Device->SolePeer) == Peer)
+        RcuInitPointer(Peer->Device->SolePeer, NULL);
     RemoveEntryList(&Peer->PeerList);
     InitializeListHead(&Peer->PeerList);
     AllowedIpsRemoveByPeer(&Peer->Device->PeerAllowedIps, Peer, &Peer->Device->DeviceUpdateLock);
     PubkeyHashtableRemove(Peer->Device->PeerHashtable, Peer);
+    NoiseKeypairsClear(&Peer->Keypairs);
+    --Peer->Device->NumPeers;
+}
+
+_Use_decl_annotations_
+VOID
+PeerStop(WG_PEER *Peer)
+{
     NoiseKeypairsClear(&Peer->Keypairs);
     /* Disable creation of new references and wait for old ones to go away. */
     ExWaitForRundownProtectionRelease(&Peer->InUse);
     /* Destroy all ongoing timers that were in-flight at the beginning of this function. */
     TimersStop(Peer);
+}
 
-    --Peer->Device->NumPeers;
-    PeerPut(Peer);
+_Use_decl_annotations_
+VOID
+PeerStopAll(WG_DEVICE *Wg)
+{
+    WG_PEER *Peer;
+    LIST_FOR_EACH_ENTRY (Peer, &Wg->PeerList, WG_PEER, PeerList)
+    {
+        _Analysis_assume_same_lock_(Peer->Device->DeviceUpdateLock, Wg->DeviceUpdateLock);
+        PeerStop(Peer);
+    }
 }
 
 _Use_decl_annotations_
 VOID
-PeerRemoveAll(WG_DEVICE *Wg)
+PeerUnlinkAll(WG_DEVICE *Wg, LIST_ENTRY *Unlinked)
 {
     WG_PEER *Peer, *Temp;
 
@@ -100,8 +130,36 @@ PeerRemoveAll(WG_DEVICE *Wg)
     LIST_FOR_EACH_ENTRY_SAFE (Peer, Temp, &Wg->PeerList, WG_PEER, PeerList)
     {
         _Analysis_assume_same_lock_(Peer->Device->DeviceUpdateLock, Wg->DeviceUpdateLock);
-        PeerRemove(Peer);
+        PeerUnlink(Peer);
+        InsertTailList(Unlinked, &Peer->PeerList);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+PeerPutUnlinked(WG_DEVICE *Wg, LIST_ENTRY *Unlinked, BOOLEAN Stopped)
+{
+    WG_PEER *Peer, *Temp;
+    LIST_FOR_EACH_ENTRY_SAFE (Peer, Temp, Unlinked, WG_PEER, PeerList)
+    {
+        _Analysis_assume_same_lock_(Peer->Device->DeviceUpdateLock, Wg->DeviceUpdateLock);
+        RemoveEntryList(&Peer->PeerList);
+        InitializeListHead(&Peer->PeerList);
+        if (!Stopped)
+            PeerStop(Peer);
+        PeerPut(Peer);
     }
+}
+
+_Use_decl_annotations_
+VOID
+PeerRemoveAll(WG_DEVICE *Wg)
+{
+    LIST_ENTRY Unlinked;
+    InitializeListHead(&Unlinked);
+    PeerStopAll(Wg);
+    PeerUnlinkAll(Wg, &Unlinked);
+    PeerPutUnlinked(Wg, &Unlinked, TRUE);
     RcuSynchronize();
 }
 
@@ -113,12 +171,13 @@ RcuRelease(RCU_CALLBACK *Rcu)
     WG_PEER *Peer = CONTAINING_RECORD(Rcu, WG_PEER, Rcu);
 
     NT_ASSERT(!PrevQueuePeek(&Peer->TxQueue) && !PrevQueuePeek(&Peer->RxQueue));
+    AclFree(RcuAccessPointer(Peer->Acl));
 
     /* The final zeroing takes care of clearing any remaining handshake key
      * material and other potentially sensitive information.
      */
     RtlSecureZeroMemory(Peer, sizeof(*Peer));
-    ExFreeToLookasideListEx(&PeerCache, Peer);
+    MemCacheFree(&PeerCache, Peer);
 }
 
 static VOID
@@ -153,6 +212,13 @@ PeerPut(WG_PEER *Peer)
     KrefPut(&Peer->Refcount, KrefRelease);
 }
 
+_Use_decl_annotations_
+SIZE_T
+PeerTrimCache(BOOLEAN UnderPressure)
+{
+    return MemTrimCache(&PeerCache, UnderPressure);
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, PeerDriverEntry)
 #endif
@@ -160,11 +226,11 @@ _Use_decl_annotations_
 NTSTATUS
 PeerDriverEntry(VOID)
 {
-    return ExInitializeLookasideListEx(&PeerCache, NULL, NULL, NonPagedPool, 0, sizeof(WG_PEER), MEMORY_TAG, 0);
+    return MemCacheInit(&PeerCache, sizeof(WG_PEER));
 }
 
 _Use_decl_annotations_
 VOID PeerUnload(VOID)
 {
-    ExDeleteLookasideListEx(&PeerCache);
+    MemCacheDelete(&PeerCache);
 }
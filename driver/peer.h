@@ -5,6 +5,7 @@
 
 #pragma once
 
+#include "acl.h"
 #include "interlocked.h"
 #include "cookie.h"
 #include "device.h"
@@ -43,12 +44,21 @@ typedef enum _HANDSHAKE_TX_ACTION
     HANDSHAKE_TX_SEND
 } HANDSHAKE_TX_ACTION;
 
+/* Times are in interrupt time units, and counters only ever go up. */
+typedef struct _PEER_HANDSHAKE_STATS
+{
+    LONG64 InitiationSent;
+    LONG64 LastRtt, MinRtt, SmoothedRtt;
+    LONG64 StagedSince, StagedWaitTime;
+    LONG HandshakesCompleted, Retransmits, CookieReplies;
+} PEER_HANDSHAKE_STATS;
+
 typedef struct _WG_PEER
 {
     WG_DEVICE *Device;
     PREV_QUEUE TxQueue, RxQueue;
     PEER_SERIAL_ENTRY TxSerialEntry, RxSerialEntry, HandshakeTxSerialEntry;
-    NET_BUFFER_LIST_QUEUE StagedPacketQueue;
+    NET_BUFFER_LIST_LOCKLESS_QUEUE StagedPacketQueue;
     EX_RUNDOWN_REF InUse;
     NOISE_KEYPAIRS Keypairs;
     ENDPOINT Endpoint;
@@ -67,10 +77,14 @@ typedef struct _WG_PEER
     BOOLEAN TimerNeedAnotherKeepalive;
     BOOLEAN SentLastminuteHandshake;
     LARGE_INTEGER WalltimeLastHandshake;
+    PEER_HANDSHAKE_STATS HandshakeStats;
     KREF Refcount;
     RCU_CALLBACK Rcu;
     LIST_ENTRY PeerList;
     LIST_ENTRY AllowedIpsList;
+    /* Entries hidden by one of the peer's absorbing nodes in PeerAllowedIps. */
+    LIST_ENTRY AllowedIpsDetachedList;
+    ACL_TABLE __rcu *Acl;
     UINT64 InternalId;
 } WG_PEER;
 
@@ -105,11 +119,46 @@ _Requires_lock_held_(Peer->Device->DeviceUpdateLock)
 VOID
 PeerRemove(_In_opt_ WG_PEER *Peer);
 
+/* Takes a peer out of the configuration without blocking, so that this may be done inside of a ConfigSeq write
+ * section. The peer must still be stopped, unless it was beforehand, and then put.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Peer->Device->DeviceUpdateLock)
+VOID
+PeerUnlink(_Inout_ WG_PEER *Peer);
+
+/* Waits until nothing works on behalf of a peer anymore. It may or may not have been unlinked yet. */
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Peer->Device->DeviceUpdateLock)
+VOID
+PeerStop(_Inout_ WG_PEER *Peer);
+
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+VOID
+PeerStopAll(_Inout_ WG_DEVICE *Wg);
+
+/* Unlinks every peer onto Unlinked, linked by their PeerList entries. */
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+VOID
+PeerUnlinkAll(_Inout_ WG_DEVICE *Wg, _Inout_ LIST_ENTRY *Unlinked);
+
+/* Puts every peer on Unlinked, stopping each first unless they all were before being unlinked. */
+_IRQL_requires_max_(APC_LEVEL)
+_Requires_lock_held_(Wg->DeviceUpdateLock)
+VOID
+PeerPutUnlinked(_Inout_ WG_DEVICE *Wg, _Inout_ LIST_ENTRY *Unlinked, _In_ BOOLEAN Stopped);
+
 _IRQL_requires_max_(APC_LEVEL)
 _Requires_lock_held_(Wg->DeviceUpdateLock)
 VOID
 PeerRemoveAll(_Inout_ WG_DEVICE *Wg);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+SIZE_T
+PeerTrimCache(_In_ BOOLEAN UnderPressure);
+
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS
 PeerDriverEntry(VOID);
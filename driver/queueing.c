@@ -98,6 +98,31 @@ MulticoreWorkQueueInit(MULTICORE_WORKQUEUE *WorkQueue, PMULTICORE_WORKQUEUE_ROUT
     return Status;
 }
 
+/* A single worker per processor serves all of a device's queues, so that traffic going both ways doesn't have the
+ * scheduler bouncing each processor between separate encrypt and decrypt threads. Every round gives each queue a
+ * bounded share: first our own handshake initiations, since there are few of them and sessions wait on them, then
+ * data in both directions, and last incoming handshakes, which are expensive and can be flooded by anyone. The SIMD
+ * state is saved once for as long as there is any work left, rather than once per batch.
+ */
+_Use_decl_annotations_
+VOID
+PacketWorker(MULTICORE_WORKQUEUE *WorkQueue)
+{
+    WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, Workers);
+    SIMD_STATE Simd;
+    BOOLEAN More;
+
+    SimdGet(&Simd);
+    do
+    {
+        More = PacketHandshakeTxWork(Wg, WORKER_HANDSHAKE_BUDGET);
+        More |= PacketDecryptWork(Wg, &Simd, WORKER_DATA_BUDGET);
+        More |= PacketEncryptWork(Wg, &Simd, WORKER_DATA_BUDGET);
+        More |= PacketHandshakeRxWork(Wg, WORKER_HANDSHAKE_BUDGET);
+    } while (More);
+    SimdPut(&Simd);
+}
+
 _Use_decl_annotations_
 BOOLEAN
 MulticoreWorkQueueBump(MULTICORE_WORKQUEUE *WorkQueue)
@@ -208,3 +233,7 @@ PrevQueueDequeue(PREV_QUEUE *Queue)
 
 #undef NEXT
 #undef STUB
+
+#ifdef DBG
+#    include "selftest/peerserial.c"
+#endif
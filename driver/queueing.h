@@ -9,6 +9,12 @@
 
 #define MAX_QUEUED_INCOMING_HANDSHAKES 4096
 #define MAX_STAGED_PACKETS 128
+#define SEND_BATCH_MAX_PEERS 16
+#define SEND_BATCH_MAX_PACKETS (MAX_STAGED_PACKETS / 2)
+#define SEND_BATCH_DEADLINE_US 50
+#define SEND_BATCH_DEADLINE_STRIDE 8
+#define WORKER_DATA_BUDGET 64
+#define WORKER_HANDSHAKE_BUDGET 8
 #define MAX_QUEUED_PACKETS 1024
 #define PEER_XMIT_PACKETS_PER_ROUND 256
 
@@ -30,80 +36,125 @@ _IRQL_requires_max_(PASSIVE_LEVEL)
 VOID
 MulticoreWorkQueueDestroy(_Inout_ MULTICORE_WORKQUEUE *WorkQueue);
 
-#define BUSY_LINK ((PEER_SERIAL_ENTRY *)~(ULONG_PTR)0)
+/* A PEER_SERIAL hands out peers that have work to do, each to one worker at a time. Adding to it is lockless: an
+ * entry claims its slot by swapping itself in as the new head and then linking the previous head to itself. Workers
+ * take entries from the tail under ConsumerLock, which only ever covers a few loads and stores. Between the swap and
+ * the link, the new entry and any added after it are not yet reachable, so a worker may briefly find the list empty.
+ * That is fine, as everyone who adds an entry either processes the list or bumps its workers afterwards.
+ *
+ * An entry is busy from the moment it is added until the worker that took it retires it. Adding a busy entry again
+ * instead flags it for requeueing, so that its worker gives it another round rather than missing the new work.
+ */
+enum
+{
+    PEER_SERIAL_BUSY = 1 << 0,
+    PEER_SERIAL_REQUEUE = 1 << 1
+};
 
 static inline VOID
 PeerSerialInit(_Out_ PEER_SERIAL *Serial)
 {
-    Serial->Last = &Serial->First;
-    Serial->First = BUSY_LINK;
-    KeInitializeSpinLock(&Serial->Lock);
+    Serial->Empty.Next = NULL;
+    Serial->Empty.State = PEER_SERIAL_BUSY;
+    Serial->Head = Serial->Tail = &Serial->Empty;
+    KeInitializeSpinLock(&Serial->ConsumerLock);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+__PeerSerialPush(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item)
+{
+    WritePointerNoFence(&Item->Next, NULL);
+    /* Workers can't see past us until we link in, so don't get preempted in between. */
+    KIRQL Irql = KeRaiseIrqlToDpcLevel();
+    WritePointerNoFence(&((PEER_SERIAL_ENTRY *)InterlockedExchangePointerRelease(&Serial->Head, Item))->Next, Item);
+    KeLowerIrql(Irql);
 }
 
-_Requires_lock_not_held_(Serial->Lock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline BOOLEAN
 PeerSerialEnqueueIfNotBusy(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN MaybeRequeue)
 {
-    BOOLEAN Added = FALSE;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    if (ReadPointerNoFence(&Item->Next))
+    LONG State = ReadNoFence(&Item->State);
+    for (;;)
     {
-        if (MaybeRequeue)
-            WriteNoFence16(&Item->Requeue, TRUE);
-        goto out;
+        /* This is a full barrier even when the requeue flag is already set, which orders whatever work our caller
+         * published before it against the worker clearing that flag when retiring.
+         */
+        LONG NewState =
+            State & PEER_SERIAL_BUSY ? (MaybeRequeue ? State | PEER_SERIAL_REQUEUE : State) : PEER_SERIAL_BUSY;
+        LONG Prev = InterlockedCompareExchange(&Item->State, NewState, State);
+        if (Prev == State)
+            break;
+        State = Prev;
     }
-    WritePointerNoFence(&Item->Next, BUSY_LINK);
-    *Serial->Last = Item;
-    Serial->Last = &Item->Next;
-    Added = TRUE;
-out:
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return Added;
+    if (State & PEER_SERIAL_BUSY)
+        return FALSE;
+    __PeerSerialPush(Serial, Item);
+    return TRUE;
 }
 
-_Requires_lock_not_held_(Serial->Lock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline BOOLEAN
 PeerSerialMaybeRetire(_Inout_ PEER_SERIAL *Serial, _Inout_ PEER_SERIAL_ENTRY *Item, _In_ BOOLEAN ForceMore)
 {
-    BOOLEAN Ret = FALSE;
-    KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    WritePointerNoFence(&Item->Next, NULL);
-    if (InterlockedCompareExchange16(&Item->Requeue, FALSE, TRUE) || ForceMore)
+    if (!ForceMore && InterlockedCompareExchange(&Item->State, 0, PEER_SERIAL_BUSY) == PEER_SERIAL_BUSY)
+        return FALSE;
+    InterlockedExchange(&Item->State, PEER_SERIAL_BUSY);
+    __PeerSerialPush(Serial, Item);
+    return TRUE;
+}
+
+_Requires_lock_held_(Serial->ConsumerLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+_Must_inspect_result_
+_Post_maybenull_
+static inline PEER_SERIAL_ENTRY *
+__PeerSerialDequeue(_Inout_ PEER_SERIAL *Serial)
+{
+    PEER_SERIAL_ENTRY *Tail = Serial->Tail, *Next = ReadPointerAcquire(&Tail->Next);
+
+    if (Tail == &Serial->Empty)
+    {
+        if (!Next)
+            return NULL;
+        Serial->Tail = Next;
+        Tail = Next;
+        Next = ReadPointerAcquire(&Next->Next);
+    }
+    if (Next)
+    {
+        Serial->Tail = Next;
+        return Tail;
+    }
+    if (Tail != ReadPointerNoFence(&Serial->Head))
+        return NULL;
+    __PeerSerialPush(Serial, &Serial->Empty);
+    Next = ReadPointerAcquire(&Tail->Next);
+    if (Next)
     {
-        WritePointerNoFence(&Item->Next, BUSY_LINK);
-        *Serial->Last = Item;
-        Serial->Last = &Item->Next;
-        Ret = TRUE;
+        Serial->Tail = Next;
+        return Tail;
     }
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return Ret;
+    return NULL;
 }
 
-_Requires_lock_not_held_(Serial->Lock)
+_Requires_lock_not_held_(Serial->ConsumerLock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 _Must_inspect_result_
 _Post_maybenull_
 static inline PEER_SERIAL_ENTRY *
 PeerSerialDequeue(_Inout_ PEER_SERIAL *Serial)
 {
-    if (ReadPointerNoFence(&Serial->First) == BUSY_LINK)
+    if (ReadPointerNoFence(&Serial->Tail) == &Serial->Empty && !ReadPointerNoFence(&Serial->Empty.Next))
         return NULL;
-    PEER_SERIAL_ENTRY *First = NULL;
     KIRQL Irql;
-    KeAcquireSpinLock(&Serial->Lock, &Irql);
-    First = Serial->First;
-    if (First != BUSY_LINK && (Serial->First = First->Next) == BUSY_LINK)
-        Serial->Last = &Serial->First;
-    KeReleaseSpinLock(&Serial->Lock, Irql);
-    return First == BUSY_LINK ? NULL : First;
+    KeAcquireSpinLock(&Serial->ConsumerLock, &Irql);
+    PEER_SERIAL_ENTRY *First = __PeerSerialDequeue(Serial);
+    KeReleaseSpinLock(&Serial->ConsumerLock, Irql);
+    return First;
 }
 
-#undef BUSY_LINK
-
 /*
  * NBL[0] = crypt state
  * NBL[1] = prev queue link
@@ -159,12 +210,10 @@ VOID
 PacketSendKeepalive(_Inout_ WG_PEER *Peer);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-_Requires_lock_not_held_(Peer->StagedPacketQueue.Lock)
 VOID
 PacketPurgeStagedPackets(_Inout_ WG_PEER *Peer);
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
-_Requires_lock_not_held_(Peer->StagedPacketQueue.Lock)
 VOID
 PacketSendStagedPackets(_Inout_ WG_PEER *Peer);
 
@@ -172,8 +221,36 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
 FreeSendNetBufferList(_In_ WG_DEVICE *Wg, __drv_freesMem(Mem) _In_ NET_BUFFER_LIST *Nbl, _In_ ULONG SendCompleteFlags);
 
-MULTICORE_WORKQUEUE_ROUTINE PacketEncryptWorker, PacketDecryptWorker;
-MULTICORE_WORKQUEUE_ROUTINE PacketHandshakeTxWorker, PacketHandshakeRxWorker;
+static inline ULONG
+SendCompleteFlagsForCurrentIrql(VOID)
+{
+    return KeGetCurrentIrql() == DISPATCH_LEVEL ? NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL : 0;
+}
+
+CRYPTO_ENGINE_TRANSFORM PacketEncryptTransform, PacketDecryptTransform;
+CRYPTO_ENGINE_COMPLETION PacketEncryptComplete, PacketDecryptComplete;
+CRYPTO_ENGINE_NOTIFY PacketEncryptNotify, PacketDecryptNotify;
+
+/* Each of these processes at most Budget entries from one of the device queues, and returns whether it stopped
+ * because of the budget rather than because the queue ran dry.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PacketEncryptWork(_Inout_ WG_DEVICE *Wg, _In_ CONST SIMD_STATE *Simd, _In_ ULONG Budget);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PacketDecryptWork(_Inout_ WG_DEVICE *Wg, _In_ CONST SIMD_STATE *Simd, _In_ ULONG Budget);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PacketHandshakeTxWork(_Inout_ WG_DEVICE *Wg, _In_ ULONG Budget);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PacketHandshakeRxWork(_Inout_ WG_DEVICE *Wg, _In_ ULONG Budget);
+
+MULTICORE_WORKQUEUE_ROUTINE PacketWorker;
 
 typedef enum _PACKET_STATE
 {
@@ -282,7 +359,6 @@ QueueEnqueuePerDeviceAndPeer(
     return STATUS_SUCCESS;
 }
 
-_Requires_lock_not_held_(PeerQueue->Lock)
 _IRQL_requires_max_(DISPATCH_LEVEL)
 static inline VOID
 QueueEnqueuePerPeer(
@@ -304,4 +380,12 @@ QueueEnqueuePerPeer(
 _IRQL_requires_max_(PASSIVE_LEVEL)
 BOOLEAN
 PacketCounterSelftest(VOID);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PacketStagedQueueSelftest(VOID);
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+BOOLEAN
+PeerSerialSelftest(VOID);
 #endif
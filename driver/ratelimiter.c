@@ -12,7 +12,7 @@
 #define TABLE_SIZE 8192
 #define MAX_ENTRIES (TABLE_SIZE * 8)
 
-static LOOKASIDE_ALIGN LOOKASIDE_LIST_EX EntryCache;
+static LOOKASIDE_ALIGN MEM_CACHE EntryCache;
 static HSIPHASH_KEY Key;
 static KSPIN_LOCK TableLock;
 static LONG TotalEntries = 0;
@@ -44,7 +44,7 @@ _Use_decl_annotations_
 static VOID
 EntryFree(RCU_CALLBACK *Rcu)
 {
-    ExFreeToLookasideListEx(&EntryCache, CONTAINING_RECORD(Rcu, RATELIMITER_ENTRY, Rcu));
+    MemCacheFree(&EntryCache, CONTAINING_RECORD(Rcu, RATELIMITER_ENTRY, Rcu));
     InterlockedDecrement(&TotalEntries);
 }
 
@@ -146,7 +146,7 @@ RatelimiterAllow(CONST SOCKADDR *Src)
     if ((ULONG)InterlockedIncrement(&TotalEntries) > MAX_ENTRIES)
         goto cleanupOom;
 
-    Entry = ExAllocateFromLookasideListEx(&EntryCache);
+    Entry = MemCacheAllocate(&EntryCache);
     if (!Entry)
         goto cleanupOom;
 
@@ -165,6 +165,13 @@ cleanupOom:
     return FALSE;
 }
 
+_Use_decl_annotations_
+SIZE_T
+RatelimiterTrimCache(BOOLEAN UnderPressure)
+{
+    return MemTrimCache(&EntryCache, UnderPressure);
+}
+
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, RatelimiterDriverEntry)
 #endif
@@ -172,8 +179,7 @@ _Use_decl_annotations_
 NTSTATUS
 RatelimiterDriverEntry(VOID)
 {
-    NTSTATUS Status =
-        ExInitializeLookasideListEx(&EntryCache, NULL, NULL, NonPagedPool, 0, sizeof(RATELIMITER_ENTRY), MEMORY_TAG, 0);
+    NTSTATUS Status = MemCacheInit(&EntryCache, sizeof(RATELIMITER_ENTRY));
     if (!NT_SUCCESS(Status))
         return Status;
     KeInitializeSpinLock(&TableLock);
@@ -190,7 +196,7 @@ RatelimiterDriverEntry(VOID)
     CryptoRandom(&Key, sizeof(Key));
     return STATUS_SUCCESS;
 cleanupEntryCache:
-    ExDeleteLookasideListEx(&EntryCache);
+    MemCacheDelete(&EntryCache);
     return Status;
 }
 
@@ -203,7 +209,7 @@ VOID RatelimiterUnload(VOID)
     ObDereferenceObject(RatelimiterGcEntriesThread.Thread);
     RatelimiterGcEntries(NULL);
     RcuBarrier();
-    ExDeleteLookasideListEx(&EntryCache);
+    MemCacheDelete(&EntryCache);
 }
 
 #ifdef DBG
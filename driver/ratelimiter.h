@@ -9,6 +9,10 @@ _IRQL_requires_max_(DISPATCH_LEVEL)
 BOOLEAN
 RatelimiterAllow(_In_ CONST SOCKADDR *Src);
 
+_IRQL_requires_max_(DISPATCH_LEVEL)
+SIZE_T
+RatelimiterTrimCache(_In_ BOOLEAN UnderPressure);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 NTSTATUS
 RatelimiterDriverEntry(VOID);
@@ -23,6 +23,22 @@ UpdateRxStats(_Inout_ WG_PEER *Peer, _In_ CONST ULONG Len)
     ++Peer->Device->Statistics.ifHCInUcastPkts;
 }
 
+/* Only one response can ever be consumed for a given initiation, so this is never racing itself for a peer. The
+ * smoothed value weighs in each new sample by 1/8, as TCP does.
+ */
+static VOID
+UpdateHandshakeRtt(_Inout_ WG_PEER *Peer)
+{
+    PEER_HANDSHAKE_STATS *Stats = &Peer->HandshakeStats;
+    LONG64 Rtt = (LONG64)KeQueryInterruptTime() - ReadNoFence64(&Stats->InitiationSent);
+    LONG64 MinRtt = ReadNoFence64(&Stats->MinRtt), SmoothedRtt = ReadNoFence64(&Stats->SmoothedRtt);
+
+    WriteNoFence64(&Stats->LastRtt, Rtt);
+    WriteNoFence64(&Stats->MinRtt, MinRtt && MinRtt < Rtt ? MinRtt : Rtt);
+    WriteNoFence64(&Stats->SmoothedRtt, SmoothedRtt ? SmoothedRtt + (Rtt - SmoothedRtt) / 8 : Rtt);
+    InterlockedIncrement(&Stats->HandshakesCompleted);
+}
+
 #define NBL_TYPE_LE32(Nbl) (((MESSAGE_HEADER *)MemGetValidatedNetBufferListData(Nbl))->Type)
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -110,6 +126,7 @@ ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
             LogInfoNblRatelimited(Wg, "Invalid handshake response from %s", Nbl);
             return;
         }
+        UpdateHandshakeRtt(Peer);
         SocketSetPeerEndpointFromNbl(Peer, Nbl);
         SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
         LogInfoRatelimited(Wg, "Receiving handshake response from peer %llu (%s)", Peer->InternalId, EndpointName);
@@ -143,18 +160,19 @@ ReceiveHandshakePacket(_Inout_ WG_DEVICE *Wg, _In_ NET_BUFFER_LIST *Nbl)
 }
 
 _Use_decl_annotations_
-VOID
-PacketHandshakeRxWorker(MULTICORE_WORKQUEUE *WorkQueue)
+BOOLEAN
+PacketHandshakeRxWork(WG_DEVICE *Wg, ULONG Budget)
 {
-    WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, HandshakeRxThreads);
-    NET_BUFFER_LIST *Nbl;
-
-    while ((Nbl = PtrRingConsume(&Wg->HandshakeRxQueue)) != NULL)
+    for (ULONG i = 0; i < Budget; ++i)
     {
+        NET_BUFFER_LIST *Nbl = PtrRingConsume(&Wg->HandshakeRxQueue);
+        if (!Nbl)
+            return FALSE;
         ReceiveHandshakePacket(Wg, Nbl);
         FreeReceiveNetBufferList(Nbl);
         InterlockedDecrement((LONG *)&Wg->HandshakeRxQueueLen);
     }
+    return TRUE;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -336,11 +354,25 @@ PacketConsumeDataDone(_Inout_ WG_PEER *Peer, _Inout_ NET_BUFFER_LIST *Nbl)
     LenBeforeTrim = NET_BUFFER_DATA_LENGTH(Nb);
     NET_BUFFER_DATA_LENGTH(Nb) = Len;
 
-    RoutedPeer = AllowedIpsLookupSrc(&Peer->Device->PeerAllowedIps, Proto, Hdr);
-    PeerPut(RoutedPeer); /* We don't need the extra reference. */
+    /* Every source address routes to the sole peer, if there is one, so there is nothing to look up. */
+    if (RcuAccessPointer(Peer->Device->SolePeer) != Peer)
+    {
+        RoutedPeer = AllowedIpsLookupSrc(&Peer->Device->PeerAllowedIps, Proto, Hdr);
+        PeerPut(RoutedPeer); /* We don't need the extra reference. */
+
+        if (RoutedPeer != Peer)
+            goto dishonestPacketPeer;
+    }
 
-    if (RoutedPeer != Peer)
-        goto dishonestPacketPeer;
+    if (RcuAccessPointer(Peer->Acl))
+    {
+        KIRQL Irql = RcuReadLock();
+        ACL_TABLE *Acl = RcuDereference(ACL_TABLE, Peer->Acl);
+        BOOLEAN Allowed = !Acl || AclAllowsNetBufferList(Acl, Nbl, Proto, TRUE);
+        RcuReadUnlock(Irql);
+        if (!Allowed)
+            goto deniedPacket;
+    }
 
     NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_SUCCESS;
     UpdateRxStats(Peer, MessageDataLen(LenBeforeTrim));
@@ -364,6 +396,11 @@ dishonestPacketSize:
     SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
     LogInfoRatelimited(Peer->Device, "Packet has incorrect size from peer %llu (%s)", Peer->InternalId, EndpointName);
     goto falsePacket;
+deniedPacket:
+    SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
+    LogInfoRatelimited(Peer->Device, "Packet from peer %llu (%s) denied by its ACL", Peer->InternalId, EndpointName);
+    ++Peer->Device->Statistics.ifInDiscards;
+    goto packetProcessed;
 falsePacket:
     ++Peer->Device->Statistics.ifInErrors;
     ++Peer->Device->Statistics.ifInDiscards;
@@ -437,31 +474,70 @@ ProcessPerPeerWork(PEER_SERIAL *WorkQueue)
             PacketPeerRxWork(CONTAINING_RECORD(Entry, WG_PEER, RxSerialEntry), PEER_XMIT_PACKETS_PER_ROUND));
 }
 
+/* Starts pulling in the lines that decrypting Nbl begins with, so that they arrive while the packet ahead of it is
+ * still being decrypted, rather than each packet stalling on its own buffer and keypair.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+PrefetchForDecrypt(_In_ NET_BUFFER_LIST *Nbl)
+{
+    CONST WSK_BUF *Buffer = &NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl)->Buffer;
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, MemGetValidatedNetBufferListData(Nbl));
+    if (Buffer->Mdl->MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL))
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (UCHAR *)Buffer->Mdl->MappedSystemVa + Buffer->Offset);
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &NET_BUFFER_LIST_KEYPAIR(Nbl)->Receiving);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PacketDecryptTransform(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, CONST SIMD_STATE *Simd)
+{
+    UNREFERENCED_PARAMETER(Engine);
+    return DecryptPacket(Simd, First, NET_BUFFER_LIST_KEYPAIR(First));
+}
+
+_Use_decl_annotations_
+VOID
+PacketDecryptComplete(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, BOOLEAN Success)
+{
+    UNREFERENCED_PARAMETER(Engine);
+    WG_PEER *Peer = NET_BUFFER_LIST_PEER(First);
+    QueueEnqueuePerPeer(
+        &Peer->Device->RxQueue, &Peer->RxSerialEntry, First, Success ? PACKET_STATE_CRYPTED : PACKET_STATE_DEAD);
+}
+
 _Use_decl_annotations_
 VOID
-PacketDecryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
+PacketDecryptNotify(CRYPTO_ENGINE *Engine)
+{
+    MulticoreWorkQueueBump(&CONTAINING_RECORD(Engine, WG_DEVICE, DecryptEngine)->Workers);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PacketDecryptWork(WG_DEVICE *Wg, CONST SIMD_STATE *Simd, ULONG Budget)
 {
-    WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, DecryptThreads);
     PTR_RING *Ring = &Wg->DecryptQueue;
-    NET_BUFFER_LIST *First;
-    SIMD_STATE Simd;
+    ULONG i;
 
-    SimdGet(&Simd);
-    while ((First = PtrRingConsume(Ring)) != NULL)
+    /* The ring is read one entry ahead, so that there is always a next packet to prefetch for. */
+    NET_BUFFER_LIST *Next = Budget ? PtrRingConsume(Ring) : NULL;
+    for (i = 0; Next && i < Budget; ++i)
     {
+        NET_BUFFER_LIST *First = Next;
+        Next = i + 1 < Budget ? PtrRingConsume(Ring) : NULL;
         for (NET_BUFFER_LIST *Nbl = First, *NextNbl; Nbl; Nbl = NextNbl)
         {
-            WG_PEER *Peer = NET_BUFFER_LIST_PEER(Nbl);
             NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
             NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
-            PACKET_STATE State =
-                DecryptPacket(&Simd, Nbl, NET_BUFFER_LIST_KEYPAIR(Nbl)) ? PACKET_STATE_CRYPTED : PACKET_STATE_DEAD;
-            QueueEnqueuePerPeer(&Wg->RxQueue, &Peer->RxSerialEntry, Nbl, State);
+            if (NextNbl || Next)
+                PrefetchForDecrypt(NextNbl ? NextNbl : Next);
+            CryptoEngineSubmit(&Wg->DecryptEngine, Nbl, Simd);
         }
         ProcessPerPeerWork(&Wg->RxQueue);
     }
-    SimdPut(&Simd);
     ProcessPerPeerWork(&Wg->RxQueue);
+    return i == Budget;
 }
 
 #pragma warning(suppress : 28194) /* `Nbl` is aliased in QueueEnqueuePerDeviceAndPeer, or QueueEnqueuePerPeer or freed \
@@ -481,8 +557,15 @@ PacketConsumeData(_Inout_ WG_DEVICE *Wg, _Inout_ __drv_aliasesMem NET_BUFFER_LIS
         NOISE_KEYPAIR *Keypair;
 
         KIRQL Irql = RcuReadLock();
-        NET_BUFFER_LIST_KEYPAIR(Nbl) = Keypair = NoiseKeypairGet(
-            (NOISE_KEYPAIR *)IndexHashtableLookup(Wg->IndexHashtable, INDEX_HASHTABLE_KEYPAIR, Message->KeyIdx, &Peer));
+        /* With a single peer, the index is nearly always one of its own keypairs, so look there before hashing. */
+        WG_PEER *SolePeer = RcuDereference(WG_PEER, Wg->SolePeer);
+        NOISE_KEYPAIR *Candidate = SolePeer ? NoiseKeypairsFind(&SolePeer->Keypairs, Message->KeyIdx) : NULL;
+        if (!Candidate)
+            Candidate = (NOISE_KEYPAIR *)IndexHashtableLookup(
+                Wg->IndexHashtable, INDEX_HASHTABLE_KEYPAIR, Message->KeyIdx, &Peer);
+        else if (!(Peer = PeerGetMaybeZero(SolePeer)))
+            Candidate = NULL;
+        NET_BUFFER_LIST_KEYPAIR(Nbl) = Keypair = NoiseKeypairGet(Candidate);
         RcuReadUnlock(Irql);
         if (!Keypair)
             goto cleanupNbl;
@@ -503,7 +586,7 @@ PacketConsumeData(_Inout_ WG_DEVICE *Wg, _Inout_ __drv_aliasesMem NET_BUFFER_LIS
         FreeReceiveNetBufferList(Nbl);
         PeerPut(Peer);
     }
-    if (FirstForDevice && !QueueEnqueuePerDevice(&Wg->DecryptQueue, &Wg->DecryptThreads, FirstForDevice))
+    if (FirstForDevice && !QueueEnqueuePerDevice(&Wg->DecryptQueue, &Wg->Workers, FirstForDevice))
     {
         for (NET_BUFFER_LIST *Nbl = FirstForDevice, *NextNbl; Nbl; Nbl = NextNbl)
         {
@@ -512,7 +595,7 @@ PacketConsumeData(_Inout_ WG_DEVICE *Wg, _Inout_ __drv_aliasesMem NET_BUFFER_LIS
             NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
             QueueEnqueuePerPeer(&Peer->Device->RxQueue, &Peer->RxSerialEntry, Nbl, PACKET_STATE_DEAD);
         }
-        MulticoreWorkQueueBump(&Wg->DecryptThreads);
+        MulticoreWorkQueueBump(&Wg->Workers);
     }
 }
 
@@ -587,7 +670,7 @@ PacketReceive(WG_DEVICE *Wg, NET_BUFFER_LIST *First)
                 goto cleanup;
             }
             InterlockedIncrement((LONG *)&Wg->HandshakeRxQueueLen);
-            MulticoreWorkQueueBump(&Wg->HandshakeRxThreads);
+            MulticoreWorkQueueBump(&Wg->Workers);
             break;
         }
         case CpuToLe32(MESSAGE_TYPE_DATA):
@@ -611,6 +694,9 @@ _Use_decl_annotations_
 VOID
 ReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST First, ULONG ReturnFlags)
 {
+    /* Packets mostly come back in runs from the same socket, so drop their references a run at a time. */
+    SOCKET *RunSocket = NULL;
+    ULONG RunLength = 0;
     for (NET_BUFFER_LIST *Nbl = First, *NextNbl; Nbl; Nbl = NextNbl)
     {
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
@@ -620,8 +706,17 @@ ReturnNetBufferLists(NDIS_HANDLE MiniportAdapterContext, PNET_BUFFER_LIST First,
         DatagramIndication->Next = NULL;
         ((WSK_PROVIDER_DATAGRAM_DISPATCH *)Socket->Sock->Dispatch)->WskRelease(Socket->Sock, DatagramIndication);
         MemFreeNetBufferList(Nbl);
-        ExReleaseRundownProtection(&Socket->ItemsInFlight);
+        if (Socket != RunSocket)
+        {
+            if (RunLength)
+                ExReleaseRundownProtectionCacheAwareEx(RunSocket->ItemsInFlight, RunLength);
+            RunSocket = Socket;
+            RunLength = 0;
+        }
+        ++RunLength;
     }
+    if (RunLength)
+        ExReleaseRundownProtectionCacheAwareEx(RunSocket->ItemsInFlight, RunLength);
 }
 
 _Use_decl_annotations_
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+static WG_IOCTL_ACL_RULE
+AclRule4(UINT8 A, UINT8 B, UINT8 C, UINT8 D, UINT8 Cidr, UINT8 Protocol, UINT16 PortLow, UINT16 PortHigh);
+static WG_IOCTL_ACL_RULE
+AclRule6(UINT32 A, UINT32 B, UINT32 C, UINT32 D, UINT8 Cidr, UINT8 Protocol, UINT16 PortLow, UINT16 PortHigh);
+static BOOLEAN
+AclTestPacket(
+    _In_ CONST ACL_TABLE *Acl,
+    _In_ ADDRESS_FAMILY Family,
+    _In_ UINT32 Addr,
+    _In_ UINT8 Protocol,
+    _In_ UINT16 Port,
+    _In_ BOOLEAN Fragment,
+    _In_ BOOLEAN Inbound);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, AclRule4)
+#    pragma alloc_text(INIT, AclRule6)
+#    pragma alloc_text(INIT, AclTestPacket)
+#    pragma alloc_text(INIT, AclSelftest)
+#endif
+
+static WG_IOCTL_ACL_RULE
+AclRule4(UINT8 A, UINT8 B, UINT8 C, UINT8 D, UINT8 Cidr, UINT8 Protocol, UINT16 PortLow, UINT16 PortHigh)
+{
+    WG_IOCTL_ACL_RULE Rule = { .AddressFamily = AF_INET,
+                               .Cidr = Cidr,
+                               .Protocol = Protocol,
+                               .PortLow = PortLow,
+                               .PortHigh = PortHigh };
+    UINT8 *Split = (UINT8 *)&Rule.Address.V4;
+    Split[0] = A;
+    Split[1] = B;
+    Split[2] = C;
+    Split[3] = D;
+    return Rule;
+}
+
+static WG_IOCTL_ACL_RULE
+AclRule6(UINT32 A, UINT32 B, UINT32 C, UINT32 D, UINT8 Cidr, UINT8 Protocol, UINT16 PortLow, UINT16 PortHigh)
+{
+    WG_IOCTL_ACL_RULE Rule = { .AddressFamily = AF_INET6,
+                               .Cidr = Cidr,
+                               .Protocol = Protocol,
+                               .PortLow = PortLow,
+                               .PortHigh = PortHigh };
+    UINT32_BE *Split = (UINT32_BE *)&Rule.Address.V6;
+    Split[0] = CpuToBe32(A);
+    Split[1] = CpuToBe32(B);
+    Split[2] = CpuToBe32(C);
+    Split[3] = CpuToBe32(D);
+    return Rule;
+}
+
+/* Builds a packet whose local address, that is the destination when Inbound and the source otherwise, is Addr for
+ * IPv4, or 2001:db8::Addr for IPv6, and whose local port is Port, and runs it through the ACL. IPv6 packets carry a
+ * hop-by-hop options header, and fragments of either family are past the first.
+ */
+static BOOLEAN
+AclTestPacket(
+    CONST ACL_TABLE *Acl,
+    ADDRESS_FAMILY Family,
+    UINT32 Addr,
+    UINT8 Protocol,
+    UINT16 Port,
+    BOOLEAN Fragment,
+    BOOLEAN Inbound)
+{
+    enum
+    {
+        PACKET_SIZE = sizeof(IPV6HDR) + 8 + 8 + 20
+    };
+    NET_BUFFER_LIST *Nbl = MemAllocateNetBufferList(0, PACKET_SIZE, 0);
+    if (!Nbl)
+        return FALSE;
+    UINT8 *Packet = MemGetValidatedNetBufferListData(Nbl);
+    RtlZeroMemory(Packet, PACKET_SIZE);
+    UINT16_BE Ports[2] = { Htons(40000), Htons(40000) };
+    Ports[Inbound ? 1 : 0] = Htons(Port);
+    UINT16_BE EthType;
+    ULONG Offset;
+
+    if (Family == AF_INET)
+    {
+        IPV4HDR *Hdr = (IPV4HDR *)Packet;
+        Hdr->Version = 4;
+        Hdr->Ihl = sizeof(*Hdr) / 4;
+        Hdr->Protocol = Protocol;
+        Hdr->FragOff = Htons(Fragment ? 0x2010 : 0x4000);
+        Hdr->Saddr = Hdr->Daddr = Htonl(0x0a000001);
+        *(Inbound ? &Hdr->Daddr : &Hdr->Saddr) = Htonl(Addr);
+        Offset = sizeof(*Hdr);
+        EthType = Htons(NDIS_ETH_TYPE_IPV4);
+    }
+    else
+    {
+        IPV6HDR *Hdr = (IPV6HDR *)Packet;
+        Hdr->Version = 6;
+        Hdr->Nexthdr = IPPROTO_HOPOPTS;
+        UINT32_BE *Local = (UINT32_BE *)(Inbound ? &Hdr->Daddr : &Hdr->Saddr);
+        Local[0] = Htonl(0x20010db8);
+        Local[3] = Htonl(Addr);
+        Offset = sizeof(*Hdr);
+        Packet[Offset] = Fragment ? IPPROTO_FRAGMENT : Protocol;
+        Offset += 8;
+        if (Fragment)
+        {
+            Packet[Offset] = Protocol;
+            Packet[Offset + 2] = 0x01;
+            Packet[Offset + 3] = 0x01;
+            Offset += 8;
+        }
+        EthType = Htons(NDIS_ETH_TYPE_IPV6);
+    }
+    RtlCopyMemory(Packet + Offset, Ports, sizeof(Ports));
+
+    KIRQL Irql = RcuReadLock();
+    BOOLEAN Allowed = AclAllowsNetBufferList(Acl, Nbl, EthType, Inbound);
+    RcuReadUnlock(Irql);
+    MemFreeNetBufferList(Nbl);
+    return Allowed;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+AclSelftest(VOID)
+{
+    WG_IOCTL_ACL_RULE Rules[WG_IOCTL_ACL_MAX_RULES];
+    ACL_TABLE *Acl = NULL;
+    BOOLEAN Success = TRUE;
+    ULONG i = 0, Test = 0;
+
+    Rules[i++] = AclRule4(192, 168, 1, 0, 24, IPPROTO_TCP, 443, 443);
+    Rules[i++] = AclRule4(192, 168, 0, 0, 16, IPPROTO_UDP, 1000, 2000);
+    Rules[i++] = AclRule4(10, 1, 2, 3, 32, 0, 0, MAXUINT16);
+    Rules[i++] = AclRule4(172, 16, 0, 0, 12, IPPROTO_ICMP, 0, MAXUINT16);
+    Rules[i++] = AclRule6(0x20010db8, 0, 0, 0x100, 120, IPPROTO_TCP, 22, 22);
+    Rules[i++] = AclRule6(0x20010db8, 0, 0, 0x200, 128, 0, 0, MAXUINT16);
+    Rules[i++] = AclRule4(10, 9, 0, 0, 16, 0, 53, 53);
+
+#define T(Expected, Family, Addr, Protocol, Port, Fragment, Inbound) \
+    do \
+    { \
+        ++Test; \
+        if (AclTestPacket(Acl, Family, Addr, Protocol, Port, Fragment, Inbound) != (Expected)) \
+        { \
+            LogDebug("acl self-test %lu: FAIL", Test); \
+            Success = FALSE; \
+        } \
+    } while (0)
+
+    if (!NT_SUCCESS(AclCompile(Rules, i, &Acl)))
+    {
+        LogDebug("acl self-test compile: FAIL");
+        return FALSE;
+    }
+
+    T(TRUE, AF_INET, 0xc0a80105, IPPROTO_TCP, 443, FALSE, TRUE);
+    T(TRUE, AF_INET, 0xc0a80105, IPPROTO_TCP, 443, FALSE, FALSE);
+    T(FALSE, AF_INET, 0xc0a80105, IPPROTO_TCP, 444, FALSE, TRUE);
+    T(FALSE, AF_INET, 0xc0a80205, IPPROTO_TCP, 443, FALSE, TRUE);
+    T(TRUE, AF_INET, 0xc0a80205, IPPROTO_UDP, 1000, FALSE, TRUE);
+    T(TRUE, AF_INET, 0xc0a8ff01, IPPROTO_UDP, 2000, FALSE, TRUE);
+    T(FALSE, AF_INET, 0xc0a8ff01, IPPROTO_UDP, 2001, FALSE, TRUE);
+    T(FALSE, AF_INET, 0xc0a90001, IPPROTO_UDP, 1500, FALSE, TRUE);
+    T(TRUE, AF_INET, 0x0a010203, IPPROTO_TCP, 1, FALSE, TRUE);
+    T(TRUE, AF_INET, 0x0a010203, IPPROTO_ICMP, 0, FALSE, TRUE);
+    T(FALSE, AF_INET, 0x0a010204, IPPROTO_ICMP, 0, FALSE, TRUE);
+    T(TRUE, AF_INET, 0xac1f0001, IPPROTO_ICMP, 0, FALSE, TRUE);
+    T(FALSE, AF_INET, 0xac200001, IPPROTO_ICMP, 0, FALSE, TRUE);
+    T(FALSE, AF_INET, 0xac1f0001, IPPROTO_TCP, 80, FALSE, TRUE);
+    /* The rule for 10.9.0.0/16 only covers port 53, so protocols without ports must not slip through it. */
+    T(TRUE, AF_INET, 0x0a090001, IPPROTO_UDP, 53, FALSE, TRUE);
+    T(FALSE, AF_INET, 0x0a090001, IPPROTO_ICMP, 0, FALSE, TRUE);
+    /* Fragments past the first are matched without their port. */
+    T(TRUE, AF_INET, 0xc0a80105, IPPROTO_TCP, 80, TRUE, TRUE);
+    T(FALSE, AF_INET, 0xc0a90105, IPPROTO_TCP, 443, TRUE, TRUE);
+
+    T(TRUE, AF_INET6, 0x1ff, IPPROTO_TCP, 22, FALSE, TRUE);
+    T(TRUE, AF_INET6, 0x100, IPPROTO_TCP, 22, FALSE, FALSE);
+    T(FALSE, AF_INET6, 0x1ff, IPPROTO_TCP, 23, FALSE, TRUE);
+    T(FALSE, AF_INET6, 0x1ff, IPPROTO_UDP, 22, FALSE, TRUE);
+    T(FALSE, AF_INET6, 0x0ff, IPPROTO_TCP, 22, FALSE, TRUE);
+    T(TRUE, AF_INET6, 0x200, IPPROTO_UDP, 9, FALSE, TRUE);
+    T(FALSE, AF_INET6, 0x201, IPPROTO_UDP, 9, FALSE, TRUE);
+    T(TRUE, AF_INET6, 0x1ff, IPPROTO_TCP, 80, TRUE, TRUE);
+    T(FALSE, AF_INET6, 0x2ff, IPPROTO_TCP, 22, TRUE, TRUE);
+    AclFree(Acl);
+
+    /* One rule covering all of IPv4 and IPv6 lets everything through. */
+    Rules[0] = AclRule4(0, 0, 0, 0, 0, 0, 0, MAXUINT16);
+    Rules[1] = AclRule6(0, 0, 0, 0, 0, 0, 0, MAXUINT16);
+    if (!NT_SUCCESS(AclCompile(Rules, 2, &Acl)))
+    {
+        LogDebug("acl self-test compile: FAIL");
+        return FALSE;
+    }
+    T(TRUE, AF_INET, 0xffffffff, IPPROTO_TCP, MAXUINT16, FALSE, TRUE);
+    T(TRUE, AF_INET, 0, IPPROTO_GRE, 0, FALSE, FALSE);
+    T(TRUE, AF_INET6, 0xffffffff, IPPROTO_UDP, 0, FALSE, TRUE);
+    AclFree(Acl);
+
+    /* Fill every slot so that the highest rule bit gets used too. */
+    for (i = 0; i < WG_IOCTL_ACL_MAX_RULES; ++i)
+        Rules[i] = AclRule4(10, 0, (UINT8)i, 0, 24, IPPROTO_UDP, (UINT16)(i * 100), (UINT16)(i * 100 + 9));
+    if (!NT_SUCCESS(AclCompile(Rules, WG_IOCTL_ACL_MAX_RULES, &Acl)))
+    {
+        LogDebug("acl self-test compile: FAIL");
+        return FALSE;
+    }
+    T(TRUE, AF_INET, 0x0a003f01, IPPROTO_UDP, 6305, FALSE, TRUE);
+    T(FALSE, AF_INET, 0x0a003f01, IPPROTO_UDP, 6205, FALSE, TRUE);
+    T(TRUE, AF_INET, 0x0a000001, IPPROTO_UDP, 0, FALSE, TRUE);
+    T(FALSE, AF_INET, 0x0a004001, IPPROTO_UDP, 0, FALSE, TRUE);
+    T(FALSE, AF_INET6, 0x100, IPPROTO_UDP, 0, FALSE, TRUE);
+    AclFree(Acl);
+
+#undef T
+
+    ++Test;
+    Rules[0] = AclRule4(10, 0, 0, 0, 33, 0, 0, MAXUINT16);
+    Rules[1] = AclRule6(0, 0, 0, 0, 0, 0, 2, 1);
+    if (NT_SUCCESS(AclCompile(Rules, 1, &Acl)) || NT_SUCCESS(AclCompile(Rules + 1, 1, &Acl)))
+    {
+        LogDebug("acl self-test %lu: FAIL", Test);
+        AclFree(Acl);
+        Success = FALSE;
+    }
+
+    if (Success)
+        LogDebug("acl self-tests: pass");
+    return Success;
+}
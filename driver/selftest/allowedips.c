@@ -8,11 +8,17 @@ Ip4(UINT8 A, UINT8 B, UINT8 C, UINT8 D);
 static inline IN6_ADDR *
 Ip6(UINT32 A, UINT32 B, UINT32 C, UINT32 D);
 static WG_PEER *InitPeer(VOID);
+static VOID
+TrieShape(_In_ ALLOWEDIPS_NODE *Root, _Out_ ULONG *Nodes, _Out_ ULONG *Depth);
+static ULONG
+CountEntries(_In_ WG_PEER *Peer);
 
 #ifdef ALLOC_PRAGMA
 #    pragma alloc_text(INIT, Ip4)
 #    pragma alloc_text(INIT, Ip6)
 #    pragma alloc_text(INIT, InitPeer)
+#    pragma alloc_text(INIT, TrieShape)
+#    pragma alloc_text(INIT, CountEntries)
 #    pragma alloc_text(INIT, AllowedIpsSelftest)
 #endif
 
@@ -50,9 +56,45 @@ static WG_PEER *InitPeer(VOID)
         return NULL;
     KrefInit(&Peer->Refcount);
     InitializeListHead(&Peer->AllowedIpsList);
+    InitializeListHead(&Peer->AllowedIpsDetachedList);
     return Peer;
 }
 
+#pragma warning(suppress : 6262) /* Using 1044 bytes of stack is still below 1280. */
+static VOID
+TrieShape(ALLOWEDIPS_NODE *Root, ULONG *Nodes, ULONG *Depth)
+{
+    ALLOWEDIPS_NODE *Node, *Stack[STACK_ENTRIES] = { Root };
+    ULONG Len = 1, Level;
+
+    *Nodes = *Depth = 0;
+    while (Len > 0 && (Node = Stack[--Len]) != NULL)
+    {
+        PushRcu(Stack, Node->Bit[0], &Len);
+        PushRcu(Stack, Node->Bit[1], &Len);
+        ++*Nodes;
+        for (Level = 1; (Node->ParentBitPacked & 3) <= 1; ++Level)
+            Node = ParentOf(Node);
+        *Depth = max(*Depth, Level);
+    }
+}
+
+static ULONG
+CountEntries(WG_PEER *Peer)
+{
+    ALLOWEDIPS_NODE *Node;
+    ULONG Count = 0;
+
+    LIST_FOR_EACH_ENTRY (Node, &Peer->AllowedIpsList, ALLOWEDIPS_NODE, PeerList)
+    {
+        if (AllowedIpsIsEntry(Node))
+            ++Count;
+    }
+    LIST_FOR_EACH_ENTRY (Node, &Peer->AllowedIpsDetachedList, ALLOWEDIPS_NODE, PeerList)
+        ++Count;
+    return Count;
+}
+
 #define Insert(Version, Mem, Ipa, Ipb, Ipc, Ipd, Cidr) \
     AllowedIpsInsertV##Version(&t, Ip##Version(Ipa, Ipb, Ipc, Ipd), Cidr, Mem, &Mutex)
 
@@ -100,6 +142,7 @@ AllowedIpsSelftest(VOID)
     ALLOWEDIPS_TABLE t;
     EX_PUSH_LOCK Mutex;
     SIZE_T i = 0, Count = 0;
+    ULONG Nodes, Depth, Octet;
     UINT64_BE Part;
     __declspec(align(8)) UINT8 Ip[16];
 
@@ -246,6 +289,52 @@ AllowedIpsSelftest(VOID)
     TestBoolean(FoundE);
     TestBoolean(!FoundOther);
 
+    /* 256 host routes of one peer, inserted out of order, end up as a single /24 node. Without aggregation, this
+     * would be 511 nodes, 9 deep.
+     */
+    AllowedIpsFree(&t, &Mutex);
+    AllowedIpsInit(&t);
+    for (Octet = 0; Octet < 256; ++Octet)
+        Insert(4, A, 10, 2, 0, (UINT8)(Octet * 167), 32);
+    TrieShape(RcuAccessPointer(t.Root4), &Nodes, &Depth);
+    LogDebug("allowedips self-test: 256 entries in %lu nodes, %lu deep", Nodes, Depth);
+    TestBoolean(Nodes == 1 && Depth == 1);
+    TestBoolean(CountEntries(A) == 256);
+    Test(4, A, 10, 2, 0, 0);
+    Test(4, A, 10, 2, 0, 255);
+    TestNegative(4, A, 10, 2, 1, 0);
+    /* Reinserting an entry that was aggregated away neither changes the trie nor duplicates the entry. */
+    Insert(4, A, 10, 2, 0, 42, 32);
+    TestBoolean(CountEntries(A) == 256);
+    /* Another peer taking over one of the entries splits the aggregate up again. */
+    Insert(4, B, 10, 2, 0, 77, 32);
+    TestBoolean(CountEntries(A) == 255);
+    Test(4, B, 10, 2, 0, 77);
+    Test(4, A, 10, 2, 0, 76);
+    Test(4, A, 10, 2, 0, 78);
+    /* A less specific route below is still shadowed by every host route. */
+    Insert(4, C, 10, 2, 0, 64, 28);
+    Test(4, A, 10, 2, 0, 65);
+    Test(4, B, 10, 2, 0, 77);
+    AllowedIpsRemoveByPeer(&t, A, &Mutex);
+    TestBoolean(IsListEmpty(&A->AllowedIpsList) && IsListEmpty(&A->AllowedIpsDetachedList));
+    Test(4, C, 10, 2, 0, 65);
+    Test(4, B, 10, 2, 0, 77);
+    TestNegative(4, A, 10, 2, 0, 1);
+    TestNegative(4, C, 10, 2, 0, 1);
+
+    AllowedIpsFree(&t, &Mutex);
+    AllowedIpsInit(&t);
+    Insert(4, A, 0, 0, 0, 0, 0);
+    TestBoolean(!AllowedIpsSolePeer(&t, &Mutex));
+    Insert(6, A, 0, 0, 0, 0, 0);
+    Insert(4, A, 10, 3, 0, 0, 16);
+    TestBoolean(AllowedIpsSolePeer(&t, &Mutex) == A);
+    Insert(4, B, 10, 3, 0, 1, 32);
+    TestBoolean(!AllowedIpsSolePeer(&t, &Mutex));
+    AllowedIpsRemoveByPeer(&t, B, &Mutex);
+    TestBoolean(AllowedIpsSolePeer(&t, &Mutex) == A);
+
     if (Success)
         LogDebug("allowedips self-tests: pass");
 
@@ -5098,6 +5098,27 @@ ChaCha20Poly1305Selftest(CONST SIMD_STATE *Simd)
             Success = FALSE;
         }
     }
+    for (ULONG Len = 0; Len <= CHACHA20POLY1305_PRECOMPUTED_LEN; ++Len)
+    {
+        CHACHA20POLY1305_PRECOMPUTED Precomputed;
+        UINT8 *Expected = ComputedOutput + CHACHA20POLY1305_PRECOMPUTED_LEN + POLY1305_MAC_SIZE;
+        for (ULONG i = 0; i < Len; ++i)
+            Input[i] = (UINT8)(i * 7 + Len);
+        LinkedMdls[0]->MappedSystemVa = Input;
+        LinkedMdls[0]->ByteCount = Len / 3;
+        LinkedMdls[1]->MappedSystemVa = Input + Len / 3;
+        LinkedMdls[1]->ByteCount = Len / 2 - Len / 3;
+        LinkedMdls[2]->MappedSystemVa = Input + Len / 2;
+        LinkedMdls[2]->ByteCount = Len - Len / 2;
+        ChaCha20Poly1305Encrypt(Expected, Input, Len, NULL, 0, Len + 1, EncKey001);
+        ChaCha20Poly1305Precompute(&Precomputed, Len + 1, EncKey001, Simd);
+        Ret = ChaCha20Poly1305EncryptMdlPrecomputed(ComputedOutput, LinkedMdls[0], Len, 0, &Precomputed, Simd);
+        if (!Ret || !RtlEqualMemory(ComputedOutput, Expected, Len + POLY1305_MAC_SIZE))
+        {
+            LogDebug("chacha20poly1305 precomputed encryption self-test %lu: FAIL", Len);
+            Success = FALSE;
+        }
+    }
     for (SIZE_T i = 0; i < ARRAYSIZE(ChaCha20Poly1305DecVectors); ++i)
     {
         RtlZeroMemory(ComputedOutput, MAXIMUM_TEST_BUFFER_LEN);
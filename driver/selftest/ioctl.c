@@ -0,0 +1,459 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+/* Drives SetInterface and GetConfiguration at scale on a device of its own, reporting wall time, how long the update
+ * lock was held, and roughly how much memory the peers and allowed IPs took. The defaults keep boot quick; define
+ * these higher, up to MAX_PEERS_PER_DEVICE peers, to size a deployment.
+ */
+#ifndef IOCTL_SCALE_TEST_MAX_PEERS
+#    define IOCTL_SCALE_TEST_MAX_PEERS 1000
+#endif
+#ifndef IOCTL_SCALE_TEST_MAX_ALLOWED_IPS
+#    define IOCTL_SCALE_TEST_MAX_ALLOWED_IPS 100000
+#endif
+
+enum
+{
+    IOCTL_SCALE_TEST_GETTERS = 2,
+    IOCTL_SCALE_TEST_CONCURRENT_SETS = 8,
+    IOCTL_SCALE_TEST_TRIE_LEVELS = 129
+};
+
+static CONST ULONG IoctlScaleTestPeers[] = { 1000, 10000, 100000, 1000000 };
+static CONST ULONG IoctlScaleTestAllowedIps[] = { 1, 10, 100 };
+
+typedef struct _IOCTL_SCALE_TEST
+{
+    WG_DEVICE *Wg;
+    ULONG NumPeers;
+    ULONG ConfigSize;
+    KEVENT Start;
+    LONG Running, Stop, Gets;
+} IOCTL_SCALE_TEST;
+
+typedef struct _IOCTL_SCALE_TEST_GETTER
+{
+    IOCTL_SCALE_TEST *Test;
+    WG_IOCTL_INTERFACE *Buffer;
+    PKTHREAD Thread;
+    ULONG Fallbacks, Torn;
+    LONG64 Time, Worst;
+} IOCTL_SCALE_TEST_GETTER;
+
+static KSTART_ROUTINE IoctlScaleTestGetter;
+static WG_DEVICE *
+IoctlScaleTestCreateDevice(VOID);
+static VOID
+IoctlScaleTestDestroyDevice(_In_ WG_DEVICE *Wg);
+static WG_IOCTL_INTERFACE *
+IoctlScaleTestBuild(
+    _In_ ULONG Generation,
+    _In_ ULONG NumPeers,
+    _In_ ULONG NumAllowedIps,
+    _In_ ULONG InterfaceFlags,
+    _In_ ULONG PeerFlags,
+    _Out_ ULONG *Size);
+static BOOLEAN
+IoctlScaleTestSet(
+    _Inout_ WG_DEVICE *Wg,
+    _In_ CONST WG_IOCTL_INTERFACE *IoctlInterface,
+    _In_ ULONG Size,
+    _Out_ LONG64 *Time,
+    _Out_ LONG64 *LockHeld);
+static ULONG64
+IoctlScaleTestMemory(_In_ WG_DEVICE *Wg);
+static ULONG64
+IoctlScaleTestUs(_In_ LONG64 Ticks);
+static BOOLEAN
+IoctlScaleTestRun(_In_ ULONG NumPeers, _In_ ULONG NumAllowedIps);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, IoctlScaleTestGetter)
+#    pragma alloc_text(INIT, IoctlScaleTestCreateDevice)
+#    pragma alloc_text(INIT, IoctlScaleTestDestroyDevice)
+#    pragma alloc_text(INIT, IoctlScaleTestBuild)
+#    pragma alloc_text(INIT, IoctlScaleTestSet)
+#    pragma alloc_text(INIT, IoctlScaleTestMemory)
+#    pragma alloc_text(INIT, IoctlScaleTestUs)
+#    pragma alloc_text(INIT, IoctlScaleTestRun)
+#    pragma alloc_text(INIT, IoctlScaleSelftest)
+#endif
+
+/* Every SET racing us leaves all peers and all of their allowed IPs in place, so a snapshot that holds anything else
+ * was torn.
+ */
+_Use_decl_annotations_
+static VOID
+IoctlScaleTestGetter(PVOID StartContext)
+{
+    IOCTL_SCALE_TEST_GETTER *Getter = StartContext;
+    IOCTL_SCALE_TEST *Test = Getter->Test;
+
+    KeWaitForSingleObject(&Test->Start, Executive, KernelMode, FALSE, NULL);
+    while (!ReadNoFence(&Test->Stop))
+    {
+        ULONG64 FinalSize;
+        LONG64 Begin = KeQueryPerformanceCounter(NULL).QuadPart;
+        if (GetConfiguration(Test->Wg, Getter->Buffer, Test->ConfigSize, &FinalSize) > GET_LOCKLESS_ATTEMPTS)
+            ++Getter->Fallbacks;
+        LONG64 Time = KeQueryPerformanceCounter(NULL).QuadPart - Begin;
+        Getter->Time += Time;
+        Getter->Worst = max(Getter->Worst, Time);
+        InterlockedIncrement(&Test->Gets);
+        if (FinalSize != Test->ConfigSize || Getter->Buffer->PeersCount != Test->NumPeers)
+            ++Getter->Torn;
+    }
+    InterlockedDecrement(&Test->Running);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* The device is never brought up, so it needs neither sockets, nor crypto engines, nor workers. */
+static WG_DEVICE *
+IoctlScaleTestCreateDevice(VOID)
+{
+    WG_DEVICE *Wg = MemAllocateAndZero(sizeof(*Wg));
+    if (!Wg)
+        return NULL;
+    LogRingInit(&Wg->Log);
+    MuInitializePushLock(&Wg->StaticIdentity.Lock);
+    MuInitializePushLock(&Wg->SocketUpdateLock);
+    MuInitializePushLock(&Wg->DeviceUpdateLock);
+    SeqcountInit(&Wg->ConfigSeq);
+    AllowedIpsInit(&Wg->PeerAllowedIps);
+    CookieCheckerInit(&Wg->CookieChecker, Wg);
+    InitializeListHead(&Wg->PeerList);
+    Wg->PeerHashtable = PubkeyHashtableAlloc();
+    Wg->IndexHashtable = IndexHashtableAlloc();
+    if (!Wg->PeerHashtable || !Wg->IndexHashtable)
+    {
+        MemFree(Wg->IndexHashtable);
+        MemFree(Wg->PeerHashtable);
+        MemFree(Wg);
+        return NULL;
+    }
+    return Wg;
+}
+
+static VOID
+IoctlScaleTestDestroyDevice(WG_DEVICE *Wg)
+{
+    MuAcquirePushLockExclusive(&Wg->DeviceUpdateLock);
+    PeerRemoveAll(Wg);
+    MuReleasePushLockExclusive(&Wg->DeviceUpdateLock);
+    RcuBarrier();
+    NoiseStaticIdentityClear(&Wg->StaticIdentity);
+    MemFree(Wg->IndexHashtable);
+    MemFree(Wg->PeerHashtable);
+    MemFree(Wg);
+}
+
+/* Peers and their allowed IPs are derived from the generation and their index, so that a later generation replaces
+ * all of them, and so that an IPv6 /128 of each never overlaps with any other peer's.
+ */
+static WG_IOCTL_INTERFACE *
+IoctlScaleTestBuild(
+    ULONG Generation,
+    ULONG NumPeers,
+    ULONG NumAllowedIps,
+    ULONG InterfaceFlags,
+    ULONG PeerFlags,
+    ULONG *Size)
+{
+    ULONG64 Size64 = sizeof(WG_IOCTL_INTERFACE) +
+                     (ULONG64)NumPeers * (sizeof(WG_IOCTL_PEER) + (ULONG64)NumAllowedIps * sizeof(WG_IOCTL_ALLOWED_IP));
+    *Size = 0;
+    if (Size64 > MAXULONG)
+        return NULL;
+    WG_IOCTL_INTERFACE *IoctlInterface = MemAllocateAndZero((SIZE_T)Size64);
+    if (!IoctlInterface)
+        return NULL;
+    *Size = (ULONG)Size64;
+
+    IoctlInterface->Flags = InterfaceFlags;
+    RtlFillMemory(IoctlInterface->PrivateKey, WG_KEY_LEN, (UCHAR)Generation);
+    IoctlInterface->PeersCount = NumPeers;
+    WG_IOCTL_PEER *IoctlPeer = (WG_IOCTL_PEER *)((UCHAR *)IoctlInterface + sizeof(WG_IOCTL_INTERFACE));
+    for (ULONG i = 0; i < NumPeers; ++i)
+    {
+        IoctlPeer->Flags = PeerFlags;
+        RtlFillMemory(IoctlPeer->PublicKey, WG_KEY_LEN, 0x5a);
+        IoctlPeer->PublicKey[0] = (UCHAR)Generation;
+        RtlCopyMemory(&IoctlPeer->PublicKey[1], &i, sizeof(i));
+        IoctlPeer->PersistentKeepalive = (USHORT)Generation;
+        IoctlPeer->AllowedIPsCount = NumAllowedIps;
+        WG_IOCTL_ALLOWED_IP *IoctlAllowedIp = (WG_IOCTL_ALLOWED_IP *)((UCHAR *)IoctlPeer + sizeof(WG_IOCTL_PEER));
+        for (ULONG j = 0; j < NumAllowedIps; ++j, ++IoctlAllowedIp)
+        {
+            IoctlAllowedIp->AddressFamily = AF_INET6;
+            IoctlAllowedIp->Cidr = 128;
+            IoctlAllowedIp->Address.V6.u.Byte[0] = 0xfd;
+            IoctlAllowedIp->Address.V6.u.Byte[1] = (UCHAR)Generation;
+            RtlCopyMemory(&IoctlAllowedIp->Address.V6.u.Byte[2], &i, sizeof(i));
+            RtlCopyMemory(&IoctlAllowedIp->Address.V6.u.Byte[6], &j, sizeof(USHORT));
+        }
+        IoctlPeer = (WG_IOCTL_PEER *)IoctlAllowedIp;
+    }
+    return IoctlInterface;
+}
+
+static BOOLEAN
+IoctlScaleTestSet(WG_DEVICE *Wg, CONST WG_IOCTL_INTERFACE *IoctlInterface, ULONG Size, LONG64 *Time, LONG64 *LockHeld)
+{
+    ULONG RemainingSize = Size;
+    LONG64 Begin = KeQueryPerformanceCounter(NULL).QuadPart;
+    NTSTATUS Status = SetInterface(Wg, IoctlInterface, &RemainingSize);
+    *Time = KeQueryPerformanceCounter(NULL).QuadPart - Begin;
+    *LockHeld = ReadNoFence64(&SetInterfaceLockHeld);
+    return NT_SUCCESS(Status) && !RemainingSize;
+}
+
+/* Counts what the peers and their allowed IPs hold: the peers themselves, every node of the tries, and every entry
+ * that was detached from them.
+ */
+static ULONG64
+IoctlScaleTestMemory(WG_DEVICE *Wg)
+{
+    ALLOWEDIPS_NODE *Stack[IOCTL_SCALE_TEST_TRIE_LEVELS + 2], *Node;
+    ULONG Depth = 0;
+    ULONG64 Nodes = 0;
+    WG_PEER *Peer;
+
+    MuAcquirePushLockShared(&Wg->DeviceUpdateLock);
+    if ((Node = RcuDereferenceProtected(ALLOWEDIPS_NODE, Wg->PeerAllowedIps.Root4, &Wg->DeviceUpdateLock)) != NULL)
+        Stack[Depth++] = Node;
+    if ((Node = RcuDereferenceProtected(ALLOWEDIPS_NODE, Wg->PeerAllowedIps.Root6, &Wg->DeviceUpdateLock)) != NULL)
+        Stack[Depth++] = Node;
+    /* Each level holds at most the sibling of the node being walked, plus the other root. */
+    while (Depth)
+    {
+        Node = Stack[--Depth];
+        ++Nodes;
+        for (ULONG i = 0; i < ARRAYSIZE(Node->Bit); ++i)
+        {
+            ALLOWEDIPS_NODE *Child = RcuDereferenceProtected(ALLOWEDIPS_NODE, Node->Bit[i], &Wg->DeviceUpdateLock);
+            if (Child)
+            {
+                NT_ASSERT(Depth < ARRAYSIZE(Stack));
+                Stack[Depth++] = Child;
+            }
+        }
+    }
+    LIST_FOR_EACH_ENTRY (Peer, &Wg->PeerList, WG_PEER, PeerList)
+    {
+        LIST_ENTRY *Entry;
+        for (Entry = Peer->AllowedIpsDetachedList.Flink; Entry != &Peer->AllowedIpsDetachedList; Entry = Entry->Flink)
+            ++Nodes;
+    }
+    ULONG64 Bytes = (ULONG64)Wg->NumPeers * sizeof(WG_PEER) + Nodes * sizeof(ALLOWEDIPS_NODE);
+    MuReleasePushLockShared(&Wg->DeviceUpdateLock);
+    return Bytes;
+}
+
+static ULONG64
+IoctlScaleTestUs(LONG64 Ticks)
+{
+    LARGE_INTEGER Frequency;
+    KeQueryPerformanceCounter(&Frequency);
+    return (ULONG64)Ticks * 1000000 / Frequency.QuadPart;
+}
+
+static BOOLEAN
+IoctlScaleTestRun(ULONG NumPeers, ULONG NumAllowedIps)
+{
+    IOCTL_SCALE_TEST *Test = MemAllocateAndZero(sizeof(*Test));
+    IOCTL_SCALE_TEST_GETTER Getters[IOCTL_SCALE_TEST_GETTERS] = { 0 };
+    WG_DEVICE *Wg = IoctlScaleTestCreateDevice();
+    ULONG ApplySize, ReplaceSize, UpdateSize, RotateSize, RemoveSize;
+    WG_IOCTL_INTERFACE *Apply = IoctlScaleTestBuild(
+        1,
+        NumPeers,
+        NumAllowedIps,
+        WG_IOCTL_INTERFACE_HAS_PRIVATE_KEY,
+        WG_IOCTL_PEER_HAS_PUBLIC_KEY | WG_IOCTL_PEER_REPLACE_ALLOWED_IPS,
+        &ApplySize);
+    WG_IOCTL_INTERFACE *Replace = IoctlScaleTestBuild(
+        2,
+        NumPeers,
+        NumAllowedIps,
+        WG_IOCTL_INTERFACE_REPLACE_PEERS,
+        WG_IOCTL_PEER_HAS_PUBLIC_KEY | WG_IOCTL_PEER_REPLACE_ALLOWED_IPS,
+        &ReplaceSize);
+    WG_IOCTL_INTERFACE *Update = IoctlScaleTestBuild(
+        2,
+        NumPeers,
+        0,
+        0,
+        WG_IOCTL_PEER_HAS_PUBLIC_KEY | WG_IOCTL_PEER_UPDATE_ONLY | WG_IOCTL_PEER_HAS_PERSISTENT_KEEPALIVE,
+        &UpdateSize);
+    WG_IOCTL_INTERFACE *Rotate = IoctlScaleTestBuild(3, 0, 0, WG_IOCTL_INTERFACE_HAS_PRIVATE_KEY, 0, &RotateSize);
+    WG_IOCTL_INTERFACE *Remove = IoctlScaleTestBuild(0, 0, 0, WG_IOCTL_INTERFACE_REPLACE_PEERS, 0, &RemoveSize);
+    BOOLEAN Success = FALSE;
+
+    if (!Test || !Wg || !Apply || !Replace || !Update || !Rotate || !Remove)
+    {
+        LogDebug("ioctl scale self-test malloc: FAIL");
+        goto cleanup;
+    }
+    Test->Wg = Wg;
+    Test->NumPeers = NumPeers;
+    Test->ConfigSize = ApplySize;
+    for (ULONG i = 0; i < IOCTL_SCALE_TEST_GETTERS; ++i)
+    {
+        Getters[i].Test = Test;
+        Getters[i].Buffer = MemAllocate(Test->ConfigSize);
+        if (!Getters[i].Buffer)
+        {
+            LogDebug("ioctl scale self-test malloc: FAIL");
+            goto cleanup;
+        }
+    }
+
+    LONG64 ApplyTime, ApplyLock;
+    if (!IoctlScaleTestSet(Wg, Apply, ApplySize, &ApplyTime, &ApplyLock) || Wg->NumPeers != NumPeers)
+    {
+        LogDebug("ioctl scale self-test %lu peers x %lu allowed IPs, apply: FAIL", NumPeers, NumAllowedIps);
+        goto cleanup;
+    }
+    ULONG64 Memory = IoctlScaleTestMemory(Wg);
+
+    ULONG64 FinalSize;
+    LONG64 GetTime = KeQueryPerformanceCounter(NULL).QuadPart;
+    GetConfiguration(Wg, Getters[0].Buffer, Test->ConfigSize, &FinalSize);
+    GetTime = KeQueryPerformanceCounter(NULL).QuadPart - GetTime;
+    if (FinalSize != Test->ConfigSize || Getters[0].Buffer->PeersCount != NumPeers)
+    {
+        LogDebug("ioctl scale self-test %lu peers x %lu allowed IPs, get: FAIL", NumPeers, NumAllowedIps);
+        goto cleanup;
+    }
+
+    LONG64 ReplaceTime, ReplaceLock, RotateTime, RotateLock;
+    if (!IoctlScaleTestSet(Wg, Replace, ReplaceSize, &ReplaceTime, &ReplaceLock) || Wg->NumPeers != NumPeers ||
+        !IoctlScaleTestSet(Wg, Rotate, RotateSize, &RotateTime, &RotateLock))
+    {
+        LogDebug("ioctl scale self-test %lu peers x %lu allowed IPs, replace: FAIL", NumPeers, NumAllowedIps);
+        goto cleanup;
+    }
+
+    /* Keep rotating the private key and updating every peer while GETs run, for at least as many GETs as getters. */
+    KeInitializeEvent(&Test->Start, NotificationEvent, FALSE);
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    for (ULONG i = 0; i < IOCTL_SCALE_TEST_GETTERS; ++i)
+    {
+        HANDLE Handle;
+        InterlockedIncrement(&Test->Running);
+        if (!NT_SUCCESS(PsCreateSystemThread(
+                &Handle, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, IoctlScaleTestGetter, &Getters[i])))
+        {
+            InterlockedDecrement(&Test->Running);
+            break;
+        }
+        ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &Getters[i].Thread, NULL);
+        ZwClose(Handle);
+    }
+    ULONG NumThreads = (ULONG)ReadNoFence(&Test->Running);
+    LONG64 SetWorst = 0, SetLockWorst = 0;
+    ULONG Sets;
+    Success = TRUE;
+    KeSetEvent(&Test->Start, IO_NO_INCREMENT, FALSE);
+    for (Sets = 0; Success && (Sets < IOCTL_SCALE_TEST_CONCURRENT_SETS || ReadNoFence(&Test->Gets) < (LONG)NumThreads);
+         ++Sets)
+    {
+        LONG64 Time, LockHeld;
+        RtlFillMemory(Rotate->PrivateKey, WG_KEY_LEN, (UCHAR)(Sets + 4));
+        Success = (Sets & 1) ? IoctlScaleTestSet(Wg, Update, UpdateSize, &Time, &LockHeld)
+                             : IoctlScaleTestSet(Wg, Rotate, RotateSize, &Time, &LockHeld);
+        SetWorst = max(SetWorst, Time);
+        SetLockWorst = max(SetLockWorst, LockHeld);
+    }
+    WriteNoFence(&Test->Stop, TRUE);
+    ULONG Fallbacks = 0, Torn = 0;
+    LONG64 GetsTime = 0, GetWorst = 0;
+    for (ULONG i = 0; i < IOCTL_SCALE_TEST_GETTERS; ++i)
+    {
+        if (!Getters[i].Thread)
+            continue;
+        KeWaitForSingleObject(Getters[i].Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Getters[i].Thread);
+        Fallbacks += Getters[i].Fallbacks;
+        Torn += Getters[i].Torn;
+        GetsTime += Getters[i].Time;
+        GetWorst = max(GetWorst, Getters[i].Worst);
+    }
+    if (!Success || NumThreads != IOCTL_SCALE_TEST_GETTERS || Torn || Wg->NumPeers != NumPeers)
+    {
+        LogDebug("ioctl scale self-test %lu peers x %lu allowed IPs, concurrent: FAIL", NumPeers, NumAllowedIps);
+        Success = FALSE;
+        goto cleanup;
+    }
+
+    LONG64 RemoveTime, RemoveLock;
+    if (!IoctlScaleTestSet(Wg, Remove, RemoveSize, &RemoveTime, &RemoveLock) || Wg->NumPeers)
+    {
+        LogDebug("ioctl scale self-test %lu peers x %lu allowed IPs, remove: FAIL", NumPeers, NumAllowedIps);
+        Success = FALSE;
+        goto cleanup;
+    }
+
+    LogDebug(
+        "ioctl scale self-test: %lu peers x %lu allowed IPs, %llu KiB: apply %llu us (lock %llu us), get %llu us, "
+        "replace %llu us (lock %llu us), key rotation %llu us (lock %llu us), removal %llu us (lock %llu us)",
+        NumPeers,
+        NumAllowedIps,
+        Memory / 1024,
+        IoctlScaleTestUs(ApplyTime),
+        IoctlScaleTestUs(ApplyLock),
+        IoctlScaleTestUs(GetTime),
+        IoctlScaleTestUs(ReplaceTime),
+        IoctlScaleTestUs(ReplaceLock),
+        IoctlScaleTestUs(RotateTime),
+        IoctlScaleTestUs(RotateLock),
+        IoctlScaleTestUs(RemoveTime),
+        IoctlScaleTestUs(RemoveLock));
+    LogDebug(
+        "ioctl scale self-test: %lu peers x %lu allowed IPs, %ld gets during %lu sets: average %llu us, worst %llu us, "
+        "%lu under the lock; worst set %llu us (lock %llu us)",
+        NumPeers,
+        NumAllowedIps,
+        ReadNoFence(&Test->Gets),
+        Sets,
+        IoctlScaleTestUs(GetsTime / max(ReadNoFence(&Test->Gets), 1)),
+        IoctlScaleTestUs(GetWorst),
+        Fallbacks,
+        IoctlScaleTestUs(SetWorst),
+        IoctlScaleTestUs(SetLockWorst));
+
+cleanup:
+    for (ULONG i = 0; i < IOCTL_SCALE_TEST_GETTERS; ++i)
+        MemFree(Getters[i].Buffer);
+    if (Wg)
+        IoctlScaleTestDestroyDevice(Wg);
+    MemFree(Remove);
+    MemFree(Rotate);
+    MemFree(Update);
+    MemFree(Replace);
+    MemFree(Apply);
+    MemFree(Test);
+    return Success;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+IoctlScaleSelftest(VOID)
+{
+    for (ULONG i = 0; i < ARRAYSIZE(IoctlScaleTestPeers); ++i)
+    {
+        for (ULONG j = 0; j < ARRAYSIZE(IoctlScaleTestAllowedIps); ++j)
+        {
+            if (IoctlScaleTestPeers[i] > IOCTL_SCALE_TEST_MAX_PEERS ||
+                (ULONG64)IoctlScaleTestPeers[i] * IoctlScaleTestAllowedIps[j] > IOCTL_SCALE_TEST_MAX_ALLOWED_IPS)
+                continue;
+            if (!IoctlScaleTestRun(IoctlScaleTestPeers[i], IoctlScaleTestAllowedIps[j]))
+                return FALSE;
+        }
+    }
+    LogDebug("ioctl scale self-tests: pass");
+    return TRUE;
+}
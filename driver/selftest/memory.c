@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+enum
+{
+    MEM_TRIM_TEST_ENTRY_SIZE = 64
+};
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, MemTrimSelftest)
+#endif
+_Use_decl_annotations_
+BOOLEAN
+MemTrimSelftest(VOID)
+{
+    MEM_CACHE Cache;
+    ULONG TestNum = 0;
+    BOOLEAN Success = TRUE;
+    VOID *Entry;
+
+    if (!NT_SUCCESS(MemCacheInit(&Cache, MEM_TRIM_TEST_ENTRY_SIZE)))
+    {
+        LogDebug("memory trim self-test lookaside: FAIL");
+        return FALSE;
+    }
+
+#define T(UnderPressure, Entries, State) \
+    do \
+    { \
+        ++TestNum; \
+        if (MemTrimCache(&Cache, UnderPressure) != (Entries) * MEM_TRIM_TEST_ENTRY_SIZE || Cache.Use != (State)) \
+        { \
+            LogDebug("memory trim self-test %u: FAIL", TestNum); \
+            Success = FALSE; \
+        } \
+    } while (0)
+#define Alloc() \
+    do \
+    { \
+        Entry = MemCacheAllocate(&Cache); \
+        if (!Entry) \
+        { \
+            LogDebug("memory trim self-test malloc: FAIL"); \
+            Success = FALSE; \
+            goto cleanup; \
+        } \
+        MemCacheFree(&Cache, Entry); \
+    } while (0)
+
+    /* A list that was never used is left alone. */
+    T(FALSE, 0, MEM_CACHE_FLUSHED);
+    /* The list was just in use, so it isn't idle yet, and keeps the entry that was freed into it. */
+    Alloc();
+    T(FALSE, 0, MEM_CACHE_QUIET);
+    /* Nothing happened for a whole period since, so it is flushed, and only once. */
+    T(FALSE, 1, MEM_CACHE_FLUSHED);
+    T(FALSE, 0, MEM_CACHE_FLUSHED);
+    /* Traffic in every period keeps it busy. */
+    Alloc();
+    T(FALSE, 0, MEM_CACHE_QUIET);
+    Alloc();
+    T(FALSE, 0, MEM_CACHE_QUIET);
+    /* But memory pressure flushes it regardless, and there is nothing left to release the second time. */
+    Alloc();
+    T(TRUE, 1, MEM_CACHE_FLUSHED);
+    T(TRUE, 0, MEM_CACHE_FLUSHED);
+    /* And it is still usable afterwards. */
+    Alloc();
+
+#undef Alloc
+#undef T
+
+    if (Success)
+        LogDebug("memory trim self-tests: pass");
+cleanup:
+    MemCacheDelete(&Cache);
+    return Success;
+}
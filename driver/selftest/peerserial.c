@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+enum
+{
+    PEER_SERIAL_TEST_ENTRIES = 16,
+    PEER_SERIAL_TEST_PRODUCERS = 4,
+    PEER_SERIAL_TEST_CONSUMERS = 4,
+    PEER_SERIAL_TEST_ROUNDS = 1 << 15
+};
+
+/* Producers add units of work to random entries and then enqueue them, the way QueueEnqueuePerPeer does, while
+ * consumers take entries, claim all of their work and retire them. Whatever the interleaving, no entry may ever be
+ * held by two consumers at once, and once everyone is done, every unit of work must have been claimed exactly once,
+ * with every entry idle. A lost requeue would show up as an idle entry with work left on it.
+ */
+typedef struct _PEER_SERIAL_TEST
+{
+    PEER_SERIAL Serial;
+    PEER_SERIAL_ENTRY Entries[PEER_SERIAL_TEST_ENTRIES];
+    LONG Work[PEER_SERIAL_TEST_ENTRIES];
+    LONG Held[PEER_SERIAL_TEST_ENTRIES];
+    KEVENT Start;
+    LONG ProducersRunning, ConsumersActive;
+    LONG64 Produced, Consumed;
+    LONG Overlaps;
+} PEER_SERIAL_TEST;
+
+typedef struct _PEER_SERIAL_TEST_THREAD
+{
+    PEER_SERIAL_TEST *Test;
+    ULONG Seed;
+    PKTHREAD Thread;
+} PEER_SERIAL_TEST_THREAD;
+
+static KSTART_ROUTINE PeerSerialTestProducer;
+static KSTART_ROUTINE PeerSerialTestConsumer;
+static BOOLEAN
+PeerSerialTestSingle(_Inout_ PEER_SERIAL_TEST *Test);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, PeerSerialTestProducer)
+#    pragma alloc_text(INIT, PeerSerialTestConsumer)
+#    pragma alloc_text(INIT, PeerSerialTestSingle)
+#    pragma alloc_text(INIT, PeerSerialSelftest)
+#endif
+
+_Use_decl_annotations_
+static VOID
+PeerSerialTestProducer(PVOID StartContext)
+{
+    PEER_SERIAL_TEST_THREAD *Thread = StartContext;
+    PEER_SERIAL_TEST *Test = Thread->Test;
+    ULONG Seed = Thread->Seed;
+
+    KeWaitForSingleObject(&Test->Start, Executive, KernelMode, FALSE, NULL);
+    for (ULONG i = 0; i < PEER_SERIAL_TEST_ROUNDS; ++i)
+    {
+        ULONG Index = RtlRandomEx(&Seed) % PEER_SERIAL_TEST_ENTRIES;
+        InterlockedIncrement(&Test->Work[Index]);
+        PeerSerialEnqueueIfNotBusy(&Test->Serial, &Test->Entries[Index], TRUE);
+    }
+    InterlockedAdd64(&Test->Produced, PEER_SERIAL_TEST_ROUNDS);
+    InterlockedDecrement(&Test->ProducersRunning);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+_Use_decl_annotations_
+static VOID
+PeerSerialTestConsumer(PVOID StartContext)
+{
+    PEER_SERIAL_TEST_THREAD *Thread = StartContext;
+    PEER_SERIAL_TEST *Test = Thread->Test;
+    ULONG Seed = Thread->Seed;
+
+    KeWaitForSingleObject(&Test->Start, Executive, KernelMode, FALSE, NULL);
+    for (;;)
+    {
+        BOOLEAN ProducersDone = !ReadNoFence(&Test->ProducersRunning);
+        InterlockedIncrement(&Test->ConsumersActive);
+        PEER_SERIAL_ENTRY *Entry = PeerSerialDequeue(&Test->Serial);
+        if (!Entry)
+        {
+            /* Only once nobody else holds an entry, and so can't requeue it, is an empty list really empty. */
+            if (!InterlockedDecrement(&Test->ConsumersActive) && ProducersDone)
+                break;
+            YieldProcessor();
+            continue;
+        }
+        ULONG Index = (ULONG)(Entry - Test->Entries);
+        if (InterlockedExchange(&Test->Held[Index], TRUE))
+            InterlockedIncrement(&Test->Overlaps);
+        InterlockedAdd64(&Test->Consumed, InterlockedExchange(&Test->Work[Index], 0));
+        /* Sometimes ask for another round, as PacketPeerTxWork does when it runs out of budget. */
+        BOOLEAN ForceMore = !(RtlRandomEx(&Seed) % 8);
+        InterlockedExchange(&Test->Held[Index], FALSE);
+        PeerSerialMaybeRetire(&Test->Serial, Entry, ForceMore);
+        InterlockedDecrement(&Test->ConsumersActive);
+    }
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+static BOOLEAN
+PeerSerialTestSingle(PEER_SERIAL_TEST *Test)
+{
+    PEER_SERIAL *Serial = &Test->Serial;
+    PEER_SERIAL_ENTRY *A = &Test->Entries[0], *B = &Test->Entries[1];
+
+    if (PeerSerialDequeue(Serial) || !PeerSerialEnqueueIfNotBusy(Serial, A, TRUE) ||
+        PeerSerialEnqueueIfNotBusy(Serial, A, TRUE) || PeerSerialDequeue(Serial) != A || PeerSerialDequeue(Serial))
+        return FALSE;
+    /* The second enqueue came while busy, so retiring must put it back once, and only once. */
+    if (!PeerSerialMaybeRetire(Serial, A, FALSE) || PeerSerialDequeue(Serial) != A ||
+        PeerSerialMaybeRetire(Serial, A, FALSE) || PeerSerialDequeue(Serial))
+        return FALSE;
+    /* Without requeueing, enqueueing a busy entry has no effect at all. */
+    if (!PeerSerialEnqueueIfNotBusy(Serial, A, TRUE) || !PeerSerialEnqueueIfNotBusy(Serial, B, TRUE) ||
+        PeerSerialEnqueueIfNotBusy(Serial, B, FALSE) || PeerSerialDequeue(Serial) != A ||
+        PeerSerialDequeue(Serial) != B || PeerSerialMaybeRetire(Serial, B, FALSE))
+        return FALSE;
+    /* Forcing another round requeues behind whatever is already there. */
+    if (!PeerSerialMaybeRetire(Serial, A, TRUE) || !PeerSerialEnqueueIfNotBusy(Serial, B, TRUE) ||
+        PeerSerialDequeue(Serial) != A || PeerSerialDequeue(Serial) != B || PeerSerialMaybeRetire(Serial, A, FALSE) ||
+        PeerSerialMaybeRetire(Serial, B, FALSE) || PeerSerialDequeue(Serial))
+        return FALSE;
+    return !A->State && !B->State;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PeerSerialSelftest(VOID)
+{
+    PEER_SERIAL_TEST *Test = MemAllocateAndZero(sizeof(*Test));
+    PEER_SERIAL_TEST_THREAD Threads[PEER_SERIAL_TEST_PRODUCERS + PEER_SERIAL_TEST_CONSUMERS] = { 0 };
+    BOOLEAN Success = FALSE;
+
+    if (!Test)
+    {
+        LogDebug("peer serial self-test malloc: FAIL");
+        return FALSE;
+    }
+
+    PeerSerialInit(&Test->Serial);
+    if (!PeerSerialTestSingle(Test))
+    {
+        LogDebug("peer serial self-test 1: FAIL");
+        goto cleanup;
+    }
+
+    KeInitializeEvent(&Test->Start, NotificationEvent, FALSE);
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    ULONG NumThreads;
+    for (NumThreads = 0; NumThreads < ARRAYSIZE(Threads); ++NumThreads)
+    {
+        HANDLE Handle;
+        Threads[NumThreads].Test = Test;
+        Threads[NumThreads].Seed = NumThreads + 1;
+        if (!NT_SUCCESS(PsCreateSystemThread(
+                &Handle,
+                THREAD_ALL_ACCESS,
+                &ObjectAttributes,
+                NULL,
+                NULL,
+                NumThreads < PEER_SERIAL_TEST_PRODUCERS ? PeerSerialTestProducer : PeerSerialTestConsumer,
+                &Threads[NumThreads])))
+            break;
+        ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &Threads[NumThreads].Thread, NULL);
+        ZwClose(Handle);
+    }
+    /* Nothing runs until Start is set, so consumers only ever wait for producers that actually exist. */
+    Test->ProducersRunning = min(NumThreads, PEER_SERIAL_TEST_PRODUCERS);
+
+    LARGE_INTEGER Frequency, Begin = KeQueryPerformanceCounter(&Frequency);
+    KeSetEvent(&Test->Start, IO_NO_INCREMENT, FALSE);
+    for (ULONG i = 0; i < NumThreads; ++i)
+    {
+        KeWaitForSingleObject(Threads[i].Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Threads[i].Thread);
+    }
+    LARGE_INTEGER End = KeQueryPerformanceCounter(NULL);
+
+    BOOLEAN Idle = TRUE;
+    for (ULONG i = 0; i < PEER_SERIAL_TEST_ENTRIES; ++i)
+        Idle &= !Test->Entries[i].State && !Test->Work[i];
+    if (NumThreads != ARRAYSIZE(Threads) || Test->Overlaps || !Idle || Test->Consumed != Test->Produced ||
+        PeerSerialDequeue(&Test->Serial))
+    {
+        LogDebug("peer serial self-test 2: FAIL");
+        goto cleanup;
+    }
+    LogDebug(
+        "peer serial self-test: %lu producers and %lu consumers passed %lld units of work in %llu us",
+        PEER_SERIAL_TEST_PRODUCERS,
+        PEER_SERIAL_TEST_CONSUMERS,
+        Test->Produced,
+        (End.QuadPart - Begin.QuadPart) * 1000000 / Frequency.QuadPart);
+    LogDebug("peer serial self-tests: pass");
+    Success = TRUE;
+
+cleanup:
+    MemFree(Test);
+    return Success;
+}
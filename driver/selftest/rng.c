@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+#include "../logging.h"
+
+#pragma data_seg("INITDATA")
+#pragma bss_seg("INITBSS")
+
+/* Starting from an all-zero key, the first output is the RFC7539 A.1 test vector #1 keystream, minus the leading
+ * CHACHA20_KEY_SIZE bytes which become the next key. After draining the rest of that stream, the following output is
+ * the keystream under that next key.
+ */
+
+static CONST UINT8 RngFirstOutput[] = {
+    0xda, 0x41, 0x59, 0x7c, 0x51, 0x57, 0x48, 0x8d, 0x77, 0x24, 0xe0, 0x3f, 0xb8, 0xd8, 0x4a, 0x37,
+    0x6a, 0x43, 0xb8, 0xf4, 0x15, 0x18, 0xa1, 0x1c, 0xc3, 0x87, 0xb6, 0x69, 0xb2, 0xee, 0x65, 0x86,
+    0x9f, 0x07, 0xe7, 0xbe, 0x55, 0x51, 0x38, 0x7a, 0x98, 0xba, 0x97, 0x7c, 0x73, 0x2d, 0x08, 0x0d,
+    0xcb, 0x0f, 0x29, 0xa0, 0x48, 0xe3, 0x65, 0x69, 0x12, 0xc6, 0x53, 0x3e, 0x32, 0xee, 0x7a, 0xed
+};
+static CONST UINT8 RngFirstKey[] = { 0x76, 0xb8, 0xe0, 0xad, 0xa0, 0xf1, 0x3d, 0x90, 0x40, 0x5d, 0x6a,
+                                     0xe5, 0x53, 0x86, 0xbd, 0x28, 0xbd, 0xd2, 0x19, 0xb8, 0xa0, 0x8d,
+                                     0xed, 0x1a, 0xa8, 0x36, 0xef, 0xcc, 0x8b, 0x77, 0x0d, 0xc7 };
+static CONST UINT8 RngSecondOutput[] = {
+    0xaf, 0xbd, 0xad, 0x28, 0x45, 0xb9, 0x3c, 0xdb, 0xb2, 0xfe, 0x64, 0x63, 0xd2, 0xfe, 0x16, 0x2a,
+    0xda, 0xe0, 0xf6, 0xe6, 0x76, 0xf0, 0x49, 0x42, 0x18, 0xf5, 0xce, 0x05, 0x96, 0xe7, 0x9f, 0x5c,
+    0x55, 0x1a, 0xaa, 0x9b, 0xa4, 0x6f, 0xaa, 0xd5, 0x28, 0xf6, 0x76, 0x3d, 0xde, 0x93, 0xc0, 0x3f,
+    0xa3, 0xb1, 0x21, 0xb2, 0xff, 0xc0, 0x53, 0x3a, 0x69, 0x5e, 0xd5, 0x6e, 0x8f, 0xda, 0x05, 0x89
+};
+static CONST UINT8 RngSecondKey[] = { 0xb0, 0xfd, 0x14, 0xff, 0x96, 0xa0, 0xbd, 0xa1, 0x54, 0xc3, 0x29,
+                                      0x08, 0x2c, 0x9c, 0x65, 0x33, 0xbb, 0x4c, 0x94, 0x73, 0xbf, 0x5d,
+                                      0xde, 0x13, 0x8f, 0x82, 0xc9, 0xac, 0x55, 0x53, 0xd9, 0x58 };
+
+#pragma data_seg()
+#pragma bss_seg()
+
+static BOOLEAN
+RngIsZero(CONST UINT8 *Buf, SIZE_T Len)
+{
+    UINT8 Acc = 0;
+    for (SIZE_T i = 0; i < Len; ++i)
+        Acc |= Buf[i];
+    return !Acc;
+}
+
+static BOOLEAN
+RngSelftest(VOID);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, RngIsZero)
+#    pragma alloc_text(INIT, RngSelftest)
+#endif
+
+static BOOLEAN
+RngSelftest(VOID)
+{
+    RNG_STATE Rng = { .Position = RNG_STREAM_SIZE };
+    UINT8 *Stream = (UINT8 *)Rng.Stream;
+    UINT8 Out[RNG_STREAM_SIZE], Other[CHACHA20_BLOCK_SIZE];
+    BOOLEAN Success = TRUE;
+
+    RngExtract(&Rng, Out, sizeof(RngFirstOutput));
+    if (!RtlEqualMemory(Out, RngFirstOutput, sizeof(RngFirstOutput)) ||
+        !RtlEqualMemory(Stream, RngFirstKey, sizeof(RngFirstKey)) ||
+        !RngIsZero(Stream + CHACHA20_KEY_SIZE, sizeof(RngFirstOutput)) ||
+        Rng.Position != CHACHA20_KEY_SIZE + sizeof(RngFirstOutput))
+    {
+        LogDebug("rng self-test 1: FAIL");
+        Success = FALSE;
+    }
+
+    RngExtract(&Rng, Out, RNG_STREAM_SIZE - Rng.Position);
+    if (!RngIsZero(Stream + CHACHA20_KEY_SIZE, RNG_STREAM_SIZE - CHACHA20_KEY_SIZE))
+    {
+        LogDebug("rng self-test 2: FAIL");
+        Success = FALSE;
+    }
+
+    RngExtract(&Rng, Out, sizeof(RngSecondOutput));
+    if (!RtlEqualMemory(Out, RngSecondOutput, sizeof(RngSecondOutput)) ||
+        !RtlEqualMemory(Stream, RngSecondKey, sizeof(RngSecondKey)))
+    {
+        LogDebug("rng self-test 3: FAIL");
+        Success = FALSE;
+    }
+
+    /* Reseeding must discard whatever was buffered under the old key. */
+    RngReseed(&Rng);
+    if (!Rng.Birthdate || Rng.Position != CHACHA20_KEY_SIZE ||
+        RtlEqualMemory(Stream, RngSecondKey, sizeof(RngSecondKey)))
+    {
+        LogDebug("rng self-test 4: FAIL");
+        Success = FALSE;
+    }
+
+    CryptoRandom(Out, sizeof(Other));
+    CryptoRandom(Other, sizeof(Other));
+    if (RtlEqualMemory(Out, Other, sizeof(Other)))
+    {
+        LogDebug("rng self-test 5: FAIL");
+        Success = FALSE;
+    }
+
+    RtlSecureZeroMemory(&Rng, sizeof(Rng));
+    if (Success)
+        LogDebug("rng self-tests: pass");
+    return Success;
+}
@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: GPL-2.0
+ *
+ * Copyright (C) 2015-2021 Jason A. Donenfeld <Jason@zx2c4.com>. All Rights Reserved.
+ */
+
+enum
+{
+    STAGED_QUEUE_TEST_CAPACITY = 64,
+    STAGED_QUEUE_TEST_PRODUCERS = 4,
+    STAGED_QUEUE_TEST_PACKETS = 1 << 12
+};
+
+typedef struct _STAGED_QUEUE_TEST
+{
+    NET_BUFFER_LIST_LOCKLESS_QUEUE Queue;
+    NET_BUFFER_LIST *Nbls;
+    KEVENT Start;
+    LONG Running, Full;
+    ULONG Next[STAGED_QUEUE_TEST_PRODUCERS];
+    ULONG Seen, Dropped;
+} STAGED_QUEUE_TEST;
+
+typedef struct _STAGED_QUEUE_TEST_PRODUCER
+{
+    STAGED_QUEUE_TEST *Test;
+    ULONG Index;
+    PKTHREAD Thread;
+} STAGED_QUEUE_TEST_PRODUCER;
+
+static KSTART_ROUTINE StagedQueueTestProducer;
+static BOOLEAN
+StagedQueueTestCheck(_Inout_ STAGED_QUEUE_TEST *Test, _In_ CONST NET_BUFFER_LIST_QUEUE *Packets);
+
+#ifdef ALLOC_PRAGMA
+#    pragma alloc_text(INIT, StagedQueueTestProducer)
+#    pragma alloc_text(INIT, StagedQueueTestCheck)
+#    pragma alloc_text(INIT, PacketStagedQueueSelftest)
+#endif
+
+_Use_decl_annotations_
+static VOID
+StagedQueueTestProducer(PVOID StartContext)
+{
+    STAGED_QUEUE_TEST_PRODUCER *Producer = StartContext;
+    STAGED_QUEUE_TEST *Test = Producer->Test;
+
+    KeWaitForSingleObject(&Test->Start, Executive, KernelMode, FALSE, NULL);
+    for (ULONG i = 0; i < STAGED_QUEUE_TEST_PACKETS; ++i)
+    {
+        if (NetBufferListLocklessEnqueue(&Test->Queue, &Test->Nbls[Producer->Index * STAGED_QUEUE_TEST_PACKETS + i]))
+            InterlockedIncrement(&Test->Full);
+    }
+    InterlockedDecrement(&Test->Running);
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* Every producer's packets must come out in the order it put them in, and never more than once. */
+static BOOLEAN
+StagedQueueTestCheck(STAGED_QUEUE_TEST *Test, CONST NET_BUFFER_LIST_QUEUE *Packets)
+{
+    ULONG Length = 0;
+    for (NET_BUFFER_LIST *Nbl = Packets->Head; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        ULONG Index = (ULONG)(Nbl - Test->Nbls);
+        ULONG Producer = Index / STAGED_QUEUE_TEST_PACKETS, Seq = Index % STAGED_QUEUE_TEST_PACKETS;
+        if (Producer >= STAGED_QUEUE_TEST_PRODUCERS || Seq < Test->Next[Producer])
+            return FALSE;
+        Test->Next[Producer] = Seq + 1;
+        ++Length;
+        if (!NET_BUFFER_LIST_NEXT_NBL(Nbl) && Nbl != Packets->Tail)
+            return FALSE;
+    }
+    Test->Seen += Length;
+    return Length == Packets->Length;
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PacketStagedQueueSelftest(VOID)
+{
+    STAGED_QUEUE_TEST *Test = MemAllocateAndZero(sizeof(*Test));
+    NET_BUFFER_LIST *Nbls =
+        MemAllocateArrayAndZero(STAGED_QUEUE_TEST_PRODUCERS * STAGED_QUEUE_TEST_PACKETS, sizeof(*Nbls));
+    STAGED_QUEUE_TEST_PRODUCER Producers[STAGED_QUEUE_TEST_PRODUCERS] = { 0 };
+    NET_BUFFER_LIST_QUEUE Packets;
+    BOOLEAN Success = FALSE;
+
+    if (!Test || !Nbls)
+    {
+        LogDebug("staged queue self-test malloc: FAIL");
+        goto cleanup;
+    }
+    Test->Nbls = Nbls;
+
+    /* A single producer going over capacity is told to drain, and draining keeps the newest packets, in order. */
+    NetBufferListLocklessInitQueue(&Test->Queue, 4);
+    ULONG Full = 0;
+    for (ULONG i = 0; i < 10; ++i)
+        Full += NetBufferListLocklessEnqueue(&Test->Queue, &Nbls[i]);
+    NET_BUFFER_LIST *Newest = NetBufferListLocklessDequeueAll(&Test->Queue);
+    NET_BUFFER_LIST_QUEUE Dropped;
+    NetBufferListReverseIntoQueue(&Dropped, NetBufferListLocklessTrimOldest(&Test->Queue, Newest));
+    NetBufferListReverseIntoQueue(&Packets, Newest);
+    if (Full != 7 || Newest != &Nbls[9] || Dropped.Head != &Nbls[0] || Dropped.Length != 6 ||
+        !StagedQueueTestCheck(Test, &Dropped) || Packets.Head != &Nbls[6] || Packets.Tail != &Nbls[9] ||
+        Packets.Length != 4 || !StagedQueueTestCheck(Test, &Packets) ||
+        !NetBufferListLocklessIsQueueEmpty(&Test->Queue))
+    {
+        LogDebug("staged queue self-test 1: FAIL");
+        goto cleanup;
+    }
+
+    /* Putting them back counts against capacity again, and puts them on top of what was queued in the meantime. */
+    if (NetBufferListLocklessEnqueue(&Test->Queue, &Nbls[10]))
+    {
+        LogDebug("staged queue self-test 2: FAIL");
+        goto cleanup;
+    }
+    NetBufferListReverseIntoQueue(&Packets, Packets.Head);
+    NetBufferListLocklessRequeueAll(&Test->Queue, Packets.Head, Packets.Tail, Packets.Length);
+    if (!NetBufferListLocklessEnqueue(&Test->Queue, &Nbls[11]) ||
+        (Newest = NetBufferListLocklessDequeueAll(&Test->Queue)) != &Nbls[11] ||
+        NetBufferListLocklessTrimOldest(&Test->Queue, Newest) != &Nbls[6] ||
+        NET_BUFFER_LIST_NEXT_NBL(&Nbls[6]) != &Nbls[10])
+    {
+        LogDebug("staged queue self-test 3: FAIL");
+        goto cleanup;
+    }
+    if (NetBufferListLocklessDequeueAll(&Test->Queue) || NetBufferListLocklessEnqueue(&Test->Queue, &Nbls[12]) ||
+        NetBufferListLocklessDequeueAll(&Test->Queue) != &Nbls[12])
+    {
+        LogDebug("staged queue self-test 4: FAIL");
+        goto cleanup;
+    }
+
+    /* Several producers hammer the queue while we drain it. Nothing may be lost, duplicated or reordered, and whatever
+     * is dropped to keep the queue at its capacity must be older than what is kept.
+     */
+    RtlZeroMemory(Test->Next, sizeof(Test->Next));
+    Test->Seen = 0;
+    NetBufferListLocklessInitQueue(&Test->Queue, STAGED_QUEUE_TEST_CAPACITY);
+    KeInitializeEvent(&Test->Start, NotificationEvent, FALSE);
+    OBJECT_ATTRIBUTES ObjectAttributes;
+    InitializeObjectAttributes(&ObjectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    for (ULONG i = 0; i < STAGED_QUEUE_TEST_PRODUCERS; ++i)
+    {
+        HANDLE Handle;
+        Producers[i].Test = Test;
+        Producers[i].Index = i;
+        InterlockedIncrement(&Test->Running);
+        if (!NT_SUCCESS(PsCreateSystemThread(
+                &Handle, THREAD_ALL_ACCESS, &ObjectAttributes, NULL, NULL, StagedQueueTestProducer, &Producers[i])))
+        {
+            InterlockedDecrement(&Test->Running);
+            break;
+        }
+        ObReferenceObjectByHandle(Handle, SYNCHRONIZE, NULL, KernelMode, &Producers[i].Thread, NULL);
+        ZwClose(Handle);
+    }
+
+    ULONG NumThreads = (ULONG)ReadNoFence(&Test->Running);
+    ULONG Drains = 0;
+    LARGE_INTEGER Frequency, Begin = KeQueryPerformanceCounter(&Frequency);
+    KeSetEvent(&Test->Start, IO_NO_INCREMENT, FALSE);
+    Success = TRUE;
+    for (BOOLEAN Done = FALSE; !Done;)
+    {
+        Done = !ReadNoFence(&Test->Running);
+        Newest = NetBufferListLocklessDequeueAll(&Test->Queue);
+        ++Drains;
+        if (!Newest)
+            continue;
+        NetBufferListReverseIntoQueue(&Dropped, NetBufferListLocklessTrimOldest(&Test->Queue, Newest));
+        NetBufferListReverseIntoQueue(&Packets, Newest);
+        Test->Dropped += Dropped.Length;
+        if (Packets.Length > STAGED_QUEUE_TEST_CAPACITY || !StagedQueueTestCheck(Test, &Dropped) ||
+            !StagedQueueTestCheck(Test, &Packets))
+            Success = FALSE;
+    }
+    LARGE_INTEGER End = KeQueryPerformanceCounter(NULL);
+
+    for (ULONG i = 0; i < STAGED_QUEUE_TEST_PRODUCERS; ++i)
+    {
+        if (!Producers[i].Thread)
+            continue;
+        KeWaitForSingleObject(Producers[i].Thread, Executive, KernelMode, FALSE, NULL);
+        ObDereferenceObject(Producers[i].Thread);
+    }
+    if (!Success || NumThreads != STAGED_QUEUE_TEST_PRODUCERS ||
+        Test->Seen != STAGED_QUEUE_TEST_PRODUCERS * STAGED_QUEUE_TEST_PACKETS)
+    {
+        LogDebug("staged queue self-test 5: FAIL");
+        Success = FALSE;
+        goto cleanup;
+    }
+    LogDebug(
+        "staged queue self-test: %lu producers queued %lu packets in %llu us, over %lu drains, dropped %lu after %ld "
+        "full enqueues",
+        NumThreads,
+        Test->Seen,
+        (End.QuadPart - Begin.QuadPart) * 1000000 / Frequency.QuadPart,
+        Drains,
+        Test->Dropped,
+        ReadNoFence(&Test->Full));
+    LogDebug("staged queue self-tests: pass");
+
+cleanup:
+    MemFree(Nbls);
+    MemFree(Test);
+    return Success;
+}
@@ -36,20 +36,21 @@ PacketSendHandshakeInitiation(_Inout_ WG_PEER *Peer)
         TimersAnyAuthenticatedPacketTraversal(Peer);
         TimersAnyAuthenticatedPacketSent(Peer);
         WriteNoFence64(&Peer->LastSentHandshake, KeQueryInterruptTime());
+        WriteNoFence64(&Peer->HandshakeStats.InitiationSent, ReadNoFence64(&Peer->LastSentHandshake));
         SocketSendBufferToPeer(Peer, &Packet, sizeof(Packet));
         TimersHandshakeInitiated(Peer);
     }
 }
 
 _Use_decl_annotations_
-VOID
-PacketHandshakeTxWorker(MULTICORE_WORKQUEUE *WorkQueue)
+BOOLEAN
+PacketHandshakeTxWork(WG_DEVICE *Wg, ULONG Budget)
 {
-    WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, HandshakeTxThreads);
-    PEER_SERIAL_ENTRY *Entry;
-
-    while ((Entry = PeerSerialDequeue(&Wg->HandshakeTxQueue)) != NULL)
+    for (ULONG i = 0; i < Budget; ++i)
     {
+        PEER_SERIAL_ENTRY *Entry = PeerSerialDequeue(&Wg->HandshakeTxQueue);
+        if (!Entry)
+            return FALSE;
         WG_PEER *Peer = CONTAINING_RECORD(Entry, WG_PEER, HandshakeTxSerialEntry);
         HANDSHAKE_TX_ACTION Action = InterlockedExchange16(&Peer->HandshakeTxAction, HANDSHAKE_TX_NONE);
 
@@ -67,6 +68,7 @@ PacketHandshakeTxWorker(MULTICORE_WORKQUEUE *WorkQueue)
             PeerPut(Peer);
         }
     }
+    return TRUE;
 }
 
 _Use_decl_annotations_
@@ -89,7 +91,7 @@ PacketSendQueuedHandshakeInitiation(WG_PEER *Peer, BOOLEAN IsRetry)
     WriteNoFence16(&Peer->HandshakeTxAction, HANDSHAKE_TX_SEND);
 
     if (PeerSerialEnqueueIfNotBusy(&Peer->Device->HandshakeTxQueue, &Peer->HandshakeTxSerialEntry, TRUE))
-        MulticoreWorkQueueBump(&Peer->Device->HandshakeTxThreads);
+        MulticoreWorkQueueBump(&Peer->Device->Workers);
     else
     {
         /* If the work was already on the queue, we want to drop the extra reference. */
@@ -185,25 +187,26 @@ EncryptPacket(
 {
     ULONG PaddingLen = CalculateNblPadding(NbIn, Mtu);
     UCHAR *OutBuffer = MemGetValidatedNetBufferData(NbOut);
-    *(MESSAGE_DATA *)OutBuffer = (MESSAGE_DATA){ .Header.Type = CpuToLe32(MESSAGE_TYPE_DATA),
-                                                 .KeyIdx = Keypair->RemoteIndex,
-                                                 .Counter = CpuToLe64(NET_BUFFER_NONCE(NbOut)) };
+    C_ASSERT(FIELD_OFFSET(MESSAGE_DATA, Counter) == sizeof(Keypair->SendingHeader));
+    *(UINT64 *)OutBuffer = Keypair->SendingHeader;
+    ((MESSAGE_DATA *)OutBuffer)->Counter = CpuToLe64(NET_BUFFER_NONCE(NbOut));
     OutBuffer += sizeof(MESSAGE_DATA);
 
     MDL *LastMdl = NULL, *OriginalNextMdl = NULL, PaddingMdl = { 0 };
     ULONG OriginalMdlLen = 0;
     if (PaddingLen)
     {
-        ULONG MdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(NbIn), Remaining = NET_BUFFER_DATA_LENGTH(NbIn), NeededLen = 0;
-        for (LastMdl = NET_BUFFER_CURRENT_MDL(NbIn);; LastMdl = LastMdl->Next)
+        ULONG MdlOffset = NET_BUFFER_CURRENT_MDL_OFFSET(NbIn), Remaining = NET_BUFFER_DATA_LENGTH(NbIn);
+        ULONG NeededLen = Remaining + MdlOffset;
+        /* Nearly always, the whole packet is in its first MDL, in which case there is nothing to walk. */
+        for (LastMdl = NET_BUFFER_CURRENT_MDL(NbIn); MmGetMdlByteCount(LastMdl) - MdlOffset < Remaining;)
         {
-            NeededLen = Remaining + MdlOffset;
-            Remaining -= min(MmGetMdlByteCount(LastMdl) - MdlOffset, Remaining);
-            if (!Remaining)
-                break;
+            Remaining -= MmGetMdlByteCount(LastMdl) - MdlOffset;
             MdlOffset = 0;
             if (!LastMdl->Next)
                 return FALSE;
+            LastMdl = LastMdl->Next;
+            NeededLen = Remaining;
         }
         OriginalMdlLen = MmGetMdlByteCount(LastMdl);
         OriginalNextMdl = LastMdl->Next;
@@ -217,16 +220,35 @@ EncryptPacket(
         LastMdl->ByteCount = NeededLen;
         NET_BUFFER_DATA_LENGTH(NbIn) += PaddingLen;
     }
-    BOOLEAN Ret = ChaCha20Poly1305EncryptMdl(
-        OutBuffer,
-        NET_BUFFER_CURRENT_MDL(NbIn),
-        NET_BUFFER_DATA_LENGTH(NbIn),
-        NET_BUFFER_CURRENT_MDL_OFFSET(NbIn),
-        NULL,
-        0,
-        NET_BUFFER_NONCE(NbOut),
-        Keypair->Sending.Key,
-        Simd);
+    BOOLEAN Ret;
+    NOISE_KEYSTREAM_CACHE *Keystream = Keypair->Keystream;
+    BOOLEAN Small = NET_BUFFER_DATA_LENGTH(NbIn) <= CHACHA20POLY1305_PRECOMPUTED_LEN;
+    NOISE_KEYSTREAM_SLOT *Slot =
+        Keystream && Small ? &Keystream->Slots[NET_BUFFER_NONCE(NbOut) % NOISE_KEYSTREAM_SLOTS] : NULL;
+    if (Slot && InterlockedCompareExchange64(&Slot->Nonce, NOISE_KEYSTREAM_BUSY, NET_BUFFER_NONCE(NbOut)) ==
+                    (LONG64)NET_BUFFER_NONCE(NbOut))
+    {
+        Ret = ChaCha20Poly1305EncryptMdlPrecomputed(
+            OutBuffer,
+            NET_BUFFER_CURRENT_MDL(NbIn),
+            NET_BUFFER_DATA_LENGTH(NbIn),
+            NET_BUFFER_CURRENT_MDL_OFFSET(NbIn),
+            &Slot->Precomputed,
+            Simd);
+        RtlSecureZeroMemory(&Slot->Precomputed, sizeof(Slot->Precomputed));
+        WriteRelease64(&Slot->Nonce, NOISE_KEYSTREAM_EMPTY);
+    }
+    else
+        Ret = ChaCha20Poly1305EncryptMdl(
+            OutBuffer,
+            NET_BUFFER_CURRENT_MDL(NbIn),
+            NET_BUFFER_DATA_LENGTH(NbIn),
+            NET_BUFFER_CURRENT_MDL_OFFSET(NbIn),
+            NULL,
+            0,
+            NET_BUFFER_NONCE(NbOut),
+            Keypair->Sending.Key,
+            Simd);
     NET_BUFFER_DATA_LENGTH(NbOut) = MessageDataLen(NET_BUFFER_DATA_LENGTH(NbIn));
     NET_BUFFER_DATA_OFFSET(NbOut) = NET_BUFFER_CURRENT_MDL_OFFSET(NbOut) = 0;
     if (PaddingLen)
@@ -245,13 +267,14 @@ PacketSendKeepalive(WG_PEER *Peer)
 {
     NET_BUFFER_LIST *Nbl;
 
-    if (NetBufferListIsQueueEmpty(&Peer->StagedPacketQueue))
+    if (NetBufferListLocklessIsQueueEmpty(&Peer->StagedPacketQueue))
     {
         Nbl = MemAllocateNetBufferList(0, 0, sizeof(MESSAGE_DATA) + NoiseEncryptedLen(0));
         if (!Nbl)
             return;
         Nbl->ParentNetBufferList = Nbl;
-        NetBufferListInterlockedEnqueue(&Peer->StagedPacketQueue, Nbl);
+        /* Whether this fills the queue doesn't matter, since it is drained right below. */
+        NetBufferListLocklessEnqueue(&Peer->StagedPacketQueue, Nbl);
         CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
         SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
         LogInfoRatelimited(Peer->Device, "Sending keepalive packet to peer %llu (%s)", Peer->InternalId, EndpointName);
@@ -315,45 +338,134 @@ ProcessPerPeerWork(PEER_SERIAL *WorkQueue)
             PacketPeerTxWork(CONTAINING_RECORD(Entry, WG_PEER, TxSerialEntry), PEER_XMIT_PACKETS_PER_ROUND));
 }
 
+/* Starts pulling in the lines that encrypting Nbl begins with, so that they arrive while the packet ahead of it is
+ * still being encrypted. The keypair only needs it when Nbl starts a chain of another peer.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static inline VOID
+PrefetchForEncrypt(_In_ NET_BUFFER_LIST *Nbl, _In_opt_ NOISE_KEYPAIR *Keypair)
+{
+    NET_BUFFER *NbIn = NET_BUFFER_LIST_FIRST_NB(Nbl->ParentNetBufferList);
+    CONST MDL *Mdl = NET_BUFFER_CURRENT_MDL(NbIn);
+    if (Mdl->MdlFlags & (MDL_MAPPED_TO_SYSTEM_VA | MDL_SOURCE_IS_NONPAGED_POOL))
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, (UCHAR *)Mdl->MappedSystemVa + NET_BUFFER_CURRENT_MDL_OFFSET(NbIn));
+    PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, MemGetValidatedNetBufferListData(Nbl));
+    if (Keypair)
+        PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, &Keypair->Sending);
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PacketEncryptTransform(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, CONST SIMD_STATE *Simd)
+{
+    WG_DEVICE *Wg = CONTAINING_RECORD(Engine, WG_DEVICE, EncryptEngine);
+    NOISE_KEYPAIR *Keypair = NET_BUFFER_LIST_KEYPAIR(First);
+    WG_PEER *Peer = NET_BUFFER_LIST_PEER(First);
+    ULONG Mtu = Peer->Endpoint.Addr.si_family == AF_INET6 ? Wg->Mtu6 : Wg->Mtu4;
+    BOOLEAN Success = TRUE;
+
+    for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        if (NET_BUFFER_LIST_NEXT_NBL(Nbl))
+            PrefetchForEncrypt(NET_BUFFER_LIST_NEXT_NBL(Nbl), NULL);
+        for (NET_BUFFER *NbIn = NET_BUFFER_LIST_FIRST_NB(Nbl->ParentNetBufferList),
+                        *NbOut = NET_BUFFER_LIST_FIRST_NB(Nbl);
+             NbIn && NbOut && Success;
+             NbIn = NET_BUFFER_NEXT_NB(NbIn), NbOut = NET_BUFFER_NEXT_NB(NbOut))
+        {
+            if (!EncryptPacket(Simd, NbOut, NbIn, Keypair, Mtu))
+                Success = FALSE;
+        }
+        if (Nbl != Nbl->ParentNetBufferList)
+        {
+            FreeSendNetBufferList(Wg, Nbl->ParentNetBufferList, 0);
+            Nbl->ParentNetBufferList = Nbl;
+        }
+    }
+    return Success;
+}
+
+_Use_decl_annotations_
+VOID
+PacketEncryptComplete(CRYPTO_ENGINE *Engine, NET_BUFFER_LIST *First, BOOLEAN Success)
+{
+    UNREFERENCED_PARAMETER(Engine);
+    WG_PEER *Peer = NET_BUFFER_LIST_PEER(First);
+    QueueEnqueuePerPeer(
+        &Peer->Device->TxQueue, &Peer->TxSerialEntry, First, Success ? PACKET_STATE_CRYPTED : PACKET_STATE_DEAD);
+}
+
 _Use_decl_annotations_
 VOID
-PacketEncryptWorker(MULTICORE_WORKQUEUE *WorkQueue)
+PacketEncryptNotify(CRYPTO_ENGINE *Engine)
+{
+    MulticoreWorkQueueBump(&CONTAINING_RECORD(Engine, WG_DEVICE, EncryptEngine)->Workers);
+}
+
+/* Fills the slots for the next few nonces of a keypair that is sending small packets. Any slot that isn't already
+ * holding one of those nonces is fair game, since its own nonce has either been used or skipped, and never will be.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static VOID
+PrecomputeKeystream(_Inout_ NOISE_KEYPAIR *Keypair, _In_ CONST SIMD_STATE *Simd)
+{
+    NOISE_KEYSTREAM_CACHE *Keystream = Keypair->Keystream;
+    if (!ReadBooleanNoFence(&Keypair->Sending.IsValid))
+        return;
+    LONG64 Next = ReadNoFence64(&Keypair->SendingCounter);
+    for (LONG64 Nonce = Next; Nonce < Next + NOISE_KEYSTREAM_SLOTS && (UINT64)Nonce < REJECT_AFTER_MESSAGES; ++Nonce)
+    {
+        NOISE_KEYSTREAM_SLOT *Slot = &Keystream->Slots[Nonce % NOISE_KEYSTREAM_SLOTS];
+        LONG64 Tag = ReadNoFence64(&Slot->Nonce);
+        if (Tag == NOISE_KEYSTREAM_BUSY || Tag >= Nonce ||
+            InterlockedCompareExchange64(&Slot->Nonce, NOISE_KEYSTREAM_BUSY, Tag) != Tag)
+            continue;
+        ChaCha20Poly1305Precompute(&Slot->Precomputed, Nonce, Keypair->Sending.Key, Simd);
+        WriteRelease64(&Slot->Nonce, Nonce);
+    }
+}
+
+_Use_decl_annotations_
+BOOLEAN
+PacketEncryptWork(WG_DEVICE *Wg, CONST SIMD_STATE *Simd, ULONG Budget)
 {
-    WG_DEVICE *Wg = CONTAINING_RECORD(WorkQueue, WG_DEVICE, EncryptThreads);
     PTR_RING *Ring = &Wg->EncryptQueue;
-    NET_BUFFER_LIST *First;
-    SIMD_STATE Simd;
+    NOISE_KEYPAIR *LastKeypair = NULL;
+    BOOLEAN LastSmall = FALSE;
+    ULONG i;
 
-    SimdGet(&Simd);
-    while ((First = PtrRingConsume(Ring)) != NULL)
+    /* The ring is read one entry ahead, so that the next chain's first packet and keypair can be prefetched. */
+    NET_BUFFER_LIST *Next = Budget ? PtrRingConsume(Ring) : NULL;
+    for (i = 0; Next && i < Budget; ++i)
     {
-        PACKET_STATE State = PACKET_STATE_CRYPTED;
+        NET_BUFFER_LIST *First = Next;
+        Next = i + 1 < Budget ? PtrRingConsume(Ring) : NULL;
+        if (Next)
+            PrefetchForEncrypt(Next, NET_BUFFER_LIST_KEYPAIR(Next));
         NOISE_KEYPAIR *Keypair = NET_BUFFER_LIST_KEYPAIR(First);
-        WG_PEER *Peer = NET_BUFFER_LIST_PEER(First);
-        ULONG Mtu = Peer->Endpoint.Addr.si_family == AF_INET6 ? Wg->Mtu6 : Wg->Mtu4;
-
-        for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+        if (Keypair->Keystream && Keypair != LastKeypair)
         {
-            for (NET_BUFFER *NbIn = NET_BUFFER_LIST_FIRST_NB(Nbl->ParentNetBufferList),
-                            *NbOut = NET_BUFFER_LIST_FIRST_NB(Nbl);
-                 NbIn && NbOut && State == PACKET_STATE_CRYPTED;
-                 NbIn = NET_BUFFER_NEXT_NB(NbIn), NbOut = NET_BUFFER_NEXT_NB(NbOut))
-            {
-                if (!EncryptPacket(&Simd, NbOut, NbIn, Keypair, Mtu))
-                    State = PACKET_STATE_DEAD;
-            }
-            if (Nbl != Nbl->ParentNetBufferList)
-            {
-                FreeSendNetBufferList(Wg, Nbl->ParentNetBufferList, 0);
-                Nbl->ParentNetBufferList = Nbl;
-            }
+            NoiseKeypairPut(LastKeypair, FALSE);
+            LastKeypair = NoiseKeypairGet(Keypair);
         }
-        _Analysis_assume_(First != NULL);
-        QueueEnqueuePerPeer(&Peer->Device->TxQueue, &Peer->TxSerialEntry, First, State);
+        /* Only the chain encrypted last decides whether to get ahead, so a chain for a keypair without a keystream
+         * cache must not leave the verdict of the one before it standing. */
+        LastSmall = Keypair == LastKeypair &&
+                    NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(First->ParentNetBufferList)) <=
+                        CHACHA20POLY1305_PRECOMPUTED_LEN;
+        CryptoEngineSubmit(&Wg->EncryptEngine, First, Simd);
         ProcessPerPeerWork(&Wg->TxQueue);
     }
-    SimdPut(&Simd);
+    /* With nothing left to encrypt, get ahead on whoever we encrypted for last. */
+    BOOLEAN More = i == Budget;
+    if (LastKeypair)
+    {
+        if (!More && LastSmall)
+            PrecomputeKeystream(LastKeypair, Simd);
+        NoiseKeypairPut(LastKeypair, FALSE);
+    }
     ProcessPerPeerWork(&Wg->TxQueue);
+    return More;
 }
 
 _IRQL_requires_max_(DISPATCH_LEVEL)
@@ -366,11 +478,11 @@ PacketCreateData(_Inout_ WG_PEER *Peer, _In_ NET_BUFFER_LIST *First)
     if (!ExAcquireRundownProtection(&Peer->InUse))
         goto cleanup;
 
-    Ret = QueueEnqueuePerDeviceAndPeer(&Wg->EncryptQueue, &Peer->TxQueue, &Wg->EncryptThreads, First);
+    Ret = QueueEnqueuePerDeviceAndPeer(&Wg->EncryptQueue, &Peer->TxQueue, &Wg->Workers, First);
     if (Ret == STATUS_PIPE_BROKEN)
     {
         QueueEnqueuePerPeer(&Peer->Device->TxQueue, &Peer->TxSerialEntry, First, PACKET_STATE_DEAD);
-        MulticoreWorkQueueBump(&Wg->EncryptThreads);
+        MulticoreWorkQueueBump(&Wg->Workers);
     }
     if (NT_SUCCESS(Ret) || Ret == STATUS_PIPE_BROKEN)
         return;
@@ -382,19 +494,43 @@ cleanup:
     PeerPut(Peer);
 }
 
+/* Staged packets start waiting when they first find no usable session, and stop when they are sent or given up on. */
+static inline VOID
+StagedWaitBegin(_Inout_ WG_PEER *Peer)
+{
+    InterlockedCompareExchange64(&Peer->HandshakeStats.StagedSince, KeQueryInterruptTime(), 0);
+}
+
+static inline VOID
+StagedWaitEnd(_Inout_ WG_PEER *Peer)
+{
+    if (!ReadNoFence64(&Peer->HandshakeStats.StagedSince))
+        return;
+    LONG64 Since = InterlockedExchange64(&Peer->HandshakeStats.StagedSince, 0);
+    if (Since)
+        InterlockedAdd64(&Peer->HandshakeStats.StagedWaitTime, (LONG64)KeQueryInterruptTime() - Since);
+}
+
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static VOID
+DiscardStagedPackets(_Inout_ WG_PEER *Peer, _In_opt_ __drv_aliasesMem NET_BUFFER_LIST *First)
+{
+    if (!First)
+        return;
+    for (NET_BUFFER_LIST *Nbl = First; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
+    {
+        NET_BUFFER_LIST_STATUS(Nbl) = NDIS_STATUS_FAILURE;
+        ++Peer->Device->Statistics.ifOutDiscards;
+    }
+    FreeSendNetBufferList(Peer->Device, First, SendCompleteFlagsForCurrentIrql());
+}
+
 _Use_decl_annotations_
 VOID
 PacketPurgeStagedPackets(WG_PEER *Peer)
 {
-    KIRQL Irql;
-
-    KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
-    Peer->Device->Statistics.ifOutDiscards += NetBufferListQueueLength(&Peer->StagedPacketQueue);
-    if (Peer->StagedPacketQueue.Head)
-        FreeSendNetBufferList(Peer->Device, Peer->StagedPacketQueue.Head, NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL);
-    Peer->StagedPacketQueue.Head = Peer->StagedPacketQueue.Tail = NULL;
-    Peer->StagedPacketQueue.Length = 0;
-    KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
+    StagedWaitEnd(Peer);
+    DiscardStagedPackets(Peer, NetBufferListLocklessDequeueAll(&Peer->StagedPacketQueue));
 }
 
 _Use_decl_annotations_
@@ -404,20 +540,19 @@ PacketSendStagedPackets(WG_PEER *Peer)
     NOISE_KEYPAIR *Keypair;
     NET_BUFFER_LIST_QUEUE Packets;
     PNET_BUFFER_LIST Nbl;
-    KIRQL Irql;
 
-    /* Steal the current queue into our local one. */
-    NetBufferListInitQueue(&Packets);
-    KeAcquireSpinLock(&Peer->StagedPacketQueue.Lock, &Irql);
-    _Analysis_suppress_lock_checking_(Packets.Lock); /* `Packets` is private, lock is not required. */
-    NetBufferListSpliceAndReinitQueue(&Peer->StagedPacketQueue, &Packets);
-    KeReleaseSpinLock(&Peer->StagedPacketQueue.Lock, Irql);
-    if (NetBufferListIsQueueEmpty(&Packets))
+    /* Steal the current queue into our local one. It comes newest first, and is only put in order once there is a key
+     * to send it with, since without one it just goes back as it is.
+     */
+    PNET_BUFFER_LIST Newest = NetBufferListLocklessDequeueAll(&Peer->StagedPacketQueue);
+    if (!Newest)
         return;
-    _Analysis_assume_(Packets.Head != NULL);
+
+    /* If the queue got too big while we were waiting on a handshake, drop the oldest packets until it's small again. */
+    DiscardStagedPackets(Peer, NetBufferListLocklessTrimOldest(&Peer->StagedPacketQueue, Newest));
 
     /* First we make sure we have a valid reference to a valid key. */
-    Irql = RcuReadLock();
+    KIRQL Irql = RcuReadLock();
     Keypair = NoiseKeypairGet(RcuDereference(NOISE_KEYPAIR, Peer->Keypairs.CurrentKeypair));
     RcuReadUnlock(Irql);
     if (!Keypair)
@@ -432,22 +567,29 @@ PacketSendStagedPackets(WG_PEER *Peer)
      * for all of them, we just consider it a failure and wait for the next
      * handshake.
      */
+    NetBufferListReverseIntoQueue(&Packets, Newest);
+    _Analysis_assume_(Packets.Head != NULL);
     for (Nbl = Packets.Head; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
         for (NET_BUFFER *Nb = NET_BUFFER_LIST_FIRST_NB(Nbl); Nb; Nb = NET_BUFFER_NEXT_NB(Nb))
         {
             NET_BUFFER_NONCE(Nb) = InterlockedIncrement64(&Keypair->SendingCounter) - 1;
             if (NET_BUFFER_NONCE(Nb) >= REJECT_AFTER_MESSAGES)
-                goto outInvalid;
+                goto outInvalidOrdered;
         }
     }
 
+    StagedWaitEnd(Peer);
     PeerGet(Keypair->Entry.Peer);
     _Analysis_assume_(NET_BUFFER_LIST_FIRST_NB(Packets.Head)); /* Checked in SendNetBufferLists(). */
     NET_BUFFER_LIST_KEYPAIR(Packets.Head) = Keypair;
     PacketCreateData(Peer, Packets.Head);
     return;
 
+outInvalidOrdered:
+    /* Nonces ran out part way, by which time the packets were already put in order, so turn them back around. */
+    NetBufferListReverseIntoQueue(&Packets, Packets.Head);
+    Newest = Packets.Head;
 outInvalid:
     WriteBooleanNoFence(&Keypair->Sending.IsValid, FALSE);
 outNokey:
@@ -455,17 +597,20 @@ outNokey:
 
     /* We orphan the packets if we're waiting on a handshake, so that they
      * don't block the pool of an upper layer. Then we put them back on the
-     * end of the queue. We're not too concerned about accidentally getting
+     * queue, all at once. We're not too concerned about accidentally getting
      * things a little out of order if packets are being added really fast,
      * because this queue is for before packets can even be sent and it's
      * small anyway.
      */
-    _Analysis_suppress_lock_checking_(Packets.Lock); /* `Packets` is private, lock is not required. */
-    while ((Nbl = NetBufferListDequeue(&Packets)) != NULL)
+    PNET_BUFFER_LIST Oldest = Newest;
+    ULONG Length = 0;
+    for (Nbl = Newest; Nbl; Nbl = NET_BUFFER_LIST_NEXT_NBL(Nbl))
     {
+        Oldest = Nbl;
+        ++Length;
         NT_ASSERT(Nbl->ParentNetBufferList);
         if (Nbl->ParentNetBufferList == Nbl)
-            goto requeueOrphan;
+            continue;
 
         for (NET_BUFFER *NbIn = NET_BUFFER_LIST_FIRST_NB(Nbl->ParentNetBufferList),
                         *NbOut = NET_BUFFER_LIST_FIRST_NB(Nbl);
@@ -481,9 +626,10 @@ outNokey:
         }
         FreeSendNetBufferList(Peer->Device, Nbl->ParentNetBufferList, 0);
         Nbl->ParentNetBufferList = Nbl;
-    requeueOrphan:
-        NetBufferListInterlockedEnqueue(&Peer->StagedPacketQueue, Nbl);
     }
+    NetBufferListLocklessRequeueAll(&Peer->StagedPacketQueue, Newest, Oldest, Length);
+
+    StagedWaitBegin(Peer);
 
     /* If we're exiting because there's something wrong with the key, it
      * means we should initiate a new handshake.
@@ -497,6 +643,7 @@ _Use_decl_annotations_
 VOID
 FreeSendNetBufferList(WG_DEVICE *Wg, NET_BUFFER_LIST *FirstNbl, ULONG SendCompleteFlags)
 {
+    ULONG Completed = 0;
     for (NET_BUFFER_LIST *Nbl = FirstNbl, *NextNbl; Nbl; Nbl = NextNbl)
     {
         NextNbl = NET_BUFFER_LIST_NEXT_NBL(Nbl);
@@ -507,7 +654,7 @@ FreeSendNetBufferList(WG_DEVICE *Wg, NET_BUFFER_LIST *FirstNbl, ULONG SendComple
             {
                 NET_BUFFER_LIST_STATUS(Nbl->ParentNetBufferList) = NET_BUFFER_LIST_STATUS(Nbl);
                 NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, Nbl->ParentNetBufferList, SendCompleteFlags);
-                ExReleaseRundownProtection(&Wg->ItemsInFlight);
+                ++Completed;
                 Nbl->ParentNetBufferList = NULL;
             }
             MemFreeNetBufferList(Nbl);
@@ -515,7 +662,13 @@ FreeSendNetBufferList(WG_DEVICE *Wg, NET_BUFFER_LIST *FirstNbl, ULONG SendComple
         else
         {
             NdisMSendNetBufferListsComplete(Wg->MiniportAdapterHandle, Nbl, SendCompleteFlags);
-            ExReleaseRundownProtection(&Wg->ItemsInFlight);
+            ++Completed;
         }
     }
+    if (Completed)
+        ExReleaseRundownProtectionCacheAwareEx(Wg->ItemsInFlight, Completed);
 }
+
+#ifdef DBG
+#    include "selftest/stagedqueue.c"
+#endif
@@ -32,7 +32,7 @@ static WSK_PROVIDER_NPI WskProviderNpi;
 static BOOLEAN WskHasIpv4Transport, WskHasIpv6Transport;
 static NTSTATUS WskInitStatus = STATUS_RETRY;
 static EX_PUSH_LOCK WskIsIniting;
-static LOOKASIDE_ALIGN LOOKASIDE_LIST_EX SocketSendCtxCache;
+static LOOKASIDE_ALIGN MEM_CACHE SocketSendCtxCache;
 
 #define NET_BUFFER_WSK_BUF(Nb) ((WSK_BUF_LIST *)&NET_BUFFER_MINIPORT_RESERVED(Nb)[0])
 static_assert(
@@ -64,7 +64,7 @@ NblSendComplete(DEVICE_OBJECT *DeviceObject, IRP *Irp, VOID *VoidCtx)
     SOCKET_SEND_CTX *Ctx = VoidCtx;
     _Analysis_assume_(Ctx);
     FreeSendNetBufferList(Ctx->Wg, Ctx->FirstNbl, 0);
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    MemCacheFree(&SocketSendCtxCache, Ctx);
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
@@ -76,7 +76,7 @@ BufferSendComplete(DEVICE_OBJECT *DeviceObject, IRP *Irp, VOID *VoidCtx)
     SOCKET_SEND_CTX *Ctx = VoidCtx;
     _Analysis_assume_(Ctx);
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    MemCacheFree(&SocketSendCtxCache, Ctx);
     return STATUS_MORE_PROCESSING_REQUIRED;
 }
 
@@ -309,7 +309,7 @@ SocketSendNblsToPeer(WG_PEER *Peer, NET_BUFFER_LIST *First, BOOLEAN *AllKeepaliv
     _Analysis_assume_(FirstWskBuf != NULL);
 
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = MemCacheAllocate(&SocketSendCtxCache);
     if (!Ctx)
         goto cleanupNbls;
     Ctx->FirstNbl = First;
@@ -361,7 +361,7 @@ cleanupRcuLock:
     RcuReadUnlockFromDpcLevel();
     ExReleaseSpinLockShared(&Peer->EndpointLock, Irql);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    MemCacheFree(&SocketSendCtxCache, Ctx);
 cleanupNbls:
     FreeSendNetBufferList(Peer->Device, First, 0);
     return Status;
@@ -374,7 +374,7 @@ NTSTATUS
 SocketSendBufferToPeer(WG_PEER *Peer, CONST VOID *Buffer, ULONG Len)
 {
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = MemCacheAllocate(&SocketSendCtxCache);
     if (!Ctx)
         return Status;
     Ctx->Buffer.Length = Len;
@@ -422,7 +422,7 @@ cleanupRcuLock:
 cleanupMdl:
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    MemCacheFree(&SocketSendCtxCache, Ctx);
     return Status;
 }
 
@@ -431,7 +431,7 @@ NTSTATUS
 SocketSendBufferAsReplyToNbl(WG_DEVICE *Wg, CONST NET_BUFFER_LIST *InNbl, CONST VOID *Buffer, ULONG Len)
 {
     NTSTATUS Status = STATUS_INSUFFICIENT_RESOURCES;
-    SOCKET_SEND_CTX *Ctx = ExAllocateFromLookasideListEx(&SocketSendCtxCache);
+    SOCKET_SEND_CTX *Ctx = MemCacheAllocate(&SocketSendCtxCache);
     if (!Ctx)
         return Status;
     Ctx->Buffer.Length = Len;
@@ -479,7 +479,7 @@ cleanupRcuLock:
 cleanupMdl:
     MemFreeDataAndMdlChain(Ctx->Buffer.Mdl);
 cleanupCtx:
-    ExFreeToLookasideListEx(&SocketSendCtxCache, Ctx);
+    MemCacheFree(&SocketSendCtxCache, Ctx);
     return Status;
 }
 
@@ -654,16 +654,22 @@ Receive(_In_opt_ PVOID SocketContext, _In_ ULONG Flags, _In_opt_ WSK_DATAGRAM_IN
         return STATUS_SUCCESS;
     WG_DEVICE *Wg = Socket->Device;
     NET_BUFFER_LIST *First = NULL, **Link = &First;
+
+    /* Take a reference for every datagram up front, and give back the ones we end up not keeping in one go. */
+    ULONG NumDatagrams = 0, Unused = 0;
+    for (WSK_DATAGRAM_INDICATION *Iter = DataIndication; Iter; Iter = Iter->Next)
+        ++NumDatagrams;
+    BOOLEAN Active = ExAcquireRundownProtectionCacheAwareEx(Socket->ItemsInFlight, NumDatagrams);
     for (WSK_DATAGRAM_INDICATION *DataIndicationNext; DataIndication; DataIndication = DataIndicationNext)
     {
         DataIndicationNext = DataIndication->Next;
         DataIndication->Next = NULL;
         NET_BUFFER_LIST *Nbl = NULL;
         ULONG Length;
-        if (!NT_SUCCESS(RtlSIZETToULong(DataIndication->Buffer.Length, &Length)))
+        if (!Active || !NT_SUCCESS(RtlSIZETToULong(DataIndication->Buffer.Length, &Length)))
             goto skipDatagramIndication;
         Nbl = MemAllocateNetBufferList(0, Length, 0);
-        if (!Nbl || !ReadBooleanNoFence(&Wg->IsUp) || !ExAcquireRundownProtection(&Socket->ItemsInFlight))
+        if (!Nbl || !ReadBooleanNoFence(&Wg->IsUp))
             goto skipDatagramIndication;
         NET_BUFFER_LIST_DATAGRAM_INDICATION(Nbl) = DataIndication;
         DataIndication->Next = (VOID *)Socket;
@@ -676,7 +682,10 @@ Receive(_In_opt_ PVOID SocketContext, _In_ ULONG Flags, _In_opt_ WSK_DATAGRAM_IN
         if (Nbl)
             MemFreeNetBufferList(Nbl);
         ++Wg->Statistics.ifInDiscards;
+        Unused += Active;
     }
+    if (Unused)
+        ExReleaseRundownProtectionCacheAwareEx(Socket->ItemsInFlight, Unused);
     if (First)
         PacketReceive(Wg, First);
     return STATUS_PENDING;
@@ -698,7 +707,7 @@ CloseSocket(_Frees_ptr_opt_ SOCKET *Socket)
 {
     if (!Socket)
         return;
-    ExWaitForRundownProtectionRelease(&Socket->ItemsInFlight);
+    ExWaitForRundownProtectionReleaseCacheAware(Socket->ItemsInFlight);
     if (!Socket->Sock)
         goto freeIt;
     KEVENT Done;
@@ -710,6 +719,7 @@ CloseSocket(_Frees_ptr_opt_ SOCKET *Socket)
     if (Status == STATUS_PENDING)
         KeWaitForSingleObject(&Done, Executive, KernelMode, FALSE, NULL);
 freeIt:
+    ExFreeCacheAwareRundownProtection(Socket->ItemsInFlight);
     MemFree(Socket);
 }
 
@@ -747,7 +757,12 @@ CreateAndBindSocket(_In_ WG_DEVICE *Wg, _Inout_ SOCKADDR *Sa, _Out_ SOCKET **Ret
         return Status;
     Socket->Device = Wg;
     Socket->Sock = NULL;
-    ExInitializeRundownProtection(&Socket->ItemsInFlight);
+    Socket->ItemsInFlight = ExAllocateCacheAwareRundownProtection(NonPagedPool, MEMORY_TAG);
+    if (!Socket->ItemsInFlight)
+    {
+        MemFree(Socket);
+        return Status;
+    }
     KEVENT Done;
     WSK_IRP I;
     KeInitializeEvent(&Done, SynchronizationEvent, FALSE);
@@ -855,8 +870,7 @@ static NTSTATUS WskInit(VOID)
         (OsVersionInfo.dwMajorVersion < 6 || (OsVersionInfo.dwMajorVersion == 6 && OsVersionInfo.dwMinorVersion < 2));
 #endif
 
-    Status = ExInitializeLookasideListEx(
-        &SocketSendCtxCache, NULL, NULL, NonPagedPool, 0, sizeof(SOCKET_SEND_CTX), MEMORY_TAG, 0);
+    Status = MemCacheInit(&SocketSendCtxCache, sizeof(SOCKET_SEND_CTX));
     if (!NT_SUCCESS(Status))
         goto cleanupIniting;
     WSK_CLIENT_NPI WskClientNpi = { .Dispatch = &WskAppDispatchV1 };
@@ -945,13 +959,27 @@ cleanupWskProviderNPI:
 cleanupWskRegister:
     WskDeregister(&WskRegistration);
 cleanupLookaside:
-    ExDeleteLookasideListEx(&SocketSendCtxCache);
+    MemCacheDelete(&SocketSendCtxCache);
 cleanupIniting:
     WriteNoFence(&WskInitStatus, Status);
     MuReleasePushLockExclusive(&WskIsIniting);
     return Status;
 }
 
+_Use_decl_annotations_
+SIZE_T
+SocketTrimCache(BOOLEAN UnderPressure)
+{
+    SIZE_T Released = 0;
+
+    /* The cache only exists once WSK is up, and WskUnload deletes it under the same lock. */
+    MuAcquirePushLockShared(&WskIsIniting);
+    if (ReadNoFence(&WskInitStatus) == STATUS_SUCCESS)
+        Released = MemTrimCache(&SocketSendCtxCache, UnderPressure);
+    MuReleasePushLockShared(&WskIsIniting);
+    return Released;
+}
+
 _Use_decl_annotations_
 VOID WskUnload(VOID)
 {
@@ -962,7 +990,7 @@ VOID WskUnload(VOID)
     CancelMibChangeNotify2(RouteNotifierV4);
     WskReleaseProviderNPI(&WskRegistration);
     WskDeregister(&WskRegistration);
-    ExDeleteLookasideListEx(&SocketSendCtxCache);
+    MemCacheDelete(&SocketSendCtxCache);
 out:
     MuReleasePushLockExclusive(&WskIsIniting);
 }
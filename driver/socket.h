@@ -11,7 +11,7 @@ typedef struct _SOCKET
 {
     WSK_SOCKET *Sock;
     WG_DEVICE *Device;
-    EX_RUNDOWN_REF ItemsInFlight;
+    EX_RUNDOWN_REF_CACHE_AWARE *ItemsInFlight;
 } SOCKET;
 
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -59,5 +59,9 @@ SocketReinit(
     _In_opt_ __drv_aliasesMem SOCKET *New6,
     _In_ UINT16 Port);
 
+_IRQL_requires_max_(APC_LEVEL)
+SIZE_T
+SocketTrimCache(_In_ BOOLEAN UnderPressure);
+
 _IRQL_requires_max_(PASSIVE_LEVEL)
 VOID WskUnload(VOID);
@@ -133,6 +133,7 @@ ExpiredRetransmitHandshake(TIMER *Timer)
     else
     {
         ++Peer->TimerHandshakeAttempts;
+        InterlockedIncrement(&Peer->HandshakeStats.Retransmits);
         CHAR EndpointName[SOCKADDR_STR_MAX_LEN];
         SockaddrToString(EndpointName, &Peer->Endpoint.Addr);
         LogInfo(
@@ -212,7 +213,7 @@ ExpiredZeroKeyMaterial(TIMER *Timer)
     WriteNoFence16(&Peer->HandshakeTxAction, HANDSHAKE_TX_CLEAR);
 
     if (PeerSerialEnqueueIfNotBusy(&Peer->Device->HandshakeTxQueue, &Peer->HandshakeTxSerialEntry, TRUE))
-        MulticoreWorkQueueBump(&Peer->Device->HandshakeTxThreads);
+        MulticoreWorkQueueBump(&Peer->Device->Workers);
     else
     {
         /* If the work was already on the queue, we want to drop the extra reference. */